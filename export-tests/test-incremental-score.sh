@@ -0,0 +1,119 @@
+#!/bin/bash
+
+# Check that generating the score files for an edited score from the
+# files for the version before the edit (as the application does when
+# a score it has opened before has changed) gives the same output as
+# generating them from scratch. The edit here fixes the pitch of the
+# note starting a tie, which changes whether the note the tie ends on,
+# in the next measure, is a new note
+
+set -e
+
+if [ -n "$1" ]; then
+    echo "Usage: $0" 1>&2
+    exit 2
+fi
+
+set -u
+
+compiler="../build/piano-precision-score-compiler"
+if [ ! -f "$compiler" -o ! -x "$compiler" ]; then
+    echo "This script must be run from the export-tests directory, with piano-precision-score-compiler built in ../build" 1>&2
+    exit 1
+fi
+
+tmpdir=$(mktemp -d)
+trap "rm -rf $tmpdir" 0
+
+write_score() {
+    local tiedpitch="$1"
+    local file="$2"
+    mkdir -p $(dirname "$file")
+    cat > "$file" <<EOF
+<?xml version="1.0" encoding="UTF-8"?>
+<mei xmlns="http://www.music-encoding.org/ns/mei" meiversion="5.0">
+  <meiHead>
+    <fileDesc>
+      <titleStmt><title>Tie test</title></titleStmt>
+      <pubStmt/>
+    </fileDesc>
+  </meiHead>
+  <music>
+    <body>
+      <mdiv>
+        <score>
+          <scoreDef meter.count="4" meter.unit="4">
+            <staffGrp>
+              <staffDef n="1" lines="5" clef.shape="G" clef.line="2"/>
+            </staffGrp>
+          </scoreDef>
+          <section>
+            <measure xml:id="m1" n="1">
+              <staff n="1"><layer n="1">
+                <note xml:id="n1" pname="c" oct="5" dur="2"/>
+                <note xml:id="n2" pname="$tiedpitch" oct="5" dur="2" tie="i"/>
+              </layer></staff>
+            </measure>
+            <measure xml:id="m2" n="2">
+              <staff n="1"><layer n="1">
+                <note xml:id="n3" pname="e" oct="5" dur="2" tie="t"/>
+                <note xml:id="n4" pname="g" oct="5" dur="2"/>
+              </layer></staff>
+            </measure>
+            <measure xml:id="m3" n="3">
+              <staff n="1"><layer n="1">
+                <note xml:id="n5" pname="c" oct="5" dur="1"/>
+              </layer></staff>
+            </measure>
+          </section>
+        </score>
+      </mdiv>
+    </body>
+  </music>
+</mei>
+EOF
+}
+
+write_score d "$tmpdir/before/tie-test.mei"
+write_score e "$tmpdir/after/tie-test.mei"
+
+"$compiler" -j 1 -o "$tmpdir/before-out" "$tmpdir/before" >/dev/null
+"$compiler" -j 1 -o "$tmpdir/full" "$tmpdir/after" >/dev/null
+"$compiler" -j 1 -o "$tmpdir/incremental" -p "$tmpdir/before-out" \
+            "$tmpdir/after" > "$tmpdir/incremental.txt"
+
+failure=no
+
+# The compiler reports the number of measures it took from the earlier
+# files in the fourth column of its output. The edit affects only the
+# first two measures, so unless the third was reused the comparison
+# below would pass just as well with everything read from scratch
+reused=$(cut -f4 "$tmpdir/incremental.txt" | cut -d' ' -f1)
+if [ "$reused" != "1" ]; then
+    echo "Incremental run reused \"$reused\" measures, expected 1:" 1>&2
+    cat "$tmpdir/incremental.txt" 1>&2
+    failure=yes
+fi
+
+if cmp -s "$tmpdir/before-out/tie-test.solo" "$tmpdir/full/tie-test.solo"; then
+    echo "Edit made no difference to the .solo file, so the test shows nothing" 1>&2
+    failure=yes
+fi
+
+for ext in solo meter; do
+    if ! cmp -s "$tmpdir/full/tie-test.$ext" \
+         "$tmpdir/incremental/tie-test.$ext"; then
+        echo "Incremental .$ext differs from full .$ext:" 1>&2
+        diff -u "$tmpdir/full/tie-test.$ext" \
+             "$tmpdir/incremental/tie-test.$ext" 1>&2 || true
+        failure=yes
+    fi
+done
+
+if [ "$failure" = "yes" ]; then
+    echo "Test failed"
+    exit 1
+else
+    echo "Test passed"
+    exit 0
+fi
@@ -0,0 +1,411 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "BinaryScoreFile.h"
+
+#include "base/Debug.h"
+
+#include <cstring>
+
+#include <QSaveFile>
+
+using std::string;
+using std::vector;
+
+static const char fileMagic[8] = { 'P', 'P', 'S', 'O', 'L', 'O', 'B', '\0' };
+static const uint32_t byteOrderMark = 0x01020304;
+
+struct BinaryScoreFile::Header {
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t noteCount;
+    uint32_t meterCount;
+    uint32_t sourceNoteCount;
+    uint32_t measureCount;
+    uint32_t reserved;
+    uint64_t notesOffset;
+    uint64_t metersOffset;
+    uint64_t sourceNotesOffset;
+    uint64_t measuresOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    int64_t ticksPerWhole;
+    uint64_t contextHash;
+};
+
+struct BinaryScoreFile::NoteRecord {
+    int32_t measureIndex;
+    int32_t pitch;
+    int64_t beat;
+    int64_t cumulative;
+    uint32_t idOffset;
+    uint32_t idLength;
+    int32_t velocity;
+    uint32_t reserved;
+};
+
+struct BinaryScoreFile::MeterRecord {
+    int32_t measureIndex;
+    int32_t numerator;
+    int32_t denominator;
+    uint32_t reserved;
+};
+
+struct BinaryScoreFile::SourceNoteRecord {
+    int32_t measureIndex;
+    int32_t pitch;
+    int64_t beat;
+    int64_t duration;
+    uint32_t idOffset;
+    uint32_t idLength;
+};
+
+struct BinaryScoreFile::MeasureRecord {
+    uint64_t hash;
+    uint32_t idOffset;
+    uint32_t idLength;
+    int32_t spanEnd;
+    uint32_t flags;
+};
+
+static const uint32_t measureChangesContext = 0x1;
+
+// The layout is the file format, so it must not depend on the compiler
+static_assert(sizeof(BinaryScoreFile::Header) == 104, "unexpected header size");
+static_assert(sizeof(BinaryScoreFile::NoteRecord) == 40, "unexpected note record size");
+static_assert(sizeof(BinaryScoreFile::MeterRecord) == 16, "unexpected meter record size");
+static_assert(sizeof(BinaryScoreFile::SourceNoteRecord) == 32, "unexpected source note record size");
+static_assert(sizeof(BinaryScoreFile::MeasureRecord) == 24, "unexpected measure record size");
+
+bool
+BinaryScoreFile::write(string path, int64_t ticksPerWhole,
+                       const vector<Note> &notes,
+                       const vector<Meter> &meters,
+                       const vector<SourceNote> &sourceNotes,
+                       const MeiMeasureTable &measureTable)
+{
+    const vector<MeiMeasureTable::Measure> &measures =
+        measureTable.getMeasures();
+    
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, fileMagic, sizeof(fileMagic));
+    header.byteOrder = byteOrderMark;
+    header.version = version;
+    header.headerSize = sizeof(Header);
+    header.noteCount = uint32_t(notes.size());
+    header.meterCount = uint32_t(meters.size());
+    header.sourceNoteCount = uint32_t(sourceNotes.size());
+    header.measureCount = uint32_t(measures.size());
+    header.notesOffset = sizeof(Header);
+    header.metersOffset = header.notesOffset + notes.size() * sizeof(NoteRecord);
+    header.sourceNotesOffset = header.metersOffset + meters.size() * sizeof(MeterRecord);
+    header.measuresOffset = header.sourceNotesOffset + sourceNotes.size() * sizeof(SourceNoteRecord);
+    header.stringsOffset = header.measuresOffset + measures.size() * sizeof(MeasureRecord);
+    header.ticksPerWhole = ticksPerWhole;
+    header.contextHash = measureTable.getContextHash();
+
+    vector<NoteRecord> noteRecords(notes.size());
+    string strings;
+    for (size_t i = 0; i < notes.size(); ++i) {
+        const Note &note = notes[i];
+        NoteRecord &record = noteRecords[i];
+        memset(&record, 0, sizeof(record));
+        record.measureIndex = note.measureIndex;
+        record.pitch = note.pitch;
+        record.beat = note.beat;
+        record.cumulative = note.cumulative;
+        record.velocity = note.velocity;
+        record.idOffset = uint32_t(strings.size());
+        record.idLength = uint32_t(note.noteId.size());
+        strings.append(note.noteId);
+    }
+
+    vector<MeterRecord> meterRecords(meters.size());
+    for (size_t i = 0; i < meters.size(); ++i) {
+        MeterRecord &record = meterRecords[i];
+        memset(&record, 0, sizeof(record));
+        record.measureIndex = meters[i].measureIndex;
+        record.numerator = meters[i].numerator;
+        record.denominator = meters[i].denominator;
+    }
+
+    vector<SourceNoteRecord> sourceNoteRecords(sourceNotes.size());
+    for (size_t i = 0; i < sourceNotes.size(); ++i) {
+        const SourceNote &note = sourceNotes[i];
+        SourceNoteRecord &record = sourceNoteRecords[i];
+        memset(&record, 0, sizeof(record));
+        record.measureIndex = note.measureIndex;
+        record.pitch = note.pitch;
+        record.beat = note.beat;
+        record.duration = note.duration;
+        record.idOffset = uint32_t(strings.size());
+        record.idLength = uint32_t(note.noteId.size());
+        strings.append(note.noteId);
+    }
+
+    vector<MeasureRecord> measureRecords(measures.size());
+    for (size_t i = 0; i < measures.size(); ++i) {
+        const MeiMeasureTable::Measure &measure = measures[i];
+        MeasureRecord &record = measureRecords[i];
+        memset(&record, 0, sizeof(record));
+        record.hash = measure.hash;
+        record.spanEnd = measure.spanEnd;
+        record.flags = (measure.changesContext ? measureChangesContext : 0);
+        record.idOffset = uint32_t(strings.size());
+        record.idLength = uint32_t(measure.id.size());
+        strings.append(measure.id);
+    }
+    
+    header.stringsSize = strings.size();
+
+    // QSaveFile writes to a temporary file and only replaces the
+    // target on commit, so a failed write leaves nothing behind
+    QSaveFile file(QString::fromStdString(path));
+    if (!file.open(QIODevice::WriteOnly)) {
+        SVDEBUG << "BinaryScoreFile::write: Failed to open \"" << path
+                << "\" for writing: " << file.errorString() << endl;
+        return false;
+    }
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(noteRecords.data()),
+               noteRecords.size() * sizeof(NoteRecord));
+    file.write(reinterpret_cast<const char *>(meterRecords.data()),
+               meterRecords.size() * sizeof(MeterRecord));
+    file.write(reinterpret_cast<const char *>(sourceNoteRecords.data()),
+               sourceNoteRecords.size() * sizeof(SourceNoteRecord));
+    file.write(reinterpret_cast<const char *>(measureRecords.data()),
+               measureRecords.size() * sizeof(MeasureRecord));
+    file.write(strings.data(), strings.size());
+
+    if (!file.commit()) {
+        SVDEBUG << "BinaryScoreFile::write: Failed to write \"" << path
+                << "\": " << file.errorString() << endl;
+        return false;
+    }
+
+    return true;
+}
+
+BinaryScoreFile::BinaryScoreFile() :
+    m_data(nullptr),
+    m_header(nullptr),
+    m_notes(nullptr),
+    m_meters(nullptr),
+    m_sourceNotes(nullptr),
+    m_measures(nullptr),
+    m_strings(nullptr)
+{
+}
+
+BinaryScoreFile::~BinaryScoreFile()
+{
+    close();
+}
+
+bool
+BinaryScoreFile::open(string path)
+{
+    close();
+
+    m_file.setFileName(QString::fromStdString(path));
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        SVDEBUG << "BinaryScoreFile::open: Failed to open \"" << path
+                << "\": " << m_file.errorString() << endl;
+        return false;
+    }
+
+    uint64_t size = uint64_t(m_file.size());
+    if (size < sizeof(Header)) {
+        SVDEBUG << "BinaryScoreFile::open: File \"" << path
+                << "\" is too short" << endl;
+        m_file.close();
+        return false;
+    }
+
+    const uchar *data = m_file.map(0, m_file.size());
+    if (!data) {
+        SVDEBUG << "BinaryScoreFile::open: Failed to map \"" << path
+                << "\": " << m_file.errorString() << endl;
+        m_file.close();
+        return false;
+    }
+
+    const Header *header = reinterpret_cast<const Header *>(data);
+
+    // Each table must lie within the file and be aligned for its
+    // records. The counts are 32-bit, so the products cannot overflow
+    auto tableFits = [&](uint64_t offset, uint64_t bytes, uint64_t alignment) {
+        return offset % alignment == 0 && offset <= size &&
+            bytes <= size - offset;
+    };
+    
+    bool valid =
+        memcmp(header->magic, fileMagic, sizeof(fileMagic)) == 0 &&
+        header->byteOrder == byteOrderMark &&
+        header->version == version &&
+        header->headerSize == sizeof(Header) &&
+        header->ticksPerWhole > 0 &&
+        tableFits(header->notesOffset,
+                  uint64_t(header->noteCount) * sizeof(NoteRecord),
+                  alignof(NoteRecord)) &&
+        tableFits(header->metersOffset,
+                  uint64_t(header->meterCount) * sizeof(MeterRecord),
+                  alignof(MeterRecord)) &&
+        tableFits(header->sourceNotesOffset,
+                  uint64_t(header->sourceNoteCount) * sizeof(SourceNoteRecord),
+                  alignof(SourceNoteRecord)) &&
+        tableFits(header->measuresOffset,
+                  uint64_t(header->measureCount) * sizeof(MeasureRecord),
+                  alignof(MeasureRecord)) &&
+        tableFits(header->stringsOffset, header->stringsSize, 1);
+    
+    if (!valid) {
+        SVDEBUG << "BinaryScoreFile::open: File \"" << path
+                << "\" is not a valid binary score file of version "
+                << version << endl;
+        m_file.unmap(const_cast<uchar *>(data));
+        m_file.close();
+        return false;
+    }
+
+    m_data = data;
+    m_header = header;
+    m_notes = reinterpret_cast<const NoteRecord *>(data + header->notesOffset);
+    m_meters = reinterpret_cast<const MeterRecord *>(data + header->metersOffset);
+    m_sourceNotes = reinterpret_cast<const SourceNoteRecord *>(data + header->sourceNotesOffset);
+    m_measures = reinterpret_cast<const MeasureRecord *>(data + header->measuresOffset);
+    m_strings = reinterpret_cast<const char *>(data + header->stringsOffset);
+    return true;
+}
+
+void
+BinaryScoreFile::close()
+{
+    if (m_data) {
+        m_file.unmap(const_cast<uchar *>(m_data));
+    }
+    if (m_file.isOpen()) {
+        m_file.close();
+    }
+    m_data = nullptr;
+    m_header = nullptr;
+    m_notes = nullptr;
+    m_meters = nullptr;
+    m_sourceNotes = nullptr;
+    m_measures = nullptr;
+    m_strings = nullptr;
+}
+
+int64_t
+BinaryScoreFile::getTicksPerWhole() const
+{
+    if (!m_header) return 0;
+    return m_header->ticksPerWhole;
+}
+
+int
+BinaryScoreFile::getNoteCount() const
+{
+    if (!m_header) return 0;
+    return int(m_header->noteCount);
+}
+
+BinaryScoreFile::Note
+BinaryScoreFile::getNote(int index) const
+{
+    if (index < 0 || index >= getNoteCount()) {
+        SVCERR << "BinaryScoreFile::getNote: Index " << index
+               << " out of range" << endl;
+        return { -1, 0, 0, 0, 0, {} };
+    }
+
+    const NoteRecord &record = m_notes[index];
+    
+    return { record.measureIndex, record.beat, record.cumulative,
+             record.pitch, record.velocity,
+             getString(record.idOffset, record.idLength) };
+}
+
+int
+BinaryScoreFile::getMeterCount() const
+{
+    if (!m_header) return 0;
+    return int(m_header->meterCount);
+}
+
+BinaryScoreFile::Meter
+BinaryScoreFile::getMeter(int index) const
+{
+    if (index < 0 || index >= getMeterCount()) {
+        SVCERR << "BinaryScoreFile::getMeter: Index " << index
+               << " out of range" << endl;
+        return { -1, 0, 0 };
+    }
+
+    const MeterRecord &record = m_meters[index];
+    return { record.measureIndex, record.numerator, record.denominator };
+}
+
+int
+BinaryScoreFile::getSourceNoteCount() const
+{
+    if (!m_header) return 0;
+    return int(m_header->sourceNoteCount);
+}
+
+BinaryScoreFile::SourceNote
+BinaryScoreFile::getSourceNote(int index) const
+{
+    if (index < 0 || index >= getSourceNoteCount()) {
+        SVCERR << "BinaryScoreFile::getSourceNote: Index " << index
+               << " out of range" << endl;
+        return { -1, 0, 0, 0, {} };
+    }
+
+    const SourceNoteRecord &record = m_sourceNotes[index];
+    return { record.measureIndex, record.beat, record.duration,
+             record.pitch, getString(record.idOffset, record.idLength) };
+}
+
+MeiMeasureTable
+BinaryScoreFile::getMeasureTable() const
+{
+    if (!m_header) return {};
+
+    vector<MeiMeasureTable::Measure> measures;
+    measures.reserve(m_header->measureCount);
+    for (uint32_t i = 0; i < m_header->measureCount; ++i) {
+        const MeasureRecord &record = m_measures[i];
+        MeiMeasureTable::Measure measure;
+        measure.id = string(getString(record.idOffset, record.idLength));
+        measure.hash = record.hash;
+        measure.changesContext = (record.flags & measureChangesContext);
+        measure.spanEnd = record.spanEnd;
+        measures.push_back(measure);
+    }
+
+    return MeiMeasureTable(measures, m_header->contextHash);
+}
+
+std::string_view
+BinaryScoreFile::getString(uint32_t offset, uint32_t length) const
+{
+    if (uint64_t(offset) + length > m_header->stringsSize) {
+        return {};
+    }
+    return std::string_view(m_strings + offset, length);
+}
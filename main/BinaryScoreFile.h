@@ -0,0 +1,135 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_BINARY_SCORE_FILE_H
+#define SV_BINARY_SCORE_FILE_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <QFile>
+
+#include "MeiMeasureTable.h"
+
+/**
+ * Binary companion to the .solo and .meter text files generated by
+ * ScoreParser, holding the same note lines and meter changes. It is
+ * laid out to be used directly from a memory-mapped file: a fixed
+ * header, tables of fixed-width records, and a pool of id
+ * characters. Score times are integer ticks rather than fractions,
+ * at a resolution recorded in the header.
+ *
+ * Besides the note lines, the file records what ScoreParser needs to
+ * regenerate the score incrementally after an edit: the MEI measure
+ * table it was generated from, and the notes taken from each measure
+ * before the pickup adjustment and the sort into line order.
+ *
+ * The text files remain the ones the aligner plugin reads, and the
+ * ones to diff; this file exists so that our own code can load a
+ * score's notes without parsing.
+ *
+ * Files are written in host byte order, and a reader rejects a file
+ * whose byte order or version it does not recognise.
+ */
+class BinaryScoreFile
+{
+public:
+    static constexpr const char *extension = "solobin";
+    static constexpr uint32_t version = 3; // 3: measure table has @tie spans
+
+    struct Note {
+        int measureIndex;
+        int64_t beat;       // ticks from the start of the measure
+        int64_t cumulative; // ticks from the start of the score
+        int pitch;          // midi pitch
+        int velocity;       // 0 for a note-off line
+        std::string_view noteId; // when read, valid while the file is open
+    };
+
+    struct Meter {
+        int measureIndex;
+        int numerator;
+        int denominator;
+    };
+
+    struct SourceNote {
+        int measureIndex;   // as in the MEI, before any pickup adjustment
+        int64_t beat;       // ticks from the start of the measure
+        int64_t duration;   // ticks, including any tied notes
+        int pitch;
+        std::string_view noteId; // when read, valid while the file is open
+    };
+
+    /** Write a file with the given note lines, which should be in
+     *  .solo line order, meter changes, source notes in document
+     *  order, and measure table. Return true on success; on failure
+     *  no file is left behind.
+     */
+    static bool write(std::string path,
+                      int64_t ticksPerWhole,
+                      const std::vector<Note> &notes,
+                      const std::vector<Meter> &meters,
+                      const std::vector<SourceNote> &sourceNotes,
+                      const MeiMeasureTable &measureTable);
+
+    BinaryScoreFile();
+    ~BinaryScoreFile();
+
+    /** Map the given file and check its header and tables. Return
+     *  false, leaving nothing open, if it cannot be mapped or is not
+     *  a valid file of this version.
+     */
+    bool open(std::string path);
+    void close();
+    bool isOpen() const { return m_data != nullptr; }
+
+    /** Return the number of ticks to a whole note used for the
+     *  score times in this file.
+     */
+    int64_t getTicksPerWhole() const;
+
+    int getNoteCount() const;
+    Note getNote(int index) const;
+
+    int getMeterCount() const;
+    Meter getMeter(int index) const;
+
+    int getSourceNoteCount() const;
+    SourceNote getSourceNote(int index) const;
+
+    MeiMeasureTable getMeasureTable() const;
+
+    struct Header;
+    struct NoteRecord;
+    struct MeterRecord;
+    struct SourceNoteRecord;
+    struct MeasureRecord;
+
+private:
+    QFile m_file;
+    const uchar *m_data;
+    const Header *m_header;
+    const NoteRecord *m_notes;
+    const MeterRecord *m_meters;
+    const SourceNoteRecord *m_sourceNotes;
+    const MeasureRecord *m_measures;
+    const char *m_strings;
+
+    std::string_view getString(uint32_t offset, uint32_t length) const;
+
+    BinaryScoreFile(const BinaryScoreFile &) = delete;
+    BinaryScoreFile &operator=(const BinaryScoreFile &) = delete;
+};
+
+#endif
@@ -139,6 +139,7 @@
 #include <QActionGroup>
 #include <QFileDialog>
 #include <QDockWidget>
+#include <QThreadPool>
 
 #include <iostream>
 #include <cstdio>
@@ -192,7 +193,8 @@ MainWindow::MainWindow(AudioMode audioMode, MIDIMode midiMode, bool withOSCSuppo
     m_templateWatcher(nullptr),
     m_shouldStartOSCQueue(false),
     m_scoreAlignmentModified(false),
-    m_followScore(true)
+    m_followScore(true),
+    m_scoreDataPool(new QThreadPool(this))
 {
     Profiler profiler("MainWindow::MainWindow");
 
@@ -246,6 +248,7 @@ MainWindow::MainWindow(AudioMode audioMode, MIDIMode midiMode, bool withOSCSuppo
     QGridLayout *scoreWidgetLayout = new QGridLayout;
 
     m_scoreWidget = new ScoreWidget(true, scoreWidgetContainer);
+    m_scoreDataPool->setMaxThreadCount(1); // see openScoreFile
     m_scoreWidget->setInteractionMode(ScoreWidget::InteractionMode::Navigate);
     connect(m_scoreWidget, &ScoreWidget::scoreLocationHighlighted,
             this, &MainWindow::scoreLocationHighlighted);
@@ -259,6 +262,12 @@ MainWindow::MainWindow(AudioMode audioMode, MIDIMode midiMode, bool withOSCSuppo
             this, &MainWindow::scoreSelectionChanged);
     connect(m_scoreWidget, &ScoreWidget::pageChanged,
             this, &MainWindow::scorePageChanged);
+    connect(m_scoreWidget, &ScoreWidget::loadProgress,
+            this, &MainWindow::scoreLoadProgress);
+    connect(m_scoreWidget, &ScoreWidget::loadCompleted,
+            this, &MainWindow::scoreLoadCompleted);
+    connect(m_scoreWidget, &ScoreWidget::loadFailed,
+            this, &MainWindow::scoreLoadFailed);
 
     int alignButtonWidth = 50 + QFontMetrics(font()).horizontalAdvance
         (tr("Align Selection of Score with All of Audio"));
@@ -544,6 +553,14 @@ MainWindow::~MainWindow()
 {
 //    SVDEBUG << "MainWindow::~MainWindow" << endl;
 
+    // Jobs in the score data pool call back into this object, and
+    // may be writing files that are about to be deleted
+    if (m_pendingScoreLoad) {
+        m_pendingScoreLoad->cancelled = true;
+        m_pendingScoreLoad = {};
+    }
+    m_scoreDataPool->waitForDone();
+    
     deleteTemporaryScoreFiles();
 
     delete m_keyReference;
@@ -2433,30 +2450,32 @@ MainWindow::openScoreFile()
 
 void
 MainWindow::deleteTemporaryScoreFiles()
+{
+    removeScoreFiles(m_scoreFilesToDelete);
+    m_scoreFilesToDelete.clear();
+}
+
+void
+MainWindow::removeScoreFiles(const vector<string> &files)
 {
     // Delete in reverse order of creation, so as to delete any
     // resulting empty directory after its contents
-    for (auto itr = m_scoreFilesToDelete.rbegin();
-         itr != m_scoreFilesToDelete.rend();
-         ++itr) {
+    for (auto itr = files.rbegin(); itr != files.rend(); ++itr) {
         auto f = *itr;
         std::error_code ec;
-        SVDEBUG << "MainWindow::deleteTemporaryScoreFiles: Removing file \""
+        SVDEBUG << "MainWindow::removeScoreFiles: Removing file \""
                 << f << "\"" << endl;
         if (!std::filesystem::remove(f, ec)) {
-            SVDEBUG << "MainWindow::deleteTemporaryScoreFiles: "
+            SVDEBUG << "MainWindow::removeScoreFiles: "
                     << "Failed to remove generated file \""
                     << f << "\": " << ec.message() << endl;
         }
     }
-    m_scoreFilesToDelete.clear();
 }
 
 void
 MainWindow::openScoreFile(QString scoreName, QString scoreFile)
 {
-    QString errorString;
-    
     if (scoreFile == "") {
         scoreFile = QString::fromStdString
             (ScoreFinder::getScoreFile(scoreName.toStdString(), "mei"));
@@ -2469,17 +2488,29 @@ MainWindow::openScoreFile(QString scoreName, QString scoreFile)
             return;
         }
     }
-        
-    if (!m_scoreWidget->loadScoreFile(scoreName, scoreFile, errorString)) {
-        QMessageBox::warning(this,
-                             tr("Unable to load score"),
-                             tr("Unable to load score \"%1\": %2")
-                             .arg(scoreName).arg(errorString),
-                             QMessageBox::Ok);
-        return;
+
+    // Opening a score supersedes any other still being opened, rather
+    // than waiting for it
+    if (m_pendingScoreLoad) {
+        SVDEBUG << "MainWindow::openScoreFile: Cancelling load of score \""
+                << m_pendingScoreLoad->scoreName << "\"" << endl;
+        m_pendingScoreLoad->cancelled = true;
     }
+    
+    auto load = std::make_shared<PendingScoreLoad>();
+    load->scoreName = scoreName;
+    load->scoreFile = scoreFile;
+    m_pendingScoreLoad = load;
 
-    deleteTemporaryScoreFiles();
+    // The pages are rendered by the score widget, which reports back
+    // through scoreLoadProgress, scoreLoadCompleted and
+    // scoreLoadFailed, while the score data is generated and read on
+    // m_scoreDataPool and reported through scoreDataLoaded. The
+    // musical events are only set once both are done, in
+    // finishScoreLoad
+    m_scoreWidget->loadScoreFileAsync(scoreName, scoreFile);
+    
+    statusBar()->showMessage(tr("Loading score \"%1\"...").arg(scoreName));
     
     m_scoreWidget->setInteractionMode(ScoreWidget::InteractionMode::Navigate);
     
@@ -2495,51 +2526,172 @@ MainWindow::openScoreFile(QString scoreName, QString scoreFile)
     m_scoreAlignmentModified = false;
     m_score = Score();
 
+    // The data pool runs one job at a time, so the files generated
+    // for the previous score are removed only once any job still
+    // writing them is done, and before this one starts writing again
+    vector<string> filesToDelete;
+    filesToDelete.swap(m_scoreFilesToDelete);
+    
+    m_scoreDataPool->start([this, load, filesToDelete]() {
+        
+        removeScoreFiles(filesToDelete);
+        if (load->cancelled) {
+            return;
+        }
+        
+        vector<string> createdFiles;
+        Score score;
+        bool ok = loadScoreData(load->scoreName, load->scoreFile,
+                                createdFiles, score);
+
+        if (load->cancelled) {
+            removeScoreFiles(createdFiles);
+            return;
+        }
+        
+        QMetaObject::invokeMethod
+            (this, [this, load, createdFiles, ok, score]() {
+                scoreDataLoaded(load, createdFiles, ok, score);
+            }, Qt::QueuedConnection);
+    });
+}
+
+bool
+MainWindow::loadScoreData(QString scoreName, QString scoreFile,
+                          vector<string> &createdFiles, Score &score)
+{
     // Creating score structure
     string sname = scoreName.toStdString();
     string scoreDir = ScoreFinder::getUserScoreDirectory() + "/" + sname;
 
     if (!std::filesystem::exists(scoreDir)) {
         if (!QDir().mkpath(QString::fromStdString(scoreDir))) {
-            SVCERR << "MainWindow::chooseScore: Failed to create score directory \"" << scoreDir << "\" for generated files" << endl;
-            return;
+            SVCERR << "MainWindow::loadScoreData: Failed to create score directory \"" << scoreDir << "\" for generated files" << endl;
+            return false;
         }
-        m_scoreFilesToDelete.push_back(scoreDir);
+        createdFiles.push_back(scoreDir);
     }
 
     auto generatedFiles = ScoreParser::generateScoreFiles
-        (scoreDir, scoreName.toStdString(), scoreFile.toStdString());
+        (scoreDir, sname, scoreFile.toStdString());
     if (generatedFiles.empty()) {
-        SVCERR << "MainWindow::chooseScore: Failed to generate score files in directory \"" << scoreDir << "\" from MEI file \"" << scoreFile << "\"" << endl;
-        return;
+        SVCERR << "MainWindow::loadScoreData: Failed to generate score files in directory \"" << scoreDir << "\" from MEI file \"" << scoreFile << "\"" << endl;
+        return false;
     }
-    m_scoreFilesToDelete.insert(m_scoreFilesToDelete.end(),
-                                generatedFiles.begin(), generatedFiles.end());
+    createdFiles.insert(createdFiles.end(),
+                        generatedFiles.begin(), generatedFiles.end());
     
     string soloPath = ScoreFinder::getScoreFile(sname, "solo");
     string meterPath = ScoreFinder::getScoreFile(sname, "meter");
-    if (!m_score.initialize(soloPath)) {
-        SVCERR << "MainWindow::chooseScore: Failed to load score data from solo file path \"" << soloPath << "\"" << endl;
+    if (!score.initialize(soloPath)) {
+        SVCERR << "MainWindow::loadScoreData: Failed to load score data from solo file path \"" << soloPath << "\"" << endl;
+        return false;
+    }
+    if (!score.readMeter(meterPath)) {
+        SVCERR << "MainWindow::loadScoreData: Failed to load meter data from meter file path \"" << meterPath << "\"" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+void
+MainWindow::scoreDataLoaded(std::shared_ptr<PendingScoreLoad> load,
+                            vector<string> createdFiles,
+                            bool ok, Score score)
+{
+    m_scoreFilesToDelete.insert(m_scoreFilesToDelete.end(),
+                                createdFiles.begin(), createdFiles.end());
+
+    if (load != m_pendingScoreLoad) {
+        SVDEBUG << "MainWindow::scoreDataLoaded: Ignoring data for superseded load of score \"" << load->scoreName << "\"" << endl;
+        return;
+    }
+
+    load->dataLoaded = true;
+    load->dataOk = ok;
+    load->score = score;
+
+    if (load->pagesLoaded) {
+        finishScoreLoad();
+    }
+}
+
+void
+MainWindow::scoreLoadProgress(QString scoreName, int pagesReady, int pageCount)
+{
+    if (!m_pendingScoreLoad || m_pendingScoreLoad->scoreName != scoreName) {
+        return;
+    }
+    
+    statusBar()->showMessage(tr("Loading score \"%1\": page %2 of %3")
+                             .arg(scoreName).arg(pagesReady).arg(pageCount));
+}
+
+void
+MainWindow::scoreLoadCompleted(QString scoreName)
+{
+    if (!m_pendingScoreLoad || m_pendingScoreLoad->scoreName != scoreName) {
+        return;
+    }
+
+    m_pendingScoreLoad->pagesLoaded = true;
+
+    if (m_pendingScoreLoad->dataLoaded) {
+        finishScoreLoad();
+    }
+}
+
+void
+MainWindow::scoreLoadFailed(QString scoreName, QString errorString)
+{
+    if (!m_pendingScoreLoad || m_pendingScoreLoad->scoreName != scoreName) {
         return;
     }
-    if (!m_score.readMeter(meterPath)) {
-        SVCERR << "MainWindow::chooseScore: Failed to load meter data from meter file path \"" << meterPath << "\"" << endl;
+
+    m_pendingScoreLoad->cancelled = true;
+    m_pendingScoreLoad = {};
+    statusBar()->clearMessage();
+    
+    QMessageBox::warning(this,
+                         tr("Unable to load score"),
+                         tr("Unable to load score \"%1\": %2")
+                         .arg(scoreName).arg(errorString),
+                         QMessageBox::Ok);
+}
+
+void
+MainWindow::finishScoreLoad()
+{
+    auto load = m_pendingScoreLoad;
+    m_pendingScoreLoad = {};
+    
+    statusBar()->clearMessage();
+
+    if (!load->dataOk) {
+        SVCERR << "MainWindow::finishScoreLoad: Failed to load score data for score \"" << load->scoreName << "\"" << endl;
         return;
     }
+    
+    m_score = load->score;
+    
     m_session.setMusicalEvents(m_score.getMusicalEvents());
     m_scoreWidget->setMusicalEvents(m_score.getMusicalEvents());
 
+    string sname = load->scoreName.toStdString();
+    QString scoreName = load->scoreName;
+    
     auto recordingDirectory =
-        ScoreFinder::getUserRecordingDirectory(scoreName.toStdString(), false);
+        ScoreFinder::getUserRecordingDirectory(sname, false);
     if (recordingDirectory != "") {
         RecordDirectory::setRecordContainerDirectory
             (QString::fromStdString(recordingDirectory));
     }
 
     auto bundledRecordingDirectory =
-        ScoreFinder::getBundledRecordingDirectory(scoreName.toStdString());
+        ScoreFinder::getBundledRecordingDirectory(sname);
     if (bundledRecordingDirectory == "") {
-        SVDEBUG << "MainWindow::chooseScore: Note: no bundled recording directory returned for score " << scoreName << endl;
+        SVDEBUG << "MainWindow::finishScoreLoad: Note: no bundled recording directory returned for score " << scoreName << endl;
         return;
     }
 
@@ -2565,12 +2717,13 @@ MainWindow::openScoreFile(QString scoreName, QString scoreFile)
         }
     }
 
+    QSettings settings;
     settings.beginGroup("FileFinder");
     settings.remove("audiopath");
     settings.remove("lastpath");
     settings.endGroup();
 
-    SVDEBUG << "MainWindow::chooseScore: haveUserRecordings = "
+    SVDEBUG << "MainWindow::finishScoreLoad: haveUserRecordings = "
             << haveUserRecordings << ", recordingDirectory = "
             << recordingDirectory << ", bundledRecordingDirectory = "
             << bundledRecordingDirectory << endl;
@@ -2600,37 +2753,12 @@ MainWindow::highlightFrameInScore(sv_frame_t frame)
 
     // The default tempo is quarter note = 120 bpm.
 
-    TimeInstantLayer *targetLayer = m_session.getOnsetsLayer();
-
-    // If the program is slow, might want to consider a different approach that can get rid of the loops.
-    QString label;
-    if (targetLayer) {
-        ModelId targetId = targetLayer->getModel();
-        const auto targetModel = ModelById::getAs<SparseOneDimensionalModel>(targetId);
-        const auto events = targetModel->getAllEvents();
-        if (events.empty()) return;
-        label = events[0].getLabel();
-        bool found = false;
-        int eventCount = targetModel->getEventCount();
-        for (int i = 1; i < eventCount; ++i) {
-            sv_frame_t eventFrame = events[i].getFrame();
-//            SVDEBUG << "MainWindow::highlightFrameInScore: seeking frame " << frame << ": event index = " << i << ": " << "Frame = " << eventFrame << ", Value = " << events[i].getValue() << ", Label = " << events[i].getLabel() << endl;
-            if (frame < eventFrame) {
-                label = events[i-1].getLabel();
-                found = true;
-                break;
-            } else if (frame == eventFrame) {
-                label = events[i].getLabel();
-                found = true;
-                break;
-            }
-        }
-        if (!found && eventCount > 0) {
-            label = events[eventCount-1].getLabel();
-        }
-    }
+    // This is called for every playback frame update, so the session
+    // keeps the onsets indexed by frame, with a cursor that follows
+    // playback, rather than us scanning the onsets model each time
+    int index = m_session.getMusicalEventIndexAtFrame(frame);
 
-    m_scoreWidget->setHighlightEventByLabel(label.toStdString());
+    m_scoreWidget->setHighlightEventByIndex(index);
 }
 
 void
@@ -26,7 +26,11 @@
 #include "Session.h"
 #include "piano-precision-aligner/Score.h"
 
+#include <atomic>
+#include <memory>
+
 class QFileSystemWatcher;
+class QThreadPool;
 class QScrollArea;
 class QToolButton;
 
@@ -167,6 +171,9 @@ protected slots:
     void scorePageChanged(int page);
     void scorePageDownButtonClicked();
     void scorePageUpButtonClicked();
+    void scoreLoadProgress(QString scoreName, int pagesReady, int pageCount);
+    void scoreLoadCompleted(QString scoreName);
+    void scoreLoadFailed(QString scoreName, QString errorString);
     void alignButtonClicked();
 
     virtual void playSpeedChanged(int);
@@ -313,6 +320,30 @@ protected:
 
     std::vector<std::string> m_scoreFilesToDelete;
     void deleteTemporaryScoreFiles();
+    static void removeScoreFiles(const std::vector<std::string> &);
+
+    // A score being opened. Its pages are loaded by the score widget
+    // while its data is generated and read on m_scoreDataPool, and
+    // finishScoreLoad is called once both are done
+    struct PendingScoreLoad {
+        QString scoreName;
+        QString scoreFile;
+        std::atomic<bool> cancelled { false };
+        bool pagesLoaded = false;
+        bool dataLoaded = false;
+        bool dataOk = false;
+        Score score;
+    };
+    std::shared_ptr<PendingScoreLoad> m_pendingScoreLoad;
+    QThreadPool *m_scoreDataPool;
+
+    static bool loadScoreData(QString scoreName, QString scoreFile,
+                              std::vector<std::string> &createdFiles,
+                              Score &score);
+    void scoreDataLoaded(std::shared_ptr<PendingScoreLoad> load,
+                         std::vector<std::string> createdFiles,
+                         bool ok, Score score);
+    void finishScoreLoad();
     
     struct LayerConfiguration {
         LayerConfiguration(sv::LayerFactory::LayerType _layer
@@ -0,0 +1,272 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "MeiMeasureTable.h"
+
+#include "pugixml.hpp"
+
+#include "base/Debug.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// 64-bit FNV-1a, which is quick and plenty good enough for telling
+// whether a measure has been edited
+
+const uint64_t fnvOffsetBasis = 14695981039346656037ull;
+const uint64_t fnvPrime = 1099511628211ull;
+
+void
+hashBytes(uint64_t &hash, const void *data, size_t size)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= fnvPrime;
+    }
+}
+
+void
+hashString(uint64_t &hash, const char *s)
+{
+    // include the terminator, so that adjacent strings can't run
+    // into one another
+    hashBytes(hash, s, strlen(s) + 1);
+}
+
+class HashWriter : public pugi::xml_writer
+{
+public:
+    uint64_t hash = fnvOffsetBasis;
+
+    void write(const void *data, size_t size) override {
+        hashBytes(hash, data, size);
+    }
+};
+
+// Elements within a measure whose effect lasts beyond it
+const char *const contextElements[] = {
+    "clef", "keySig", "meterSig", "meterSigGrp", "mensur",
+    "scoreDef", "staffDef", "staffGrp"
+};
+
+bool
+isContextElement(const char *name)
+{
+    for (const char *c : contextElements) {
+        if (!strcmp(name, c)) return true;
+    }
+    return false;
+}
+
+string
+referencedId(const char *value)
+{
+    if (*value == '#') ++value;
+    return value;
+}
+
+// Collect the measures in document order, and hash everything that is
+// not inside one into the context hash. A measure contributes only its
+// position to the context, via its id.
+void
+walk(pugi::xml_node node, vector<pugi::xml_node> &measures,
+     uint64_t &contextHash)
+{
+    for (pugi::xml_node child : node.children()) {
+        if (child.type() == pugi::node_element) {
+            if (!strcmp(child.name(), "measure")) {
+                measures.push_back(child);
+                hashString(contextHash, "measure");
+                hashString(contextHash,
+                           child.attribute("xml:id").value());
+                continue;
+            }
+            hashString(contextHash, child.name());
+            for (pugi::xml_attribute attr : child.attributes()) {
+                hashString(contextHash, attr.name());
+                hashString(contextHash, attr.value());
+            }
+            walk(child, measures, contextHash);
+            hashString(contextHash, "/");
+        } else {
+            hashString(contextHash, child.value());
+        }
+    }
+}
+
+template <typename F>
+void
+forEachDescendantElement(pugi::xml_node node, F f)
+{
+    for (pugi::xml_node child : node.children()) {
+        if (child.type() != pugi::node_element) continue;
+        f(child);
+        forEachDescendantElement(child, f);
+    }
+}
+
+// True if a @tie value says the note or chord is tied to one after
+// it, which may be in the next measure: "i" (initial) or "m" (medial)
+bool
+continuesTie(const char *tie)
+{
+    return strchr(tie, 'i') || strchr(tie, 'm');
+}
+
+// The measure offset of a tstamp2 value such as "1m+2.5", or 0 if it
+// has none
+int
+measureOffsetOf(const char *tstamp2)
+{
+    if (!strchr(tstamp2, 'm')) return 0;
+    return atoi(tstamp2);
+}
+
+}
+
+MeiMeasureTable::MeiMeasureTable() :
+    m_contextHash(0)
+{
+}
+
+MeiMeasureTable::MeiMeasureTable(vector<Measure> measures,
+                                 uint64_t contextHash) :
+    m_measures(std::move(measures)),
+    m_contextHash(contextHash)
+{
+}
+
+bool
+MeiMeasureTable::read(string meiFile)
+{
+    m_measures.clear();
+    m_contextHash = 0;
+
+    pugi::xml_document doc;
+    pugi::xml_parse_result result = doc.load_file(meiFile.c_str());
+    if (result.status != pugi::status_ok) {
+        SVDEBUG << "MeiMeasureTable::read: Failed to parse " << meiFile
+                << ": " << result.description() << endl;
+        return false;
+    }
+
+    vector<pugi::xml_node> nodes;
+    uint64_t contextHash = fnvOffsetBasis;
+    walk(doc, nodes, contextHash);
+
+    int n = int(nodes.size());
+    vector<Measure> measures(n);
+    std::unordered_map<string, int> measureOfId;
+
+    for (int i = 0; i < n; ++i) {
+        Measure &m = measures[i];
+        m.id = nodes[i].attribute("xml:id").value();
+        HashWriter writer;
+        nodes[i].print(writer, "", pugi::format_raw);
+        m.hash = writer.hash;
+        m.changesContext = false;
+        m.spanEnd = i;
+        forEachDescendantElement(nodes[i], [&](pugi::xml_node e) {
+            pugi::xml_attribute id = e.attribute("xml:id");
+            if (id) measureOfId[id.value()] = i;
+            if (isContextElement(e.name())) m.changesContext = true;
+        });
+    }
+
+    // A span belongs to the earliest measure it touches, whichever
+    // measure it happens to be encoded in
+
+    for (int i = 0; i < n; ++i) {
+        forEachDescendantElement(nodes[i], [&](pugi::xml_node e) {
+            int first = i, last = i;
+            for (const char *ref : { "startid", "endid" }) {
+                pugi::xml_attribute attr = e.attribute(ref);
+                if (!attr) continue;
+                auto itr = measureOfId.find(referencedId(attr.value()));
+                if (itr == measureOfId.end()) continue;
+                first = std::min(first, itr->second);
+                last = std::max(last, itr->second);
+            }
+            pugi::xml_attribute tstamp2 = e.attribute("tstamp2");
+            if (tstamp2) {
+                int end = i + measureOffsetOf(tstamp2.value());
+                last = std::max(last, std::min(end, n - 1));
+            }
+            // A tie given by @tie rather than a tie element names no
+            // end, but whether the note it ends on is a new note
+            // depends on this one, and that note may be in the next
+            // measure
+            pugi::xml_attribute tie = e.attribute("tie");
+            if (tie && continuesTie(tie.value())) {
+                last = std::max(last, std::min(i + 1, n - 1));
+            }
+            Measure &m = measures[first];
+            m.spanEnd = std::max(m.spanEnd, last);
+        });
+    }
+
+    m_measures = std::move(measures);
+    m_contextHash = contextHash;
+    return true;
+}
+
+bool
+MeiMeasureTable::getAffectedMeasures(const MeiMeasureTable &before,
+                                     const MeiMeasureTable &after,
+                                     vector<int> &affected)
+{
+    affected.clear();
+
+    if (before.isEmpty() || after.isEmpty()) return false;
+    if (before.m_contextHash != after.m_contextHash) return false;
+
+    const vector<Measure> &bm = before.m_measures;
+    const vector<Measure> &am = after.m_measures;
+    if (bm.size() != am.size()) return false;
+
+    int n = int(am.size());
+    vector<bool> changed(n, false);
+
+    for (int i = 0; i < n; ++i) {
+        if (bm[i].id != am[i].id) return false;
+        if (bm[i].hash == am[i].hash) continue;
+        if (bm[i].changesContext || am[i].changesContext) return false;
+        changed[i] = true;
+    }
+
+    vector<bool> result(changed);
+
+    for (const vector<Measure> *measures : { &bm, &am }) {
+        for (int i = 0; i < n; ++i) {
+            int end = std::min((*measures)[i].spanEnd, n - 1);
+            if (end <= i) continue;
+            if (std::find(changed.begin() + i, changed.begin() + end + 1,
+                          true) == changed.begin() + end + 1) {
+                continue;
+            }
+            std::fill(result.begin() + i, result.begin() + end + 1, true);
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (result[i]) affected.push_back(i);
+    }
+    return true;
+}
@@ -0,0 +1,84 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_MEI_MEASURE_TABLE_H
+#define SV_MEI_MEASURE_TABLE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * The measures of an MEI file in document order, each with a hash of
+ * its content, together with a hash of everything in the file
+ * outside the measures. Comparing the tables made before and after
+ * an edit tells us which measures the edit could have affected, so
+ * that only those need to be regenerated or re-rendered.
+ *
+ * This reads the MEI directly, without Verovio, so it is cheap
+ * compared with loading the score.
+ */
+class MeiMeasureTable
+{
+public:
+    struct Measure {
+        std::string id;
+        uint64_t hash;
+
+        /** True if the measure contains something, such as a clef,
+         *  key or meter change, whose effect carries on into the
+         *  following measures. */
+        bool changesContext;
+
+        /** Index of the last measure reached by any span (tie, slur,
+         *  hairpin, octave line etc.) that starts in this measure,
+         *  or the measure's own index if there is none. A note or
+         *  chord with a @tie that continues counts as a span to the
+         *  next measure. */
+        int spanEnd;
+    };
+
+    MeiMeasureTable();
+    MeiMeasureTable(std::vector<Measure> measures, uint64_t contextHash);
+
+    /** Read the given MEI file, replacing any existing content. If
+     *  the file cannot be read or parsed, return false and leave the
+     *  table empty.
+     */
+    bool read(std::string meiFile);
+
+    bool isEmpty() const { return m_measures.empty(); }
+    const std::vector<Measure> &getMeasures() const { return m_measures; }
+    uint64_t getContextHash() const { return m_contextHash; }
+
+    /** Compare the tables for two versions of a score and return, in
+     *  ascending order, the indices of the measures whose notes or
+     *  appearance may differ between them. Those are the measures
+     *  whose content has changed, plus all measures covered by any
+     *  span in either version that touches a changed measure.
+     *
+     *  Return false if the difference cannot be confined to
+     *  particular measures, so that everything must be regenerated:
+     *  because either table is empty, the sequence of measures
+     *  differs, something outside the measures differs, or a changed
+     *  measure has content that affects the measures after it.
+     */
+    static bool getAffectedMeasures(const MeiMeasureTable &before,
+                                    const MeiMeasureTable &after,
+                                    std::vector<int> &affected);
+
+private:
+    std::vector<Measure> m_measures;
+    uint64_t m_contextHash;
+};
+
+#endif
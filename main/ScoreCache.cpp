@@ -0,0 +1,396 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ScoreCache.h"
+#include "ScoreFinder.h"
+
+#include "base/Debug.h"
+
+#include <chrono>
+#include <filesystem>
+#include <set>
+
+#include <QCryptographicHash>
+#include <QFile>
+#include <QSaveFile>
+#include <QTemporaryDir>
+
+using std::string;
+using std::vector;
+
+namespace fs = std::filesystem;
+
+// Every entry stores its files under this stem, with the extension
+// of the original, so that one entry can serve any score name
+static const string entryFileStem = "score";
+
+// Subdirectory holding one small file per score name, containing the
+// latest key for that score on its first line followed by the
+// parameters it was made with. No key can have this name
+static const string latestDirName = "latest";
+
+// An entry that no latest file names is left alone for this long
+// after it was written, since whoever stored it (perhaps another
+// process) may not yet have recorded its key as the latest
+static const auto pruneGracePeriod = std::chrono::hours(1);
+
+static std::set<string> readLatestKeys(fs::path cacheDir);
+static void prune(fs::path cacheDir, string keep);
+
+string
+ScoreCache::getCacheDirectory()
+{
+    string scoreDir = ScoreFinder::getUserScoreDirectory();
+    if (scoreDir == "") {
+        return {};
+    }
+
+    // Leading dot, so that ScoreFinder::getScoreNames passes over it
+    fs::path dir = fs::path(scoreDir) / ".cache";
+
+    std::error_code ec;
+    if (!fs::is_directory(dir, ec)) {
+        if (!fs::create_directories(dir, ec)) {
+            SVDEBUG << "ScoreCache::getCacheDirectory: Failed to create "
+                    << dir.string() << ": " << ec.message() << endl;
+            return {};
+        }
+    }
+    return dir.string();
+}
+
+string
+ScoreCache::makeKey(string scoreFile, string parameters)
+{
+    QFile file(QString::fromStdString(scoreFile));
+    if (!file.open(QIODevice::ReadOnly)) {
+        SVDEBUG << "ScoreCache::makeKey: Failed to open score file \""
+                << scoreFile << "\"" << endl;
+        return {};
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    if (!hash.addData(&file)) {
+        SVDEBUG << "ScoreCache::makeKey: Failed to read score file \""
+                << scoreFile << "\"" << endl;
+        return {};
+    }
+
+    // Separate the parameters from the file content so that no
+    // combination of the two can collide with another
+    hash.addData(QByteArray(1, '\0'));
+    hash.addData(QByteArray::fromStdString(parameters));
+
+    return hash.result().toHex().toStdString();
+}
+
+string
+ScoreCache::hashFile(string scoreFile)
+{
+    QFile file(QString::fromStdString(scoreFile));
+    if (!file.open(QIODevice::ReadOnly)) {
+        SVDEBUG << "ScoreCache::hashFile: Failed to open score file \""
+                << scoreFile << "\"" << endl;
+        return {};
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    if (!hash.addData(&file)) {
+        SVDEBUG << "ScoreCache::hashFile: Failed to read score file \""
+                << scoreFile << "\"" << endl;
+        return {};
+    }
+
+    return hash.result().toHex().toStdString();
+}
+
+string
+ScoreCache::makeKeyForContent(string contentHash, string parameters)
+{
+    if (contentHash == "") {
+        return {};
+    }
+    
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(QByteArray::fromStdString(contentHash));
+    hash.addData(QByteArray(1, '\0'));
+    hash.addData(QByteArray::fromStdString(parameters));
+
+    return hash.result().toHex().toStdString();
+}
+
+vector<string>
+ScoreCache::retrieve(string key, vector<string> extensions,
+                     string scoreDir, string scoreName)
+{
+    if (key == "") {
+        return {};
+    }
+    
+    string cacheDir = getCacheDirectory();
+    if (cacheDir == "") {
+        return {};
+    }
+
+    fs::path entryDir = fs::path(cacheDir) / key;
+
+    std::error_code ec;
+    if (!fs::is_directory(entryDir, ec)) {
+        SVDEBUG << "ScoreCache::retrieve: No entry for key " << key << endl;
+        return {};
+    }
+
+    for (auto ext : extensions) {
+        if (!fs::is_regular_file(entryDir / (entryFileStem + "." + ext), ec)) {
+            SVDEBUG << "ScoreCache::retrieve: Entry for key " << key
+                    << " lacks a ." << ext << " file" << endl;
+            return {};
+        }
+    }
+
+    vector<string> copied;
+    
+    for (auto ext : extensions) {
+        fs::path source = entryDir / (entryFileStem + "." + ext);
+        fs::path target = fs::path(scoreDir) / (scoreName + "." + ext);
+        if (!fs::copy_file(source, target,
+                           fs::copy_options::overwrite_existing, ec)) {
+            SVDEBUG << "ScoreCache::retrieve: Failed to copy "
+                    << source.string() << " to " << target.string()
+                    << ": " << ec.message() << endl;
+            for (auto f : copied) {
+                fs::remove(f, ec);
+            }
+            return {};
+        }
+        copied.push_back(target.string());
+    }
+
+    SVDEBUG << "ScoreCache::retrieve: Retrieved " << copied.size()
+            << " file(s) for key " << key << endl;
+    
+    return copied;
+}
+
+bool
+ScoreCache::store(string key, vector<string> files)
+{
+    if (key == "" || files.empty()) {
+        return false;
+    }
+    
+    string cacheDir = getCacheDirectory();
+    if (cacheDir == "") {
+        return false;
+    }
+
+    fs::path entryDir = fs::path(cacheDir) / key;
+
+    std::error_code ec;
+    if (fs::is_directory(entryDir, ec)) {
+        SVDEBUG << "ScoreCache::store: Entry for key " << key
+                << " already exists" << endl;
+        return true;
+    }
+
+    // Write into a temporary directory alongside, and rename it into
+    // place once complete. A reader (perhaps in another process)
+    // therefore never sees a partial entry, and if two writers race,
+    // one rename fails harmlessly and its directory is removed
+    
+    QTemporaryDir tempDir(QString::fromStdString
+                          ((fs::path(cacheDir) / (key + ".XXXXXX")).string()));
+    if (!tempDir.isValid()) {
+        SVDEBUG << "ScoreCache::store: Failed to create temporary directory: "
+                << tempDir.errorString() << endl;
+        return false;
+    }
+
+    fs::path tempPath = fs::path(tempDir.path().toStdString());
+    std::set<string> seen;
+    
+    for (auto f : files) {
+        string ext = fs::path(f).extension().string();
+        if (ext == "" || seen.find(ext) != seen.end()) {
+            SVDEBUG << "ScoreCache::store: File \"" << f << "\" has no "
+                    << "extension or duplicates another's" << endl;
+            return false;
+        }
+        seen.insert(ext);
+        if (!fs::copy_file(f, tempPath / (entryFileStem + ext), ec)) {
+            SVDEBUG << "ScoreCache::store: Failed to copy \"" << f
+                    << "\": " << ec.message() << endl;
+            return false;
+        }
+    }
+
+    fs::rename(tempPath, entryDir, ec);
+    if (ec) {
+        SVDEBUG << "ScoreCache::store: Failed to rename entry into place: "
+                << ec.message() << endl;
+        return fs::is_directory(entryDir, ec);
+    }
+
+    tempDir.setAutoRemove(false);
+    
+    SVDEBUG << "ScoreCache::store: Stored " << files.size()
+            << " file(s) for key " << key << endl;
+
+    prune(cacheDir, key);
+    
+    return true;
+}
+
+string
+ScoreCache::getEntryFile(string key, string extension)
+{
+    if (key == "") {
+        return {};
+    }
+    
+    string cacheDir = getCacheDirectory();
+    if (cacheDir == "") {
+        return {};
+    }
+
+    fs::path path = fs::path(cacheDir) / key /
+        (entryFileStem + "." + extension);
+
+    std::error_code ec;
+    if (!fs::is_regular_file(path, ec)) {
+        return {};
+    }
+    return path.string();
+}
+
+void
+ScoreCache::setLatestKey(string scoreName, string parameters, string key)
+{
+    string cacheDir = getCacheDirectory();
+    if (cacheDir == "" || scoreName == "" || key == "") {
+        return;
+    }
+
+    fs::path dir = fs::path(cacheDir) / latestDirName;
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+
+    QSaveFile file(QString::fromStdString((dir / scoreName).string()));
+    if (!file.open(QIODevice::WriteOnly) ||
+        file.write(QByteArray::fromStdString(key + "\n" + parameters)) < 0 ||
+        !file.commit()) {
+        SVDEBUG << "ScoreCache::setLatestKey: Failed to record key for "
+                << "score " << scoreName << ": " << file.errorString()
+                << endl;
+    }
+}
+
+string
+ScoreCache::getLatestKey(string scoreName, string parameters)
+{
+    string cacheDir = getCacheDirectory();
+    if (cacheDir == "" || scoreName == "") {
+        return {};
+    }
+
+    QFile file(QString::fromStdString
+               ((fs::path(cacheDir) / latestDirName / scoreName).string()));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return {};
+    }
+
+    string content = file.readAll().toStdString();
+    auto newline = content.find('\n');
+    if (newline == string::npos ||
+        content.substr(newline + 1) != parameters) {
+        return {};
+    }
+    return content.substr(0, newline);
+}
+
+static std::set<string>
+readLatestKeys(fs::path cacheDir)
+{
+    std::set<string> keys;
+    
+    std::error_code ec;
+    for (const auto &entry :
+             fs::directory_iterator(cacheDir / latestDirName, ec)) {
+        QFile file(QString::fromStdString(entry.path().string()));
+        if (!file.open(QIODevice::ReadOnly)) {
+            continue;
+        }
+        string content = file.readAll().toStdString();
+        keys.insert(content.substr(0, content.find('\n')));
+    }
+
+    return keys;
+}
+
+// Remove every entry, and every temporary directory left over from a
+// failed store, that is older than the grace period and not named by
+// any latest file, except the one for the given key
+static void
+prune(fs::path cacheDir, string keep)
+{
+    auto latest = readLatestKeys(cacheDir);
+    auto cutoff = fs::file_time_type::clock::now() - pruneGracePeriod;
+    int removed = 0;
+    
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(cacheDir, ec)) {
+        string name = entry.path().filename().string();
+        if (name == keep || name == latestDirName ||
+            latest.find(name) != latest.end()) {
+            continue;
+        }
+        std::error_code eec;
+        if (!entry.is_directory(eec) ||
+            entry.last_write_time(eec) > cutoff || eec) {
+            continue;
+        }
+        if (fs::remove_all(entry.path(), eec) > 0) {
+            ++removed;
+        } else if (eec) {
+            SVDEBUG << "ScoreCache::prune: Failed to remove \"" << name
+                    << "\": " << eec.message() << endl;
+        }
+    }
+
+    if (removed > 0) {
+        SVDEBUG << "ScoreCache::prune: Removed " << removed
+                << " stale entries" << endl;
+    }
+}
+
+void
+ScoreCache::removeUnlessLatest(string key)
+{
+    string cacheDir = getCacheDirectory();
+    if (cacheDir == "" || key == "" || key == latestDirName) {
+        return;
+    }
+
+    auto latest = readLatestKeys(cacheDir);
+    if (latest.find(key) != latest.end()) {
+        return;
+    }
+
+    std::error_code ec;
+    if (fs::remove_all(fs::path(cacheDir) / key, ec) > 0) {
+        SVDEBUG << "ScoreCache::removeUnlessLatest: Removed entry for key "
+                << key << endl;
+    } else if (ec) {
+        SVDEBUG << "ScoreCache::removeUnlessLatest: Failed to remove entry "
+                << "for key " << key << ": " << ec.message() << endl;
+    }
+}
@@ -0,0 +1,117 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_SCORE_CACHE_H
+#define SV_SCORE_CACHE_H
+
+#include <string>
+#include <vector>
+
+/**
+ * Persistent store for files generated from a score, addressed by
+ * the content of the score file they were generated from. Entries
+ * live below a hidden ".cache" directory in the user score
+ * directory, one subdirectory per key. Entries are never modified
+ * once written, so a stale entry is simply one whose key nobody asks
+ * for any more.
+ *
+ * The cache also remembers, for each score name, the key most
+ * recently stored or retrieved for it. When a score has been edited
+ * this identifies the entry generated from its previous version,
+ * which ScoreParser can use to regenerate only what has changed. An
+ * entry that is no longer the latest for any score name is stale,
+ * and is removed the next time a new entry is stored.
+ */
+class ScoreCache
+{
+public:
+    /** Return the key identifying files generated from the given
+     *  score file with the given generator parameters. The key is a
+     *  hash of the file's bytes together with the parameters string,
+     *  which should describe everything else the output depends on
+     *  (tool versions, options). Return the empty string if the file
+     *  cannot be read.
+     */
+    static std::string makeKey(std::string scoreFile,
+                               std::string parameters);
+
+    /** Return a hash of the bytes of the given score file, or the
+     *  empty string if the file cannot be read.
+     */
+    static std::string hashFile(std::string scoreFile);
+
+    /** Return the key identifying files generated, with the given
+     *  parameters, from a score whose bytes had the given hash (as
+     *  returned by hashFile). Use this rather than makeKey when the
+     *  files come from a copy of the score read earlier, which the
+     *  file on disk may no longer match. Return the empty string if
+     *  the hash is empty.
+     */
+    static std::string makeKeyForContent(std::string contentHash,
+                                         std::string parameters);
+
+    /** Look up the cache entry for the given key. If it is present
+     *  and has a file for every one of the given extensions, copy
+     *  those files into scoreDir, named scoreName.<extension>, and
+     *  return their paths in the order of the extensions
+     *  given. Otherwise return an empty vector, having copied
+     *  nothing.
+     */
+    static std::vector<std::string> retrieve(std::string key,
+                                             std::vector<std::string> extensions,
+                                             std::string scoreDir,
+                                             std::string scoreName);
+
+    /** Store copies of the given files as the cache entry for the
+     *  given key. Each file is stored under its extension, so the
+     *  files must all have different extensions. The entry becomes
+     *  visible to retrieve() only once all of the files have been
+     *  written. Any stale entries found are removed. Return true on
+     *  success; failure to store is not fatal to anything but the
+     *  cache.
+     */
+    static bool store(std::string key, std::vector<std::string> files);
+
+    /** Return the full path of the file with the given extension in
+     *  the cache entry for the given key, or the empty string if
+     *  there is no such file. The file must not be modified.
+     */
+    static std::string getEntryFile(std::string key, std::string extension);
+
+    /** Record the given key as the latest one for the given score
+     *  name, generated with the given parameters (as for makeKey).
+     */
+    static void setLatestKey(std::string scoreName,
+                             std::string parameters,
+                             std::string key);
+
+    /** Return the key most recently recorded for the given score
+     *  name, or the empty string if there is none or it was recorded
+     *  with different parameters.
+     */
+    static std::string getLatestKey(std::string scoreName,
+                                    std::string parameters);
+
+    /** Remove the cache entry for the given key, unless it is the
+     *  latest key recorded for any score name. Call this with the
+     *  key a new one has replaced as the latest for some name, so
+     *  that the cache does not keep every version of a score.
+     */
+    static void removeUnlessLatest(std::string key);
+
+    /** Return the full path of the cache directory, creating it if
+     *  necessary, or the empty string if it cannot be created.
+     */
+    static std::string getCacheDirectory();
+};
+
+#endif
@@ -11,15 +11,17 @@
 */
 
 #include "ScoreParser.h"
+#include "ScoreCache.h"
+#include "BinaryScoreFile.h"
+#include "MeiMeasureTable.h"
 
 #include "verovio-replace/include/vrv/timemap.h"
 #include "verovio-replace/include/vrv/toolkit.h"
 #include "verovio/include/vrv/vrv.h"
 
-#include "jsonxx.h"
-
 #include "base/Debug.h"
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -31,6 +33,13 @@ using std::vector;
 #include <QString>
 #include <QStringList>
 
+static const string timemapOptions = "{\"includeMeasures\" : true,}";
+
+// Increment this whenever a change here alters the content of the
+// generated files, so that cached files from older versions are not
+// reused
+static const int generatedFormatVersion = 7;
+
 static void
 removeGeneratedFiles(const vector<string> files)
 {
@@ -48,7 +57,30 @@ removeGeneratedFiles(const vector<string> files)
 vector<string>
 ScoreParser::generateScoreFiles(string dir, string scoreName, string meiFile)
 {
-    vector<string> generatedFiles;
+    string parameters = "verovio " + vrv::GetVersion() +
+        "\nformat " + std::to_string(generatedFormatVersion) +
+        "\ntimemap " + timemapOptions;
+    
+    string cacheKey = ScoreCache::makeKey(meiFile, parameters);
+
+    // The cached files are copied into the score directory rather
+    // than used in place, because the aligner plugin looks for them
+    // there
+    auto cached = ScoreCache::retrieve
+        (cacheKey, { "json", "meter", "solo", BinaryScoreFile::extension },
+         dir, scoreName);
+    if (!cached.empty()) {
+        SVDEBUG << "ScoreParser::generateScoreFiles: Using cached files for "
+                << meiFile << endl;
+        ScoreCache::setLatestKey(scoreName, parameters, cacheKey);
+        return cached;
+    }
+
+    // If this score was generated before with different content, the
+    // previous run's binary file lets us skip unchanged measures
+    string previousBinaryFile = ScoreCache::getEntryFile
+        (ScoreCache::getLatestKey(scoreName, parameters),
+         BinaryScoreFile::extension);
     
     vrv::Toolkit toolkit(false);
 
@@ -57,35 +89,112 @@ ScoreParser::generateScoreFiles(string dir, string scoreName, string meiFile)
         SVDEBUG << "ScoreParser::generateScoreFiles: Failed to set Verovio resource path" << endl;
         return {};
     }
+
+    auto generated = generateScoreFiles(toolkit, dir, scoreName, meiFile,
+                                        previousBinaryFile);
+    if (!generated.empty() && ScoreCache::store(cacheKey, generated)) {
+        ScoreCache::setLatestKey(scoreName, parameters, cacheKey);
+    }
+    return generated;
+}
+
+/**
+ * Compare the measure table stored in the binary file from a previous
+ * run with that of the current MEI, and return a flag per measure
+ * saying whether its notes must be read again, or an empty vector if
+ * all of them must.
+ *
+ * Besides the measures the MEI comparison reports as affected, this
+ * includes any measure with a note that lasts up to or into a later
+ * affected measure, since an edit there may have added, removed or
+ * changed a tie that determines that note's duration.
+ */
+static vector<bool>
+findMeasuresToRecompute(const BinaryScoreFile &previous,
+                        const MeiMeasureTable &measureTable,
+                        const vector<int64_t> &measureStarts)
+{
+    vector<int> affected;
+    if (!MeiMeasureTable::getAffectedMeasures(previous.getMeasureTable(),
+                                              measureTable, affected)) {
+        return {};
+    }
+
+    int n = int(measureTable.getMeasures().size());
+    if (int(measureStarts.size()) < n) {
+        return {};
+    }
+    
+    vector<bool> recompute(n, false);
+    for (int m : affected) {
+        recompute[m] = true;
+    }
+
+    vector<int> nextAffected(n + 1, n);
+    for (int m = n - 1; m >= 0; --m) {
+        nextAffected[m] = (recompute[m] ? m : nextAffected[m + 1]);
+    }
+
+    vector<bool> result(recompute);
+    for (int i = 0; i < previous.getSourceNoteCount(); ++i) {
+        auto note = previous.getSourceNote(i);
+        int m = note.measureIndex - 1;
+        if (m < 0 || m >= n) {
+            return {};
+        }
+        if (recompute[m]) continue;
+        int next = nextAffected[m + 1];
+        if (next < n &&
+            measureStarts[m] + note.beat + note.duration >= measureStarts[next]) {
+            result[m] = true;
+        }
+    }
+
+    return result;
+}
+
+vector<string>
+ScoreParser::generateScoreFiles(vrv::Toolkit &toolkit,
+                                string dir, string scoreName, string meiFile,
+                                string previousBinaryFile,
+                                int *reusedMeasures)
+{
+    vector<string> generatedFiles;
+
+    if (reusedMeasures) *reusedMeasures = 0;
+    
     toolkit.LoadFile(meiFile);
 
-    jsonxx::Array timemap;
-    string option = "{\"includeMeasures\" : true,}";
+    vrv::Timemap timemap;
+    string option = timemapOptions;
     string timemapFilePath = dir + "/" + scoreName + ".json";
-    if (!toolkit.RenderToTimemapFile(timemapFilePath, option)) {
+    if (!toolkit.RenderToTimemapFile(timemapFilePath, option, timemap)) {
         SVDEBUG << "Failed to write timemap data to " << timemapFilePath << endl;
+        removeGeneratedFiles({ timemapFilePath });
         return {};
     }
     generatedFiles.push_back(timemapFilePath);
-    timemap.parse(toolkit.RenderToTimemap(option));
+
+    // After the timemap, so that this includes the pickup length
+    const vrv::ScoreMetadata metadata = toolkit.GetScoreMetadata();
 
     std::vector<string> meters; // could start from measure 1 or 0 (pickup)
-    for (int i = 0; i < int(timemap.size()); i++) {
-        auto event = timemap.get<jsonxx::Object>(i);
-        if (event.has<jsonxx::String>("meterSig")) {
-            string meter = event.get<jsonxx::String>("meterSig");
+    for (const auto &entry : timemap.GetEntries()) {
+        if (entry.meterSig != vrv::TIMEMAP_ID_NONE) {
+            auto meter = timemap.GetString(entry.meterSig);
             auto m = meter.find(" ");
-            meters.push_back(meter.substr(m+1));
+            meters.push_back(string(meter.substr(m+1)));
         }
     }
     // Writing to the .meter file
-    // vector<std::pair<int, string>> meterChanges;
+    vector<BinaryScoreFile::Meter> meterChanges;
     string outputString;
-    int offset = abs(1 - toolkit.HasPickupMeasure()); // start from measure 0 if there's pickup
+    int offset = metadata.hasPickup ? 0 : 1; // start from measure 0 if there's pickup
     for (int m = 0; m + 1 < int(meters.size()); m++) {
         if ((m == 0) || (meters.at(m) != meters.at(m-1))) {
             outputString += std::to_string(m+offset) + "\t" + meters.at(m) + "\n";
-            // meterChanges.push_back(std::pair<int, std::string>(m+offset, meters.at(m)));
+            vrv::Rational meter = vrv::Rational::fromString(meters.at(m));
+            meterChanges.push_back({ m+offset, int(meter.numerator), int(meter.denominator) });
         }
     }
     string outfile(dir + "/" + scoreName + ".meter");
@@ -100,75 +209,138 @@ ScoreParser::generateScoreFiles(string dir, string scoreName, string meiFile)
         return {};
     }
 
-    // Calculating cumulative fraction for the beginning of each measure
-    vector<vrv::Fraction> cumulativeMeasureFraction; // note that this is updated later if there is a pickup measure
-    if (meters.size() > 0)  cumulativeMeasureFraction.push_back(vrv::Fraction(0, 1));
+    // Calculating cumulative ticks for the beginning of each measure.
+    // Score times are carried as exact integer ticks from here on,
+    // and turned into reduced fractions only when writing the .solo
+    vector<int64_t> cumulativeMeasureTicks; // note that this is updated later if there is a pickup measure
+    if (meters.size() > 0)  cumulativeMeasureTicks.push_back(0);
     for (int m = 1; m < int(meters.size()); m++) {
-        cumulativeMeasureFraction.push_back(cumulativeMeasureFraction.back() + vrv::Fraction::fromString(meters.at(m-1)));
+        cumulativeMeasureTicks.push_back(cumulativeMeasureTicks.back() + vrv::Rational::fromString(meters.at(m-1)).toTicks());
+    }
+
+    // If we have the binary file generated from an earlier version of
+    // this score, find which measures could have changed since and
+    // read only those from Verovio, taking the rest from the earlier
+    // run. Verovio still has to load the whole score, and the timemap
+    // and meters above cover the whole of it, so those are always
+    // generated in full
+    MeiMeasureTable measureTable;
+    measureTable.read(meiFile);
+
+    BinaryScoreFile previous;
+    vector<bool> recompute; // per measure; empty if all are read
+    if (previousBinaryFile != "" && previous.open(previousBinaryFile)) {
+        recompute = findMeasuresToRecompute(previous, measureTable,
+                                            cumulativeMeasureTicks);
     }
 
     // Extracting individual notes
-    vector<vrv::SoloNote> soloNotes;
-    for (int i = 0; i < int(timemap.size()); i++) {
-        auto event = timemap.get<jsonxx::Object>(i);
-        if (event.has<jsonxx::Array>("on")) {
-            auto onNotes = event.get<jsonxx::Array>("on");
-            for (int n = 0; n < int(onNotes.size()); n++) {
-                string id = onNotes.get<jsonxx::String>(n);
-                jsonxx::Object times;
-                times.parse(toolkit.GetTimesForElement(id));
-                float tiedDur = times.get<jsonxx::Array>("scoreTimeTiedDuration").get<jsonxx::Number>(0);
-                if (tiedDur == -1) continue; // skipping tied notes that are not leading notes
-
-                vrv::SoloNote newNote;
-                newNote.measureIndex = toolkit.GetMeasureIndexForNote(id);
-
-                vrv::Fraction beat = toolkit.GetClosestFraction(times.get<jsonxx::Array>("scoreTimeOnset").get<jsonxx::Number>(0) / 4.);
-                newNote.beat = beat;
-
-                newNote.duration = tiedDur + times.get<jsonxx::Array>("scoreTimeDuration").get<jsonxx::Number>(0);
-                newNote.duration = newNote.duration / 4.;
-
-                jsonxx::Object note;
-                note.parse(toolkit.GetMIDIValuesForElement(id));
-                newNote.pitch = note.get<jsonxx::Number>("pitch");
-                if (newNote.pitch > 108 || newNote.pitch < 21) {
-                    SVDEBUG << "Pitch/midi = " << newNote.pitch << " out of range. Ignored." << endl;
-                    continue;
-                }
+    vrv::NoteTable noteTable;
+    if (!toolkit.GetNoteTable(noteTable,
+                              recompute.empty() ? nullptr : &recompute)) {
+        SVDEBUG << "Failed to obtain note table for " << meiFile << endl;
+        removeGeneratedFiles(generatedFiles);
+        return {};
+    }
 
-                newNote.noteId = id;
+    // Our measure numbering is Verovio's, so only if Verovio sees the
+    // same measures as the MEI table in the same order can we match
+    // them up
+    if (!recompute.empty()) {
+        const auto &measures = measureTable.getMeasures();
+        bool consistent = (noteTable.measureId.size() == measures.size());
+        for (size_t i = 0; consistent && i < measures.size(); ++i) {
+            consistent = (noteTable.measureId[i] == measures[i].id &&
+                          noteTable.measureIndexOf[i] == int(i) + 1);
+        }
+        if (!consistent) {
+            SVDEBUG << "ScoreParser: Measures in " << meiFile
+                    << " do not match the MEI table, reading all of them"
+                    << endl;
+            recompute.clear();
+            toolkit.GetNoteTable(noteTable);
+        }
+    }
+
+    auto readOnNotes = [&](const vrv::NoteTable &table) {
+        vector<vrv::SoloNote> notes;
+        notes.reserve(table.size());
+        for (size_t i = 0; i < table.size(); i++) {
+            if (!table.tieLeader[i]) continue; // skipping tied notes that are not leading notes
 
-                newNote.cumulative = cumulativeMeasureFraction.at(newNote.measureIndex-1) + newNote.beat;
+            vrv::SoloNote newNote;
+            newNote.measureIndex = table.measureIndex[i];
 
-                newNote.on = 1;
+            newNote.beat = table.onset[i];
 
-                soloNotes.push_back(newNote);
+            newNote.duration = table.tiedDuration[i] + table.duration[i];
+
+            newNote.pitch = table.pitch[i];
+            if (newNote.pitch > 108 || newNote.pitch < 21) {
+                SVDEBUG << "Pitch/midi = " << newNote.pitch << " out of range. Ignored." << endl;
+                continue;
             }
-        }
-    }
 
-    // Adding off notes to soloNotes
-    vector<vrv::SoloNote> lines = soloNotes;
-    for (const auto &note : soloNotes) {
-        if (!note.on)   continue;
-        vrv::Fraction end = note.cumulative + toolkit.GetClosestFraction(note.duration);
-        int endMeasure;
-        vrv::Fraction endBeat;
-        int m = 0;
-        while (m < int(meters.size()) && cumulativeMeasureFraction.at(m) < end)   m++;
-        if (m < int(meters.size()) && end == cumulativeMeasureFraction.at(m)) {
-            endMeasure = m+1;
-            endBeat = vrv::Fraction(0, 1);
+            newNote.noteId = table.noteId[i];
+
+            newNote.cumulative = cumulativeMeasureTicks.at(newNote.measureIndex-1) + newNote.beat;
+
+            newNote.on = 1;
+
+            notes.push_back(newNote);
+        }
+        return notes;
+    };
+    
+    vector<vrv::SoloNote> onNotes = readOnNotes(noteTable); // in document order
+
+    // Interleave the notes just read with those kept from the
+    // previous run, measure by measure, into the order a full read
+    // would have given. Both lists are in measure order; if either
+    // turns out not to be, give up and read everything
+    if (!recompute.empty()) {
+        vector<vrv::SoloNote> merged;
+        size_t i = 0;
+        int j = 0;
+        int nsource = previous.getSourceNoteCount();
+        int nmeasures = int(recompute.size());
+        for (int m = 1; m <= nmeasures; ++m) {
+            while (i < onNotes.size() && onNotes[i].measureIndex == m) {
+                merged.push_back(onNotes[i++]);
+            }
+            for (; j < nsource; ++j) {
+                auto note = previous.getSourceNote(j);
+                if (note.measureIndex != m) break;
+                if (recompute[m-1]) continue;
+                merged.push_back(vrv::SoloNote
+                                 (m, note.beat,
+                                  cumulativeMeasureTicks.at(m-1) + note.beat,
+                                  note.duration, note.pitch,
+                                  string(note.noteId), 1));
+            }
+        }
+        if (i == onNotes.size() && j == nsource) {
+            int nread = int(std::count(recompute.begin(), recompute.end(),
+                                       true));
+            SVDEBUG << "ScoreParser: Read " << nread
+                    << " of " << nmeasures << " measures from " << meiFile
+                    << ", kept the rest from the previous run" << endl;
+            onNotes = std::move(merged);
+            if (reusedMeasures) *reusedMeasures = nmeasures - nread;
         } else {
-            endMeasure = m;
-            endBeat = end - cumulativeMeasureFraction.at(m-1);
+            SVDEBUG << "ScoreParser: Notes out of measure order in "
+                    << meiFile << ", reading all of them" << endl;
+            toolkit.GetNoteTable(noteTable);
+            onNotes = readOnNotes(noteTable);
         }
-        vrv::SoloNote offNote = vrv::SoloNote(endMeasure, endBeat, end, note.duration, note.pitch, note.noteId, 0);
-        lines.push_back(offNote);
     }
+    previous.close();
 
-    std::sort(lines.begin(), lines.end(), [](vrv::SoloNote &a, vrv::SoloNote &b){
+    vector<vrv::SoloNote> lines = addOffNotes(onNotes, cumulativeMeasureTicks);
+
+    // Stable, so that notes that compare equal keep the note table's
+    // document order and the output does not vary between runs
+    std::stable_sort(lines.begin(), lines.end(), [](const vrv::SoloNote &a, const vrv::SoloNote &b){
         if (a.cumulative < b.cumulative)    return true;
         if (b.cumulative < a.cumulative)    return false;
         if (a.on < b.on)    return true;
@@ -179,17 +351,21 @@ ScoreParser::generateScoreFiles(string dir, string scoreName, string meiFile)
     });
 
     // Dealing with possible pickup measure by adjusting the initial measure and shifting other meaasures
-    // Note that cumulative fractions also need adjustments, but lines do not need to be resorted.
-    if (toolkit.HasPickupMeasure() && int(meters.size()) > 1) {
-        vrv::Fraction M = vrv::Fraction::fromString(meters.at(0));
-        vrv::Fraction L; // the actual length of the pickup measure. (TODO: not accurate if tied across the first measure)
+    // Note that cumulative ticks also need adjustments, but lines do not need to be resorted.
+    if (metadata.hasPickup && int(meters.size()) > 1) {
+        int64_t M = vrv::Rational::fromString(meters.at(0)).toTicks();
+        // The actual length of the pickup measure, from the notes
+        // written to the .solo file rather than from
+        // metadata.pickupLength, which also counts the cue notes and
+        // notes out of piano range that are left out of it
+        int64_t L = 0; // (TODO: not accurate if tied across the first measure)
         for (const auto &line : lines) {
             if (line.measureIndex == 1) {
                 L = line.cumulative;
             }
         }
-        for (int m = 1; m < int(meters.size()); m++) // adjusting cumulativeMeasureFraction
-            cumulativeMeasureFraction.at(m) = cumulativeMeasureFraction.at(m) - (M-L);
+        for (int m = 1; m < int(meters.size()); m++) // adjusting cumulativeMeasureTicks
+            cumulativeMeasureTicks.at(m) = cumulativeMeasureTicks.at(m) - (M-L);
 
         for (auto &line : lines) {
             if (line.measureIndex > 1) {
@@ -199,28 +375,31 @@ ScoreParser::generateScoreFiles(string dir, string scoreName, string meiFile)
                 line.measureIndex = 0;
                 line.beat = (M-L) + line.cumulative;
                 if (line.cumulative == L) { // (TODO: might not be accurate if tied across the first measure)
-                    line.beat = vrv::Fraction(0, 1);
+                    line.beat = 0;
                     line.measureIndex = 1;
                 }
             }
         }
     }
 
-    // Writing to the .solo file
-    string content;
-    for (const auto &line : lines) {
-        content += std::to_string(line.measureIndex) + "+" + std::to_string(line.beat.numerator) + "/" + std::to_string(line.beat.denominator) + "\t";
-        content += std::to_string(line.cumulative.numerator) + "/" + std::to_string(line.cumulative.denominator)  + "\t90\t";
-        content += std::to_string(line.pitch) + "\t";
-        if (line.on)    content += "80\t";
-        else    content += "0\t";
-        content += line.noteId + "\n";
-    }
+    // Writing to the .solo file, with times as reduced fractions of a whole note
     outfile = dir + "/" + scoreName + ".solo";
     std::ofstream file(outfile);
-    file << content;
+    auto writeFraction = [&file](int64_t ticks) {
+        vrv::Rational r = vrv::Rational::fromTicks(ticks).reduced();
+        file << r.numerator << '/' << r.denominator;
+    };
+    for (const auto &line : lines) {
+        file << line.measureIndex << '+';
+        writeFraction(line.beat);
+        file << '\t';
+        writeFraction(line.cumulative);
+        file << "\t90\t" << line.pitch << '\t' << (line.on ? "80" : "0")
+             << '\t' << line.noteId << '\n';
+    }
+    file.close();
     generatedFiles.push_back(outfile);
-    if (file.good()) {
+    if (!file.fail()) {
         SVDEBUG << "Wrote solo data to " << outfile << endl;
     } else {
         SVDEBUG << "Failed to write solo data to " << outfile << endl;
@@ -228,9 +407,58 @@ ScoreParser::generateScoreFiles(string dir, string scoreName, string meiFile)
         return {};
     }
 
+    // And the binary equivalent of .solo and .meter together
+    vector<BinaryScoreFile::Note> binaryNotes;
+    binaryNotes.reserve(lines.size());
+    for (const auto &line : lines) {
+        binaryNotes.push_back({ line.measureIndex, line.beat, line.cumulative,
+                                line.pitch, line.on ? 80 : 0, line.noteId });
+    }
+    vector<BinaryScoreFile::SourceNote> sourceNotes;
+    sourceNotes.reserve(onNotes.size());
+    for (const auto &note : onNotes) {
+        sourceNotes.push_back({ note.measureIndex, note.beat, note.duration,
+                                note.pitch, note.noteId });
+    }
+    outfile = dir + "/" + scoreName + "." + BinaryScoreFile::extension;
+    if (BinaryScoreFile::write(outfile, vrv::SCORE_TICKS_PER_WHOLE,
+                               binaryNotes, meterChanges,
+                               sourceNotes, measureTable)) {
+        generatedFiles.push_back(outfile);
+        SVDEBUG << "Wrote binary score data to " << outfile << endl;
+    } else {
+        SVDEBUG << "Failed to write binary score data to " << outfile << endl;
+        removeGeneratedFiles(generatedFiles);
+        return {};
+    }
+
     return generatedFiles;
 }
 
+vector<vrv::SoloNote>
+ScoreParser::addOffNotes(const vector<vrv::SoloNote> &onNotes,
+                         const vector<int64_t> &measureStarts)
+{
+    // Room for an on and an off line for every note, so that adding
+    // the off notes below never reallocates
+    vector<vrv::SoloNote> lines;
+    lines.reserve(2 * onNotes.size());
+    lines.insert(lines.end(), onNotes.begin(), onNotes.end());
+
+    // The measure an off note falls in is the last one starting at or
+    // before it, found by binary search over the measure starts
+    for (const auto &note : onNotes) {
+        int64_t end = note.cumulative + note.duration;
+        auto next = std::upper_bound(measureStarts.begin(),
+                                     measureStarts.end(), end);
+        int endMeasure = int(next - measureStarts.begin());
+        int64_t endBeat = end - measureStarts.at(endMeasure-1);
+        lines.push_back(vrv::SoloNote(endMeasure, endBeat, end, note.duration, note.pitch, note.noteId, 0));
+    }
+
+    return lines;
+}
+
 string
 ScoreParser::getResourcePath()
 {
@@ -13,9 +13,15 @@
 #ifndef SV_SCORE_PARSER_H
 #define SV_SCORE_PARSER_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
+namespace vrv {
+class Toolkit;
+struct SoloNote;
+}
+
 class ScoreParser
 {
 public:
@@ -29,6 +35,38 @@ public:
                                                        std::string scoreName,
                                                        std::string meiFile);
 
+    /** As above, but load the MEI file into the supplied Verovio
+     *  toolkit rather than constructing a new one. The toolkit's
+     *  resource path must already have been set. A toolkit may be
+     *  reused for any number of scores in turn, but must not be
+     *  used by more than one thread at a time.
+     *
+     *  If previousBinaryFile names the binary score file generated
+     *  from an earlier version of the same score, notes are taken
+     *  from it for any measures the MEI shows to be unaffected by
+     *  the changes since, and only the remaining measures are read
+     *  from Verovio. The output is the same either way. If
+     *  reusedMeasures is non-null, it receives the number of
+     *  measures taken from the earlier file, which is 0 if all were
+     *  read from Verovio.
+     */
+    static std::vector<std::string> generateScoreFiles(vrv::Toolkit &toolkit,
+                                                       std::string scoreDir,
+                                                       std::string scoreName,
+                                                       std::string meiFile,
+                                                       std::string previousBinaryFile = "",
+                                                       int *reusedMeasures = nullptr);
+
+    /** Return the given on notes followed by an off note for each,
+     *  placed in the measure its end falls in. An end exactly at a
+     *  measure boundary belongs to the measure starting there, at
+     *  beat 0. measureStarts holds the start of each measure in
+     *  ticks from the start of the score, the first being 0. The
+     *  result is not sorted.
+     */
+    static std::vector<vrv::SoloNote> addOffNotes(const std::vector<vrv::SoloNote> &onNotes,
+                                                  const std::vector<int64_t> &measureStarts);
+
     /** Obtain the resource path to pass to Verovio. Resources are
      *  unpacked from the binary bundle the first time this is called,
      *  so the resulting resource path is local to this invocation of
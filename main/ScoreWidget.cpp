@@ -11,24 +11,30 @@
 */
 
 #include "ScoreWidget.h"
+#include "ScoreCache.h"
 #include "ScoreFinder.h"
 #include "ScoreParser.h"
 
 #include <QPainter>
 #include <QMouseEvent>
 #include <QSvgRenderer>
-#include <QDomDocument>
-#include <QDomElement>
 #include <QToolButton>
 #include <QGridLayout>
 #include <QSettings>
+#include <QThread>
+#include <QThreadPool>
+#include <QTimer>
 
 #include "base/Debug.h"
 #include "widgets/IconLoader.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+#include <set>
 #include <vector>
 
-#include "verovio/include/vrv/toolkit.h"
+#include "verovio-replace/include/vrv/toolkit.h"
 #include "verovio/include/vrv/vrv.h"
 
 #include "vrvtrim.h"
@@ -40,6 +46,18 @@ static QColor navigateHighlightColour("#59c4df");
 static QColor editHighlightColour("#ffbd00");
 static QColor selectHighlightColour(150, 150, 255);
 
+// Upper limit on the memory taken by rasterised pages, in bytes. One
+// page at 4K with 32-bit pixels is about 32MB
+static const uint64_t rasterCacheBudget = 160 * 1024 * 1024;
+
+// Default number of pages to keep renderers for: the page shown, its
+// neighbours, and a few more recently shown
+static const int defaultPageRendererLimit = 6;
+
+// Serial numbers for rendered pages, assigned on whichever thread
+// the page is prepared
+static std::atomic<uint64_t> nextPageSerial(1);
+
 using std::vector;
 using std::pair;
 using std::string;
@@ -50,14 +68,37 @@ ScoreWidget::ScoreWidget(bool withZoomControls, QWidget *parent) :
     QFrame(parent),
     m_page(-1),
     m_scale(100),
+    m_renderedScale(0),
+    m_loadPool(new QThreadPool(this)),
+    m_rescaleTimer(new QTimer(this)),
+    m_pageUseClock(0),
+    m_pageRendererLimit(defaultPageRendererLimit),
+    m_prefetchPool(new QThreadPool(this)),
     m_mode(InteractionMode::None),
-    m_mouseActive(false)
+    m_noteUnderMouse(-1),
+    m_noteToHighlight(-1),
+    m_selectStart(-1),
+    m_selectEnd(-1),
+    m_mouseActive(false),
+    m_rasterCacheClock(0)
 {
     setFrameStyle(Panel | Plain);
     setMinimumSize(QSize(100, 100));
     setMouseTracking(true);
     m_verovioResourcePath = ScoreParser::getResourcePath();
 
+    m_prefetchPool->setMaxThreadCount(2);
+
+    QSettings settings;
+    settings.beginGroup("ScoreWidget");
+    m_pageRendererLimit = std::max(settings.value
+        ("pageRendererLimit", m_pageRendererLimit).toInt(), 3);
+    settings.endGroup();
+    
+    m_rescaleTimer->setSingleShot(true);
+    m_rescaleTimer->setInterval(150);
+    connect(m_rescaleTimer, &QTimer::timeout, this, &ScoreWidget::rescale);
+    
     if (withZoomControls) {
         sv::IconLoader il;
         auto zoomOut = new QToolButton;
@@ -80,7 +121,6 @@ ScoreWidget::ScoreWidget(bool withZoomControls, QWidget *parent) :
         layout->setColumnStretch(3, 10);
         setLayout(layout);
 
-        QSettings settings;
         settings.beginGroup("ScoreWidget");
         m_scale = settings.value("scale", m_scale).toInt();
         settings.endGroup();
@@ -89,7 +129,11 @@ ScoreWidget::ScoreWidget(bool withZoomControls, QWidget *parent) :
 
 ScoreWidget::~ScoreWidget()
 {
-
+    // Jobs in the load and prefetch pools call back into this object
+    cancelLoad();
+    m_loadPool->waitForDone();
+    m_prefetchPool->clear();
+    m_prefetchPool->waitForDone();
 }
 
 QString
@@ -117,20 +161,9 @@ ScoreWidget::setScale(int scale)
         return;
     }
     m_scale = scale;
-    auto scoreName = m_scoreName;
-    auto scoreFilename = m_scoreFilename;
-    auto musicalEvents = m_musicalEvents;
-    QString errorString;
-    if (!loadScoreFile(scoreName, scoreFilename, errorString)) {
-        SVCERR << "ScoreWidget::setScale: Failed to reload score "
-               << scoreName << ": " << errorString << endl;
-        return;
-    }
-    setMusicalEvents(musicalEvents);
-    if (m_highlightEventLabel != "") {
-        setHighlightEventByLabel(m_highlightEventLabel);
-    }
-    update();
+
+    // Zoom steps in quick succession are gathered into one relayout
+    m_rescaleTimer->start();
     
     QSettings settings;
     settings.beginGroup("ScoreWidget");
@@ -138,731 +171,1320 @@ ScoreWidget::setScale(int scale)
     settings.endGroup();
 }
 
-int
-ScoreWidget::getScale() const
+void
+ScoreWidget::rescale()
 {
-    return m_scale;
-}
+    if (m_scoreFilename == "" || m_scale == m_renderedScale) {
+        return;
+    }
 
-bool
-ScoreWidget::loadScoreFile(QString scoreName, QString scoreFile, QString &errorString)
-{
-    clearSelection();
+    // Lay out the document already loaded in the toolkit again at
+    // the new scale, render the page being shown straight away, and
+    // leave the rest to a background job. The toolkit belongs to
+    // that job until it is done, so if it is still running, take
+    // the toolkit back from it
+    
+    auto toolkit = m_toolkit;
+    string contentHash = m_toolkitContentHash;
+    if (!toolkit && m_currentLoad && m_currentLoad->rescaling) {
+        auto job = m_currentLoad;
+        cancelLoad();
+        std::lock_guard<std::mutex> guard(job->toolkitMutex);
+        toolkit = job->toolkit;
+        contentHash = job->contentHash;
+    }
 
-    if (m_verovioResourcePath == "") {
-        SVDEBUG << "ScoreWidget::loadScoreFile: No Verovio resource path available" << endl;
-        errorString = "No Verovio resource path available: application was not packaged properly";
-        return false;
+    // A score being loaded in the background is laid out at the
+    // scale its load started with. Wait for it to finish and then
+    // lay it out again, rather than reloading it here on the GUI
+    // thread
+    if (isLoading()) {
+        m_rescaleTimer->start();
+        return;
     }
     
-    clearSelection();
-
-    m_svgPages.clear();
-    m_noteSystemExtentMap.clear();
-
-    m_highlightEventLabel = {};
-    m_eventToHighlight = {};
-    m_selectStart = {};
-    m_selectEnd = {};
+    // If the pages at this scale are in the cache, or there is
+    // nothing loaded fully yet to lay out again, reload instead -
+    // passing on any toolkit, so as not to load the file again if
+    // the cache turns out not to have them after all. The key is
+    // that of the document in the toolkit, not of the file as it is
+    // now, since it is the toolkit's document we would lay out
     
-    m_page = -1;
+    string cacheKey = SvgPageCache::makeKey
+        (contentHash, getLayoutOptions(m_scale), m_scale);
     
-    SVDEBUG << "ScoreWidget::loadScoreFile: Asked to load MEI file \""
-            << scoreFile << "\" for score \"" << scoreName << "\"" << endl;
-
-    vrv::Toolkit toolkit(false);
-    if (!toolkit.SetResourcePath(m_verovioResourcePath)) {
-        SVDEBUG << "ScoreWidget::loadScoreFile: Failed to set Verovio resource path" << endl;
-        return false;
+    if (!toolkit || SvgPageCache::contains(cacheKey)) {
+
+        auto scoreName = m_scoreName;
+        auto scoreFilename = m_scoreFilename;
+        auto musicalEvents = m_musicalEvents;
+        QString errorString;
+        if (!loadScoreFile(scoreName, scoreFilename, toolkit, contentHash,
+                           errorString)) {
+            SVCERR << "ScoreWidget::rescale: Failed to reload score "
+                   << scoreName << ": " << errorString << endl;
+            emit loadFailed(scoreName, errorString);
+            return;
+        }
+        setMusicalEvents(musicalEvents);
+        if (m_highlightEventLabel != "") {
+            setHighlightEventByLabel(m_highlightEventLabel);
+        }
+        update();
+        return;
     }
 
-    string defaultOptions = "\"footer\": \"none\"";
+    SVDEBUG << "ScoreWidget::rescale: Laying out score \"" << m_scoreName
+            << "\" again at scale " << m_scale << endl;
     
-    if (m_scale != 100) {
-        toolkit.SetOptions("{\"scaleToPageSize\": true, " + defaultOptions + "}");
-        if (!toolkit.SetScale(m_scale)) {
-            SVDEBUG << "ScoreWidget::loadScoreFile: Failed to set rendering scale" << endl;
-        } else {
-            SVDEBUG << "ScoreWidget::loadScoreFile: Set scale to " << m_scale << endl;
-        }
-        SVDEBUG << "options: " << toolkit.GetOptions() << endl;
-    } else {
-        toolkit.SetOptions("{" + defaultOptions + "}");
+    clearSelection();
+
+    // Keep the first measure of the current page in view
+    string anchorMeasure;
+    if (m_page >= 0 && m_page < int(m_renderedPages.size()) &&
+        !m_renderedPages[m_page].measureIds.empty()) {
+        anchorMeasure = m_renderedPages[m_page].measureIds[0];
     }
     
-    if (!toolkit.LoadFile(scoreFile.toStdString())) {
-        SVDEBUG << "ScoreWidget::loadScoreFile: Load failed in Verovio toolkit" << endl;
-        return false;
-    }
-
-    int pp = toolkit.GetPageCount();
+    m_toolkit = {};
+    m_toolkitContentHash = {};
+    m_renderedScale = 0;
+    
+    applyScale(*toolkit, m_scale);
+    toolkit->RedoLayout();
 
-    SVDEBUG << "ScoreWidget::loadScoreFile: Have " << pp << " pages" << endl;
+    int pp = toolkit->GetPageCount();
+    int target = 0;
     
+    m_svgPages = vector<shared_ptr<QSvgRenderer>>(pp);
+    m_pageLastUsed = vector<uint64_t>(pp, 0);
+    m_renderedPages = vector<RenderedPage>(pp);
     for (int p = 0; p < pp; ++p) {
+        m_renderedPages[p].measureIds = toolkit->GetMeasureIDsOnPage(p + 1);
+        if (anchorMeasure != "" &&
+            std::find(m_renderedPages[p].measureIds.begin(),
+                      m_renderedPages[p].measureIds.end(),
+                      anchorMeasure) != m_renderedPages[p].measureIds.end()) {
+            target = p;
+        }
+    }
 
-        std::string svgText = toolkit.RenderToSVG(p + 1); // (verovio is 1-based)
-
-        // Verovio generates SVG 1.1, this transforms its output to
-        // SVG 1.2 Tiny required by Qt
-        svgText = VrvTrim::transformSvgToTiny(svgText);
-
-        QByteArray svgData = QByteArray::fromStdString(svgText);
-        
-        shared_ptr<QSvgRenderer> renderer = make_shared<QSvgRenderer>(svgData);
-        renderer->setAspectRatioMode(Qt::KeepAspectRatio);
-
-        SVDEBUG << "ScoreWidget::showPage: created renderer from "
-                << svgData.size() << "-byte SVG data" << endl;
-
-        m_svgPages.push_back(renderer);
+    // The notes are found again from m_musicalEvents once all the
+    // pages are back. The events, and so the selection, stay as they
+    // are
+    clearNotes();
 
-        findSystemExtents(svgData, renderer);
+    if (pp == 0) {
+        m_toolkit = toolkit;
+        m_toolkitContentHash = contentHash;
+        m_page = -1;
+        update();
+        return;
     }
     
-    m_scoreName = scoreName;
-    m_scoreFilename = scoreFile;
-
-    SVDEBUG << "ScoreWidget::loadScoreFile: Load successful, showing first page"
-            << endl;
-    showPage(0);
-    return true;
-}
-
-
-void
-ScoreWidget::findSystemExtents(QByteArray svgData, shared_ptr<QSvgRenderer> renderer)
-{
-    // Study the system dimensions in order to calculate proper
-    // highlight positions, and add them to m_noteSystemExtentMap.
-
-    // We are now parsing the SVG XML in three different ways! But I
-    // still don't think it's a significant overhead
+    // The converted pages are kept to store in the cache once they
+    // are all done. Each is written only by the job converting it
+    auto converted = make_shared<vector<SvgPageCache::Page>>(pp);
     
-    QDomDocument doc;
-    doc.setContent(svgData);
+    LoadedPage visible;
+    visible.page = target;
+    visible.pageCount = pp;
+    visible.reusedFrom = -1;
+    (*converted)[target] = convertPage(toolkit->RenderToSVG(target + 1));
+    preparePage((*converted)[target], thread(), true, visible);
+    setLoadedPage(std::move(visible));
 
-    Extent currentExtent;
-    vector<double> staffLines;
+    m_page = -1;
+    showPage(target);
 
-    auto extractExtent = [&](QDomElement path,
-                             QString systemId,
-                             QString staffId) -> Extent {
-        
-        // We're looking for a path of the form Mx0 y0 Lx1 y1
-        
-        QStringList dd = path.attribute("d").split(" ", Qt::SkipEmptyParts);
-        if (dd.size() != 4) return {};
+    // Then the rest, nearest the visible page first
+    vector<int> order;
+    for (int d = 1; d < pp; ++d) {
+        if (target + d < pp) order.push_back(target + d);
+        if (target - d >= 0) order.push_back(target - d);
+    }
 
-        if (dd[0].startsWith("M", Qt::CaseInsensitive)) {
-            dd[0] = dd[0].right(dd[0].length()-1);
-        } else return {};
+    vector<vector<string>> measureIds;
+    for (const auto &rp : m_renderedPages) {
+        measureIds.push_back(rp.measureIds);
+    }
+    
+    auto job = make_shared<LoadJob>();
+    job->rescaling = true;
+    job->toolkit = toolkit;
+    job->contentHash = contentHash;
+    job->scale = m_scale;
+    m_currentLoad = job;
+
+    QThread *guiThread = thread();
+    string scoreName = m_scoreName.toStdString();
+    int scale = m_scale;
+    
+    m_loadPool->start([this, job, order, pp, target, guiThread, converted,
+                       measureIds, cacheKey, scoreName, scale]() {
 
-        if (dd[2].startsWith("L", Qt::CaseInsensitive)) {
-            dd[2] = dd[2].right(dd[2].length()-1);
-        } else return {};
+        QThreadPool pool;
         
-        bool ok = false;
-        double x0 = dd[0].toDouble(&ok); if (!ok) return {};
-        double y0 = dd[1].toDouble(&ok); if (!ok) return {};
-        double x1 = dd[2].toDouble(&ok); if (!ok) return {};
-        double y1 = dd[3].toDouble(&ok); if (!ok) return {};
-        
-        if (systemId != "" && y1 > y0 && x1 == x0) {
-#ifdef DEBUG_SCORE_WIDGET
-            SVDEBUG << "Found possible extent for system with id \""
-                    << systemId << "\": from "
-                    << y0 << " -> " << y1 << endl;
-#endif
-            QRectF mapped = renderer->transformForElement(systemId)
-                .mapRect(QRectF(0, y0, 1, y1 - y0));
-            return Extent(mapped.y(), mapped.height());
-        }
+        for (int p : order) {
 
-        if (staffId != "" && x1 > x0 && y1 == y0 &&
-            staffLines.size() < 5) {
-#ifdef DEBUG_SCORE_WIDGET
-            SVDEBUG << "Found possible staff line for staff with id \""
-                    << staffId << "\": from "
-                    << x0 << " to " << x1 << " at y = " << y0 << endl;
-#endif
-            staffLines.push_back(y0);
-            if (staffLines.size() == 5) {
-                y0 = staffLines[0];
-                y1 = staffLines[4];
-#ifdef DEBUG_SCORE_WIDGET
-                SVDEBUG << "Deducing extent from staff lines as "
-                        << y0 << " -> " << y1 << endl;
-#endif
-                QRectF mapped = renderer->transformForElement(staffId)
-                    .mapRect(QRectF(0, y0, 1, y1 - y0));
-                return Extent(mapped.y(), mapped.height());
+            std::string svgText;
+            {
+                std::lock_guard<std::mutex> guard(job->toolkitMutex);
+                if (job->cancelled) {
+                    break;
+                }
+                svgText = job->toolkit->RenderToSVG(p + 1);
             }
-        }                
-        
-        return {};
-    };
-    
-    std::function<void(QDomNode, QString, QString)> descend =
-        [&](QDomNode node, QString systemId, QString staffId) {
 
-        if (!node.isElement()) {
-            return;
-        }
-
-        QDomElement elt = node.toElement();
-        QString tag = elt.tagName();
-
-        if (systemId != "" || staffId != "") {
-            if (currentExtent.isNull() && tag == "path") {
-                // Haven't yet seen system dimensions, defined using
-                // either the vertical path that joins the systems, or
-                // if there is only one staff, locations of the first
-                // and fifth staff lines. This might be one of the
-                // bits of evidence we need
-                currentExtent = extractExtent(elt, systemId, staffId);
-            }
+            bool withRenderer = (std::abs(p - target) <= 1);
+            
+            pool.start([this, job, p, pp, svgText, guiThread, converted,
+                        withRenderer]() {
+                LoadedPage page;
+                page.page = p;
+                page.pageCount = pp;
+                page.reusedFrom = -1;
+                (*converted)[p] = convertPage(svgText);
+                preparePage((*converted)[p], guiThread, withRenderer, page);
+                QMetaObject::invokeMethod
+                    (this, [this, job, page]() {
+                        if (job != m_currentLoad) return;
+                        setLoadedPage(page);
+                    }, Qt::QueuedConnection);
+            });
         }
-        
-        if (tag == "g") {
-            // The remaining elements we're interested in (system,
-            // staff, note) are all defined using group tags in SVG
 
-            QStringList classes =
-                elt.attribute("class").split(" ", Qt::SkipEmptyParts);
-
-            if (systemId == "" && classes.contains("system")) {
-                systemId = elt.attribute("id");
-                currentExtent = {};
-            }
+        pool.waitForDone();
 
-            if (staffId == "" && classes.contains("staff")) {
-                staffId = elt.attribute("id");
-                staffLines.clear();
-                if (systemId == "") { // a staff outside a system
-                    currentExtent = {};
-                }
-            }
-            
-            if (!currentExtent.isNull() && classes.contains("note")) {
-                QString noteId = elt.attribute("id");
-                if (noteId != "") {
-#ifdef DEBUG_EVENT_FINDING
-                    SVDEBUG << "Assigning system extent ("
-                            << currentExtent.y << ","
-                            << currentExtent.height
-                            << ") to note with id \"" << noteId << "\"" << endl;
-#endif
-                    m_noteSystemExtentMap[noteId] = currentExtent;
-                }
+        if (!job->cancelled) {
+            for (int p = 0; p < pp; ++p) {
+                (*converted)[p].measureIds = measureIds[p];
             }
+            SvgPageCache::store(cacheKey, *converted, scoreName, scale);
         }
-            
-        auto children = node.childNodes();
-        for (int i = 0; i < children.size(); ++i) {
-            descend(children.at(i), systemId, staffId);
-        }
-    };
-
-    descend(doc.documentElement(), "", "");
-}                       
+        
+        QMetaObject::invokeMethod
+            (this, [this, job]() {
+                if (job != m_currentLoad) return;
+                m_currentLoad = {};
+                finishRescale(job);
+            }, Qt::QueuedConnection);
+    });
+}
 
 void
-ScoreWidget::setMusicalEvents(const Score::MusicalEventList &events)
+ScoreWidget::setLoadedPage(LoadedPage page)
 {
-    m_musicalEvents = events;
-
-#ifdef DEBUG_SCORE_WIDGET
-    SVDEBUG << "ScoreWidget::setMusicalEvents: " << events.size()
-            << " events" << endl;
-#endif
-
-    m_idDataMap.clear();
-    m_labelIdMap.clear();
-    m_pageEventsMap.clear();
-    
-    if (m_svgPages.empty()) {
-        SVDEBUG << "ScoreWidget::setMusicalEvents: WARNING: No SVG pages, score should have been set before this" << endl;
+    if (page.page < 0 || page.page >= int(m_svgPages.size())) {
+        SVCERR << "ScoreWidget::setLoadedPage: Page " << page.page
+               << " out of range" << endl;
         return;
     }
-    
-    int p = 0;
-    int npages = m_svgPages.size();
-    int ix = 0;
-    
-    for (const auto &ev : m_musicalEvents) {
-        for (const auto &n : ev.notes) {
-            if (!n.isNewNote) {
-                continue;
-            }
-            EventId id = QString::fromStdString(n.noteId);
-            if (id == "") {
-                SVDEBUG << "ScoreWidget::setMusicalEvents: NOTE: found note with no id" << endl;
-                continue;
-            }
-            if (p + 1 < npages &&
-                !m_svgPages[p]->elementExists(id) &&
-                m_svgPages[p + 1]->elementExists(id)) {
-                ++p;
-            }
-
-            if (m_svgPages[p]->elementExists(id)) {
 
-                QRectF rect = m_svgPages[p]->boundsOnElement(id); 
-                rect = m_svgPages[p]->transformForElement(id).mapRect(rect);
-
-#ifdef DEBUG_EVENT_FINDING
-                SVDEBUG << "found note id " << id << " for event at "
-                        << ev.measureInfo.toLabel()
-                        << " -> page " << p << ", rect "
-                        << rect.x() << "," << rect.y() << " " << rect.width()
-                        << "x" << rect.height() << endl;
-#endif
-
-                EventData data;
-                data.id = id;
-                data.page = p;
-                data.boxOnPage = rect;
-                data.location = ev.measureInfo.measureFraction;
-                data.label = ev.measureInfo.toLabel();
-                data.indexInEvents = ix;
-                m_idDataMap[id] = data;
-                m_pageEventsMap[p].push_back(id);
-                m_labelIdMap[data.label] = id;
-            }
-        }
-        ++ix;
+    if (page.rendered.svg.isEmpty()) {
+        SVCERR << "ScoreWidget::setLoadedPage: No SVG for page "
+               << page.page << endl;
+        return;
     }
 
-#ifdef DEBUG_SCORE_WIDGET
-    SVDEBUG << "ScoreWidget::setMusicalEvents: Done" << endl;
-#endif
-}
+    // Only the pages near the one shown come with a renderer; the
+    // rest have theirs made when they are wanted
 
-void
-ScoreWidget::resizeEvent(QResizeEvent *)
-{
-    if (m_page >= 0) {
-        showPage(m_page);
+    // The measure ids were set when the layout was done
+    RenderedPage &rendered = m_renderedPages[page.page];
+    page.rendered.measureIds = std::move(rendered.measureIds);
+    rendered = std::move(page.rendered);
+    
+    installPageRenderer(page.page, page.renderer, false);
+
+    if (page.page == m_page) {
+        update();
     }
 }
 
 void
-ScoreWidget::enterEvent(QEnterEvent *)
+ScoreWidget::finishRescale(std::shared_ptr<LoadJob> job)
 {
-    m_mouseActive = true;
-    update();
-}
+    m_toolkit = job->toolkit;
+    m_toolkitContentHash = job->contentHash;
+    m_renderedScale = job->scale;
+    pruneRasterCache();
 
-void
-ScoreWidget::leaveEvent(QEvent *)
-{
-    if (m_mouseActive) {
-        emit interactionEnded(m_mode);
+    SVDEBUG << "ScoreWidget::finishRescale: Laid out " << m_svgPages.size()
+            << " pages at scale " << m_renderedScale << endl;
+    
+    setMusicalEvents(m_musicalEvents);
+    if (m_highlightEventLabel != "") {
+        setHighlightEventByLabel(m_highlightEventLabel);
     }
-    m_mouseActive = false;
     update();
+    
+    emit pageChanged(m_page);
 }
 
-void
-ScoreWidget::mouseMoveEvent(QMouseEvent *e)
+string
+ScoreWidget::getLayoutOptions(int scale)
 {
-    if (!m_mouseActive) return;
-
-    m_eventUnderMouse = getEventAtPoint(e->pos());
-
-#ifdef DEBUG_SCORE_WIDGET
-    SVDEBUG << "ScoreWidget::mouseMoveEvent: id under mouse = "
-            << m_eventUnderMouse.id << endl;
-#endif
+    string defaultOptions = "\"footer\": \"none\"";
     
-    update();
-
-    if (!m_eventUnderMouse.isNull()) {
-#ifdef DEBUG_SCORE_WIDGET
-        SVDEBUG << "ScoreWidget::mouseMoveEvent: Emitting scorePositionHighlighted at " << m_eventUnderMouse.location << endl;
-#endif
-        emit scoreLocationHighlighted(m_eventUnderMouse.location,
-                                      m_eventUnderMouse.label,
-                                      m_mode);
+    if (scale != 100) {
+        return "{\"scaleToPageSize\": true, " + defaultOptions + "}";
+    } else {
+        return "{\"scaleToPageSize\": false, " + defaultOptions + "}";
     }
 }
 
 void
-ScoreWidget::mousePressEvent(QMouseEvent *e)
+ScoreWidget::applyScale(vrv::Toolkit &toolkit, int scale)
 {
-    if (e->button() != Qt::LeftButton) {
-        return;
-    }
+    toolkit.SetOptions(getLayoutOptions(scale));
     
-    mouseMoveEvent(e);
-
-    if (!m_musicalEvents.empty() && !m_eventUnderMouse.isNull() &&
-        (m_mode == InteractionMode::SelectStart ||
-         m_mode == InteractionMode::SelectEnd)) {
-
-        if (m_mode == InteractionMode::SelectStart) {
-            m_selectStart = m_eventUnderMouse;
-            if (!(m_selectStart.location < m_selectEnd.location)) {
-                m_selectEnd = {};
-            }
-        } else {
-            m_selectEnd = m_eventUnderMouse;
-            if (!(m_selectStart.location < m_selectEnd.location)) {
-                m_selectStart = {};
-            }
-        }
-        
-#ifdef DEBUG_SCORE_WIDGET
-        SVDEBUG << "ScoreWidget::mousePressEvent: Set select start to "
-                << m_selectStart.location << " and end to "
-                << m_selectEnd.location << endl;
-#endif
-
-        auto start = m_selectStart;
-        auto end = m_selectEnd;
-        if (start.isNull()) start = getScoreStartEvent();
-        if (end.isNull()) end = getScoreEndEvent();
-        emit selectionChanged(start.location,
-                              isSelectedFromStart(),
-                              start.label,
-                              end.location,
-                              isSelectedToEnd(),
-                              end.label);
-        update();
+    if (!toolkit.SetScale(scale)) {
+        SVDEBUG << "ScoreWidget::applyScale: Failed to set rendering scale" << endl;
+    } else {
+        SVDEBUG << "ScoreWidget::applyScale: Set scale to " << scale << endl;
     }
+}
 
-    if (!m_eventUnderMouse.isNull()) {
-#ifdef DEBUG_SCORE_WIDGET
-        SVDEBUG << "ScoreWidget::mousePressEvent: Emitting scorePositionActivated at " << m_eventUnderMouse.location << endl;
-#endif
-        emit scoreLocationActivated(m_eventUnderMouse.location,
-                                    m_eventUnderMouse.label,
-                                    m_mode);
-        update();
-    }
+SvgPageCache::Page
+ScoreWidget::convertPage(const std::string &svgText)
+{
+    // Verovio generates SVG 1.1, this transforms its output to SVG
+    // 1.2 Tiny required by Qt. The page size, the system extents
+    // used for highlighting, and the note boxes used to place events
+    // are found in the same pass
+    SvgPageCache::Page converted;
+    converted.svg = QByteArray::fromStdString
+        (VrvTrim::transformSvgToTiny(svgText, converted.geometry));
+    return converted;
 }
 
 void
-ScoreWidget::clearSelection()
+ScoreWidget::preparePage(const SvgPageCache::Page &converted,
+                         QThread *guiThread, bool withRenderer,
+                         LoadedPage &page)
 {
-#ifdef DEBUG_SCORE_WIDGET
-    SVDEBUG << "ScoreWidget::clearSelection" << endl;
-#endif
+    page.rendered.serial = nextPageSerial++;
+    page.rendered.svg = converted.svg;
+    page.rendered.geometry = converted.geometry;
 
-    if (m_selectStart.isNull() && m_selectEnd.isNull()) {
+    if (!withRenderer) {
         return;
     }
+    
+    auto renderer = make_shared<QSvgRenderer>(converted.svg);
+    renderer->setAspectRatioMode(Qt::KeepAspectRatio);
 
-    m_selectStart = {};
-    m_selectEnd = {};
-
-    emit selectionChanged(m_selectStart.location,
-                          true,
-                          getScoreStartEvent().label,
-                          m_selectEnd.location,
-                          true,
-                          getScoreEndEvent().label);
-
-    update();
+    // Created here, but used only from the GUI thread
+    renderer->moveToThread(guiThread);
+    
+    page.renderer = renderer;
 }
 
-void
-ScoreWidget::zoomIn()
+int
+ScoreWidget::getScale() const
 {
-    if (m_scale < 240) {
-        setScale(m_scale + 20);
-    }
+    return m_scale;
 }
 
 void
-ScoreWidget::zoomOut()
+ScoreWidget::setPageRendererLimit(int pages)
 {
-    if (m_scale > 20) {
-        setScale(m_scale - 20);
-    }
+    // The page shown and its two neighbours are always kept
+    m_pageRendererLimit = std::max(pages, 3);
+    evictPageRenderers();
+
+    QSettings settings;
+    settings.beginGroup("ScoreWidget");
+    settings.setValue("pageRendererLimit", m_pageRendererLimit);
+    settings.endGroup();
 }
 
-void
-ScoreWidget::zoomReset()
+int
+ScoreWidget::getPageRendererLimit() const
 {
-    setScale(100);
+    return m_pageRendererLimit;
 }
 
-ScoreWidget::EventData
-ScoreWidget::getScoreStartEvent() const
+bool
+ScoreWidget::loadScoreFile(QString scoreName, QString scoreFile, QString &errorString)
 {
-    if (m_musicalEvents.empty()) return {};
-    return getEventForMusicalEvent(*m_musicalEvents.begin());
+    return loadScoreFile(scoreName, scoreFile, {}, {}, errorString);
 }
 
 bool
-ScoreWidget::isSelectedFromStart() const
+ScoreWidget::loadScoreFile(QString scoreName, QString scoreFile,
+                           shared_ptr<vrv::Toolkit> toolkit,
+                           string toolkitContentHash,
+                           QString &errorString)
 {
-    return (m_musicalEvents.empty() ||
-            m_selectStart.isNull() ||
-            m_selectStart.indexInEvents == 0);
-}
+    cancelLoad();
+    
+    LoadRequest request = beginLoad(scoreName, scoreFile);
+    request.toolkit = toolkit;
+    request.toolkitContentHash = toolkitContentHash;
 
-ScoreWidget::EventData
-ScoreWidget::getScoreEndEvent() const
-{
-    if (m_musicalEvents.empty()) return {};
-    return getEventForMusicalEvent(*m_musicalEvents.rbegin());
-}
+    SVDEBUG << "ScoreWidget::loadScoreFile: Asked to load MEI file \""
+            << scoreFile << "\" for score \"" << scoreName << "\"" << endl;
 
-ScoreWidget::EventData
-ScoreWidget::getEventForMusicalEvent(const Score::MusicalEvent &mev) const
-{
-    if (mev.notes.empty()) return {};
-    return getEventWithId(mev.notes.begin()->noteId);
-}
+    // renderPages calls back in page order, one call at a time, and
+    // returns only once all calls have been made
+    vector<LoadedPage> pages;
+    std::atomic<bool> cancelled(false);
+    MeiMeasureTable measureTable;
+    string contentHash;
+    if (!renderPages(request, thread(), cancelled,
+                     [&](LoadedPage page) {
+                         pages.push_back(std::move(page));
+                     },
+                     measureTable, toolkit, contentHash, errorString)) {
+        return false;
+    }
 
-ScoreWidget::EventData
-ScoreWidget::getEventWithId(EventId id) const
-{
-    auto itr = m_idDataMap.find(id);
-    if (itr == m_idDataMap.end()) {
-        return {};
+    for (auto &page : pages) {
+        addLoadedPage(std::move(page));
     }
-    return itr->second;
+    finishLoad(request, measureTable, toolkit, contentHash);
+    return true;
 }
 
-ScoreWidget::EventData
-ScoreWidget::getEventWithId(const std::string &id) const
+void
+ScoreWidget::loadScoreFileAsync(QString scoreName, QString scoreFile)
 {
-    return getEventWithId(QString::fromStdString(id));
+    cancelLoad();
+
+    LoadRequest request = beginLoad(scoreName, scoreFile);
+
+    SVDEBUG << "ScoreWidget::loadScoreFileAsync: Asked to load MEI file \""
+            << scoreFile << "\" for score \"" << scoreName << "\"" << endl;
+    
+    auto job = make_shared<LoadJob>();
+    m_currentLoad = job;
+
+    // Results are posted back to this thread, and dropped there if
+    // the load has been cancelled or superseded by then. The
+    // destructor waits for the pool, so this outlives the job
+    QThread *guiThread = thread();
+    
+    m_loadPool->start([this, job, request, guiThread]() {
+
+        MeiMeasureTable measureTable;
+        shared_ptr<vrv::Toolkit> toolkit;
+        string contentHash;
+        QString errorString;
+        
+        bool ok = renderPages
+            (request, guiThread, job->cancelled,
+             [this, job](LoadedPage page) {
+                 QMetaObject::invokeMethod
+                     (this, [this, job, page]() {
+                         if (job != m_currentLoad) return;
+                         QString scoreName = m_scoreName;
+                         int pageCount = page.pageCount;
+                         addLoadedPage(page);
+                         emit loadProgress(scoreName, getPageCount(), pageCount);
+                     }, Qt::QueuedConnection);
+             },
+             measureTable, toolkit, contentHash, errorString);
+
+        QMetaObject::invokeMethod
+            (this, [this, job, request, ok, measureTable, toolkit,
+                    contentHash, errorString]() {
+                if (job != m_currentLoad) return;
+                m_currentLoad = {};
+                if (ok) {
+                    finishLoad(request, measureTable, toolkit, contentHash);
+                } else {
+                    SVDEBUG << "ScoreWidget::loadScoreFileAsync: Failed to load score \""
+                            << request.scoreName << "\": " << errorString << endl;
+                    emit loadFailed(request.scoreName, errorString);
+                }
+            }, Qt::QueuedConnection);
+    });
 }
 
-ScoreWidget::EventData
-ScoreWidget::getEventWithLabel(EventLabel label) const
+void
+ScoreWidget::cancelLoad()
 {
-    if (m_labelIdMap.find(label) == m_labelIdMap.end()) return {};
-    return getEventWithId(m_labelIdMap.at(label));
+    if (m_currentLoad) {
+        SVDEBUG << "ScoreWidget::cancelLoad: Cancelling load of score \""
+                << m_scoreName << "\"" << endl;
+        m_currentLoad->cancelled = true;
+        m_currentLoad = {};
+    }
 }
 
 bool
-ScoreWidget::isSelectedToEnd() const
+ScoreWidget::isLoading() const
 {
-    return (m_musicalEvents.empty() ||
-            m_selectEnd.isNull() ||
-            m_selectEnd.indexInEvents + 1 >= int(m_musicalEvents.size()));
+    return bool(m_currentLoad);
 }
 
-bool
-ScoreWidget::isSelectedAll() const
+ScoreWidget::LoadRequest
+ScoreWidget::beginLoad(QString scoreName, QString scoreFile)
 {
-    return isSelectedFromStart() && isSelectedToEnd();
+    clearSelection();
+
+    LoadRequest request;
+    request.scoreName = scoreName;
+    request.scoreFile = scoreFile;
+    request.resourcePath = m_verovioResourcePath;
+    request.scale = m_scale;
+
+    // Hold on to the pages of any previous complete load of the same
+    // score at the same scale, in case it has only been edited
+    m_previousSvgPages.clear();
+    if (scoreName == m_scoreName && m_scale == m_renderedScale) {
+        m_previousSvgPages.swap(m_svgPages);
+        request.previousPages.swap(m_renderedPages);
+        request.previousMeasureTable = m_renderedMeasureTable;
+    }
+    
+    // The rasters of the previous pages are kept until the load is
+    // finished, as those of any pages kept from them are still good
+    m_svgPages.clear();
+    m_pageLastUsed.clear();
+    m_renderedPages.clear();
+    m_renderedMeasureTable = {};
+    m_renderedScale = 0;
+    m_toolkit = {};
+    m_toolkitContentHash = {};
+
+    m_musicalEvents.clear();
+    m_events.clear();
+    m_eventByLabel.clear();
+    clearNotes();
+    
+    m_highlightEventLabel = {};
+    m_selectStart = -1;
+    m_selectEnd = -1;
+    
+    m_page = -1;
+
+    m_scoreName = scoreName;
+    m_scoreFilename = scoreFile;
+
+    update();
+
+    return request;
 }
 
 void
-ScoreWidget::getSelection(Fraction &start, EventLabel &startLabel,
-                          Fraction &end, EventLabel &endLabel) const
+ScoreWidget::addLoadedPage(LoadedPage page)
 {
-    start = m_selectStart.location;
-    startLabel = m_selectStart.label;
-    end = m_selectEnd.location;
-    endLabel = m_selectEnd.label;
+    if (page.page != int(m_svgPages.size())) {
+        SVCERR << "ScoreWidget::addLoadedPage: Page " << page.page
+               << " arrived out of order, expected " << m_svgPages.size()
+               << endl;
+        return;
+    }
+
+    if (page.rendered.svg.isEmpty()) {
+        SVCERR << "ScoreWidget::addLoadedPage: No SVG for page "
+               << page.page << endl;
+        return;
+    }
+
+    // A kept page may have had its renderer dropped already, in
+    // which case it is made again when next wanted
+    shared_ptr<QSvgRenderer> renderer = page.renderer;
+    if (page.reusedFrom >= 0 &&
+        page.reusedFrom < int(m_previousSvgPages.size())) {
+        renderer = m_previousSvgPages[page.reusedFrom];
+    }
+    
+    m_svgPages.push_back({});
+    m_pageLastUsed.push_back(0);
+    m_renderedPages.push_back(std::move(page.rendered));
+    installPageRenderer(page.page, renderer, false);
+
+    if (m_page < 0) {
+        showPage(0);
+    } else {
+        emit pageChanged(m_page); // page count has changed
+    }
 }
 
 void
-ScoreWidget::mouseDoubleClickEvent(QMouseEvent *e)
+ScoreWidget::finishLoad(const LoadRequest &request,
+                        const MeiMeasureTable &measureTable,
+                        shared_ptr<vrv::Toolkit> toolkit,
+                        string contentHash)
 {
-    if (e->button() != Qt::LeftButton) {
-        return;
+    m_toolkit = toolkit;
+    m_toolkitContentHash = contentHash;
+    m_previousSvgPages.clear();
+    pruneRasterCache();
+    m_renderedMeasureTable = measureTable;
+    m_renderedScale = request.scale;
+
+    SVDEBUG << "ScoreWidget::finishLoad: Loaded " << m_svgPages.size()
+            << " pages of score \"" << request.scoreName << "\"" << endl;
+
+    if (m_page < 0) {
+        showPage(0);
     }
+    
+    emit loadCompleted(request.scoreName);
+}
 
-#ifdef DEBUG_SCORE_WIDGET
-    SVDEBUG << "ScoreWidget::mouseDoubleClickEvent" << endl;
-#endif
+bool
+ScoreWidget::renderPages(const LoadRequest &request,
+                         QThread *guiThread,
+                         const std::atomic<bool> &cancelled,
+                         std::function<void(LoadedPage)> pageReady,
+                         MeiMeasureTable &measureTable,
+                         std::shared_ptr<vrv::Toolkit> &toolkitOut,
+                         std::string &contentHashOut,
+                         QString &errorString)
+{
+    if (request.resourcePath == "") {
+        SVDEBUG << "ScoreWidget::renderPages: No Verovio resource path available" << endl;
+        errorString = "No Verovio resource path available: application was not packaged properly";
+        return false;
+    }
+
+    string scoreFile = request.scoreFile.toStdString();
+    measureTable.read(scoreFile);
+
+    // Pages to hand to pageReady are built in a pool of worker
+    // threads, each job writing only to its own page's slot.
+    // Whichever thread completes the next page due passes it, and
+    // any completed pages after it, to pageReady, so that pages are
+    // delivered in order however the jobs finish
+    vector<LoadedPage> slots;
+    vector<bool> done;
+    int pp = 0;
+    int nextToDeliver = 0;
+    std::mutex deliveryMutex;
+
+    auto prepare = [&](int n) {
+        pp = n;
+        slots = vector<LoadedPage>(pp);
+        done = vector<bool>(pp, false);
+        for (int p = 0; p < pp; ++p) {
+            slots[p].page = p;
+            slots[p].pageCount = pp;
+            slots[p].reusedFrom = -1;
+        }
+    };
+    
+    auto complete = [&](int p) {
+        std::lock_guard<std::mutex> guard(deliveryMutex);
+        done[p] = true;
+        while (nextToDeliver < pp && done[nextToDeliver]) {
+            pageReady(std::move(slots[nextToDeliver]));
+            ++nextToDeliver;
+        }
+    };
+
+    auto finish = [&](QThreadPool &pool) {
+        pool.waitForDone();
+        if (cancelled) {
+            SVDEBUG << "ScoreWidget::renderPages: Cancelled after "
+                    << nextToDeliver << " of " << pp << " pages" << endl;
+            errorString = "Loading was cancelled";
+            return false;
+        }
+        return true;
+    };
+
+    // If the pages have been rendered at this scale before, the
+    // cache has them ready to hand to QSvgRenderer, and we need
+    // neither Verovio nor VrvTrim. When we have a toolkit already,
+    // the pages are those of the document it has, which the file
+    // may have changed from since
+    
+    string contentHash = (request.toolkit ?
+                          request.toolkitContentHash :
+                          ScoreCache::hashFile(scoreFile));
+    string layoutOptions = getLayoutOptions(request.scale);
+    string cacheKey = SvgPageCache::makeKey
+        (contentHash, layoutOptions, request.scale);
+
+    vector<SvgPageCache::Page> cached;
+    if (SvgPageCache::retrieve(cacheKey, cached)) {
+
+        prepare(int(cached.size()));
+        QThreadPool pool;
         
-    if (m_mode == InteractionMode::Navigate) {
-        setInteractionMode(InteractionMode::Edit);
+        for (int p = 0; p < pp; ++p) {
+            if (cancelled) {
+                break;
+            }
+            LoadedPage &slot = slots[p];
+            slot.rendered.measureIds = cached[p].measureIds;
+            pool.start([&slot, &complete, &cached, p, guiThread]() {
+                preparePage(cached[p], guiThread, p <= 1, slot);
+                complete(p);
+            });
+        }
+
+        if (!finish(pool)) {
+            return false;
+        }
+
+        SVDEBUG << "ScoreWidget::renderPages: Took " << pp
+                << " pages from cache" << endl;
+
+        // Any toolkit we were given is still good for a relayout
+        toolkitOut = request.toolkit;
+        contentHashOut = (request.toolkit ? contentHash : string());
+        return true;
     }
+    
+    auto toolkit = request.toolkit;
 
-    mousePressEvent(e);
+    if (toolkit) {
+        applyScale(*toolkit, request.scale);
+        toolkit->RedoLayout();
+    } else {
+        toolkit = make_shared<vrv::Toolkit>(false);
+        if (!toolkit->SetResourcePath(request.resourcePath)) {
+            SVDEBUG << "ScoreWidget::renderPages: Failed to set Verovio resource path" << endl;
+            errorString = "Failed to set Verovio resource path";
+            return false;
+        }
+
+        applyScale(*toolkit, request.scale);
+    
+        if (!toolkit->LoadFile(scoreFile)) {
+            SVDEBUG << "ScoreWidget::renderPages: Load failed in Verovio toolkit" << endl;
+            errorString = "Load failed in Verovio toolkit";
+            return false;
+        }
+
+        // If the file changed while Verovio was reading it, we can't
+        // tell which version it has, so cache nothing from it
+        if (ScoreCache::hashFile(scoreFile) != contentHash) {
+            SVDEBUG << "ScoreWidget::renderPages: Score file changed during load, not caching its pages" << endl;
+            contentHash = "";
+            cacheKey = "";
+        }
+    }
+
+    const vrv::ScoreMetadata &metadata = toolkit->GetScoreMetadata();
+    prepare(metadata.pageCount);
+
+    SVDEBUG << "ScoreWidget::renderPages: Have " << pp << " pages, "
+            << metadata.measureCount << " measures, "
+            << metadata.noteCount << " notes" << endl;
+
+    // A page can be kept from the previous load if it holds the same
+    // measures as before and the edit affected none of them: its
+    // layout depends only on those measures and on the context
+    // outside the measures, which getAffectedMeasures requires to be
+    // unchanged
+    std::set<string> affectedMeasureIds;
+    bool canReuse = false;
+    if (!request.previousPages.empty()) {
+        vector<int> affected;
+        canReuse = MeiMeasureTable::getAffectedMeasures
+            (request.previousMeasureTable, measureTable, affected);
+        for (int m : affected) {
+            affectedMeasureIds.insert(measureTable.getMeasures()[m].id);
+        }
+    }
+
+    // Verovio renders the pages one at a time on this thread, as its
+    // toolkit is not thread-safe, while the rest of the work for each
+    // page - converting the SVG, building its renderer and finding
+    // the system extents - goes to the pool as soon as the page's
+    // SVG is ready. The converted pages are also kept for the cache
+    vector<SvgPageCache::Page> converted(pp);
+    QThreadPool pool;
+    int reused = 0;
+    
+    for (int p = 0; p < pp; ++p) {
+
+        if (cancelled) {
+            break;
+        }
+        
+        LoadedPage &slot = slots[p];
+        slot.rendered.measureIds = toolkit->GetMeasureIDsOnPage(p + 1);
+        converted[p].measureIds = slot.rendered.measureIds;
+
+        if (canReuse && p < int(request.previousPages.size()) &&
+            slot.rendered.measureIds == request.previousPages[p].measureIds &&
+            std::none_of(slot.rendered.measureIds.begin(),
+                         slot.rendered.measureIds.end(),
+                         [&](const string &id) {
+                             return affectedMeasureIds.count(id) > 0;
+                         })) {
+            slot.rendered = request.previousPages[p];
+            slot.reusedFrom = p;
+            converted[p].svg = slot.rendered.svg;
+            converted[p].geometry = slot.rendered.geometry;
+            ++reused;
+            complete(p);
+            continue;
+        }
+
+        std::string svgText = toolkit->RenderToSVG(p + 1); // (verovio is 1-based)
+
+        pool.start([&slot, &converted, &complete, p, svgText, guiThread]() {
+            SvgPageCache::Page page = convertPage(svgText);
+            preparePage(page, guiThread, p <= 1, slot);
+            converted[p].svg = page.svg;
+            converted[p].geometry = std::move(page.geometry);
+            complete(p);
+        });
+    }
+
+    if (!finish(pool)) {
+        return false;
+    }
+    
+    if (reused > 0) {
+        SVDEBUG << "ScoreWidget::renderPages: Kept " << reused << " of "
+                << pp << " pages from previous load" << endl;
+    }
+
+    SvgPageCache::store(cacheKey, converted,
+                        request.scoreName.toStdString(), request.scale);
+
+    toolkitOut = toolkit;
+    contentHashOut = contentHash;
+
+    return true;
 }
 
-ScoreWidget::EventData
-ScoreWidget::getEventAtPoint(QPoint point)
+void
+ScoreWidget::setMusicalEvents(const Score::MusicalEventList &events)
 {
-    const auto &events = m_pageEventsMap[m_page];
+    m_musicalEvents = events;
+
+#ifdef DEBUG_SCORE_WIDGET
+    SVDEBUG << "ScoreWidget::setMusicalEvents: " << events.size()
+            << " events" << endl;
+#endif
+
+    m_events.clear();
+    m_events.reserve(m_musicalEvents.size());
+    m_eventByLabel.clear();
+
+    for (const auto &ev : m_musicalEvents) {
+        EventData data;
+        data.location = ev.measureInfo.measureFraction;
+        data.label = ev.measureInfo.toLabel();
+        m_eventByLabel[data.label] = int(m_events.size());
+        m_events.push_back(data);
+    }
+
+    if (m_selectStart >= int(m_events.size())) m_selectStart = -1;
+    if (m_selectEnd >= int(m_events.size())) m_selectEnd = -1;
+
+    clearNotes();
     
-    double px = point.x();
-    double py = point.y();
+    if (m_renderedPages.empty()) {
+        SVDEBUG << "ScoreWidget::setMusicalEvents: WARNING: No SVG pages, score should have been set before this" << endl;
+        return;
+    }
 
-    EventData found;
-    double foundX = 0.0;
+    if (std::any_of(m_renderedPages.begin(), m_renderedPages.end(),
+                    [](const RenderedPage &rp) { return rp.svg.isEmpty(); })) {
+        SVDEBUG << "ScoreWidget::setMusicalEvents: Pages still being rendered, events will be placed when they are done" << endl;
+        return;
+    }
+    
+    int p = 0;
+    int npages = m_renderedPages.size();
+    int ix = 0;
+    
+    for (const auto &ev : m_musicalEvents) {
+        EventData &data = m_events[ix];
+        for (const auto &n : ev.notes) {
+            if (!n.isNewNote) {
+                continue;
+            }
+            if (n.noteId.empty()) {
+                SVDEBUG << "ScoreWidget::setMusicalEvents: NOTE: found note with no id" << endl;
+                continue;
+            }
+            if (m_noteById.find(n.noteId) != m_noteById.end()) {
+                continue;
+            }
+
+            // The events are in score order, so we need only ever
+            // move on to the next page
+            const VrvTrim::NoteBox *box = VrvTrim::findNoteBox
+                (m_renderedPages[p].geometry.noteBoxes, n.noteId);
+            if (!box && p + 1 < npages) {
+                box = VrvTrim::findNoteBox
+                    (m_renderedPages[p + 1].geometry.noteBoxes, n.noteId);
+                if (box) {
+                    ++p;
+                }
+            }
+
+            if (!box) {
+                continue;
+            }
+
+            // Highlights span the note's whole system vertically
+            QRectF rect(box->x, box->y, box->width, box->height);
+            const auto &extents = m_renderedPages[p].geometry.noteSystemExtents;
+            auto eitr = extents.find(n.noteId);
+            if (eitr != extents.end()) {
+                rect = QRectF(rect.x(), eitr->second.y,
+                              rect.width(), eitr->second.height);
+            }
 
 #ifdef DEBUG_EVENT_FINDING
-    SVDEBUG << "ScoreWidget::getEventAtPoint: point " << px << "," << py << endl;
+            SVDEBUG << "found note id " << n.noteId << " for event at "
+                    << data.label << " -> page " << p << ", rect "
+                    << rect.x() << "," << rect.y() << " " << rect.width()
+                    << "x" << rect.height() << endl;
 #endif
-    
-    for (auto itr = events.begin(); itr != events.end(); ++itr) {
 
-        EventId id = *itr;
-        EventData edata = getEventWithId(id);
-        if (edata.isNull()) continue;
-        
-        QRectF r = getHighlightRectFor(edata);
-        if (r == QRectF()) continue;
+            if (data.firstNote < 0) {
+                data.firstNote = int(m_notes.size());
+            }
+            ++data.noteCount;
+            m_noteById[n.noteId] = int(m_notes.size());
+            m_notes.push_back({ n.noteId, ix, p, rect });
+        }
+        ++ix;
+    }
 
-#ifdef DEBUG_EVENT_FINDING
-        SVDEBUG << "ScoreWidget::getEventAtPoint: id " << *itr
-                << " has rect " << r.x() << "," << r.y() << " "
-                << r.width() << "x" << r.height() << " (seeking " << px
-                << "," << py << ")" << endl;
+    buildHitIndex();
+    
+#ifdef DEBUG_SCORE_WIDGET
+    SVDEBUG << "ScoreWidget::setMusicalEvents: Found " << m_notes.size()
+            << " notes" << endl;
 #endif
+}
+
+void
+ScoreWidget::clearNotes()
+{
+    m_notes.clear();
+    m_noteById.clear();
+    m_pageHitIndex.clear();
+    for (auto &data : m_events) {
+        data.firstNote = -1;
+        data.noteCount = 0;
+    }
+    m_noteToHighlight = -1;
+    m_noteUnderMouse = -1;
+}
+
+void
+ScoreWidget::buildHitIndex()
+{
+    // Indexed in page coordinates, so that the index does not depend
+    // on the widget size and need not be rebuilt on resize. The map
+    // from page to widget coordinates only scales and translates, so
+    // the order of things is the same in both
     
-        if (py < r.y() || py > r.y() + r.height()) {
-            continue;
+    m_pageHitIndex.clear();
+    m_pageHitIndex.resize(m_renderedPages.size());
+
+    // The notes on each page are contiguous in m_notes
+    int n = 0;
+    int nnotes = m_notes.size();
+    
+    while (n < nnotes) {
+
+        int page = m_notes[n].page;
+        std::map<pair<double, double>, HitSystem> systems;
+        
+        for (; n < nnotes && m_notes[n].page == page; ++n) {
+            const QRectF &rect = m_notes[n].rectOnPage;
+            if (rect == QRectF()) continue;
+            auto key = pair<double, double>(rect.y(), rect.y() + rect.height());
+            HitSystem &system = systems[key];
+            system.y0 = key.first;
+            system.y1 = key.second;
+            system.events.push_back({ rect.x(), n });
         }
-        if (px < r.x() || r.x() < foundX) {
+
+        if (page < 0 || page >= int(m_pageHitIndex.size())) {
             continue;
         }
         
-        found = edata;
-        foundX = r.x();
+        PageHitIndex &index = m_pageHitIndex[page];
+        double reach = 0.0;
+        for (auto &sp : systems) { // ordered by y0
+            HitSystem &system = sp.second;
+            std::stable_sort(system.events.begin(), system.events.end(),
+                             [](const HitEvent &a, const HitEvent &b) {
+                                 return a.x < b.x;
+                             });
+            if (index.systems.empty() || system.y1 > reach) {
+                reach = system.y1;
+            }
+            system.reach = reach;
+            index.systems.push_back(std::move(system));
+        }
     }
+}
 
-#ifdef DEBUG_EVENT_FINDING
-    SVDEBUG << "ScoreWidget::idAtPoint: point " << point.x()
-            << "," << point.y() << " -> element id " << found.id
-            << " with x = " << foundX << endl;
+void
+ScoreWidget::resizeEvent(QResizeEvent *)
+{
+    if (m_page >= 0) {
+        showPage(m_page);
+    }
+}
+
+void
+ScoreWidget::enterEvent(QEnterEvent *)
+{
+    m_mouseActive = true;
+    updateHighlight();
+}
+
+void
+ScoreWidget::leaveEvent(QEvent *)
+{
+    if (m_mouseActive) {
+        emit interactionEnded(m_mode);
+    }
+    m_mouseActive = false;
+    updateHighlight();
+}
+
+void
+ScoreWidget::mouseMoveEvent(QMouseEvent *e)
+{
+    if (!m_mouseActive) return;
+
+    m_noteUnderMouse = getNoteAtPoint(e->pos());
+
+#ifdef DEBUG_SCORE_WIDGET
+    SVDEBUG << "ScoreWidget::mouseMoveEvent: id under mouse = "
+            << (m_noteUnderMouse < 0 ? string() : m_notes[m_noteUnderMouse].id)
+            << endl;
 #endif
     
-    return found;
+    updateHighlight();
+
+    if (m_noteUnderMouse >= 0) {
+        const EventData &event = getEventOfNote(m_noteUnderMouse);
+#ifdef DEBUG_SCORE_WIDGET
+        SVDEBUG << "ScoreWidget::mouseMoveEvent: Emitting scorePositionHighlighted at " << event.location << endl;
+#endif
+        emit scoreLocationHighlighted(event.location, event.label, m_mode);
+    }
 }
 
-QRectF
-ScoreWidget::getHighlightRectFor(const EventData &event)
+void
+ScoreWidget::mousePressEvent(QMouseEvent *e)
 {
-    QRectF rect = event.boxOnPage;
+    if (e->button() != Qt::LeftButton) {
+        return;
+    }
+    
+    mouseMoveEvent(e);
+
+    if (!m_musicalEvents.empty() && m_noteUnderMouse >= 0 &&
+        (m_mode == InteractionMode::SelectStart ||
+         m_mode == InteractionMode::SelectEnd)) {
+
+        if (m_mode == InteractionMode::SelectStart) {
+            m_selectStart = m_notes[m_noteUnderMouse].event;
+            if (!(getEvent(m_selectStart).location <
+                  getEvent(m_selectEnd).location)) {
+                m_selectEnd = -1;
+            }
+        } else {
+            m_selectEnd = m_notes[m_noteUnderMouse].event;
+            if (!(getEvent(m_selectStart).location <
+                  getEvent(m_selectEnd).location)) {
+                m_selectStart = -1;
+            }
+        }
+        
+#ifdef DEBUG_SCORE_WIDGET
+        SVDEBUG << "ScoreWidget::mousePressEvent: Set select start to "
+                << getEvent(m_selectStart).location << " and end to "
+                << getEvent(m_selectEnd).location << endl;
+#endif
 
-    if (m_noteSystemExtentMap.find(event.id) != m_noteSystemExtentMap.end()) {
-        Extent extent = m_noteSystemExtentMap.at(event.id);
-        rect = QRectF(rect.x(), extent.y, rect.width(), extent.height);
+        const EventData &start = getEvent
+            (m_selectStart < 0 ? getScoreStartEvent() : m_selectStart);
+        const EventData &end = getEvent
+            (m_selectEnd < 0 ? getScoreEndEvent() : m_selectEnd);
+        emit selectionChanged(start.location,
+                              isSelectedFromStart(),
+                              start.label,
+                              end.location,
+                              isSelectedToEnd(),
+                              end.label);
+        updateSelection();
+    }
+
+    if (m_noteUnderMouse >= 0) {
+        const EventData &event = getEventOfNote(m_noteUnderMouse);
+#ifdef DEBUG_SCORE_WIDGET
+        SVDEBUG << "ScoreWidget::mousePressEvent: Emitting scorePositionActivated at " << event.location << endl;
+#endif
+        emit scoreLocationActivated(event.location, event.label, m_mode);
+        updateHighlight();
     }
-                      
-    return m_pageToWidget.mapRect(rect);
 }
 
 void
-ScoreWidget::paintEvent(QPaintEvent *e)
+ScoreWidget::clearSelection()
 {
-    QFrame::paintEvent(e);
+#ifdef DEBUG_SCORE_WIDGET
+    SVDEBUG << "ScoreWidget::clearSelection" << endl;
+#endif
 
-    if (m_page < 0 || m_page >= getPageCount()) {
-        SVDEBUG << "ScoreWidget::paintEvent: No page or page out of range, painting nothing" << endl;
+    if (m_selectStart < 0 && m_selectEnd < 0) {
         return;
     }
 
-    QPainter paint(this);
+    m_selectStart = -1;
+    m_selectEnd = -1;
 
-    auto renderer = m_svgPages[m_page];
+    emit selectionChanged(Fraction(),
+                          true,
+                          getEvent(getScoreStartEvent()).label,
+                          Fraction(),
+                          true,
+                          getEvent(getScoreEndEvent()).label);
 
-    // When we actually paint the SVG, we just tell Qt to stick it on
-    // the paint device scaled while preserving aspect. But we still
-    // need to do the same calculations ourselves to construct the
-    // transforms needed for mapping to e.g. mouse interaction space
-    
-    QSizeF widgetSize = size();
-    QSizeF pageSize = renderer->viewBoxF().size();
+    updateSelection();
+}
 
-    double ww = widgetSize.width(), wh = widgetSize.height();
-    double pw = pageSize.width(), ph = pageSize.height();
+void
+ScoreWidget::zoomIn()
+{
+    if (m_scale < 240) {
+        setScale(m_scale + 20);
+    }
+}
+
+void
+ScoreWidget::zoomOut()
+{
+    if (m_scale > 20) {
+        setScale(m_scale - 20);
+    }
+}
+
+void
+ScoreWidget::zoomReset()
+{
+    setScale(100);
+}
+
+int
+ScoreWidget::getScoreStartEvent() const
+{
+    if (m_events.empty()) return -1;
+    return 0;
+}
+
+bool
+ScoreWidget::isSelectedFromStart() const
+{
+    return (m_musicalEvents.empty() ||
+            m_selectStart <= 0);
+}
+
+int
+ScoreWidget::getScoreEndEvent() const
+{
+    if (m_events.empty()) return -1;
+    return int(m_events.size()) - 1;
+}
+
+const ScoreWidget::EventData &
+ScoreWidget::getEvent(int event) const
+{
+    static const EventData none;
+    if (event < 0 || event >= int(m_events.size())) {
+        return none;
+    }
+    return m_events[event];
+}
+
+const ScoreWidget::EventData &
+ScoreWidget::getEventOfNote(int note) const
+{
+    if (note < 0 || note >= int(m_notes.size())) {
+        return getEvent(-1);
+    }
+    return getEvent(m_notes[note].event);
+}
+
+int
+ScoreWidget::getHighlightNoteFor(int event) const
+{
+    // Highlight the last note found for the event
+    const EventData &data = getEvent(event);
+    if (data.noteCount == 0) return -1;
+    return data.firstNote + data.noteCount - 1;
+}
+
+bool
+ScoreWidget::isSelectedToEnd() const
+{
+    return (m_musicalEvents.empty() ||
+            m_selectEnd < 0 ||
+            m_selectEnd + 1 >= int(m_musicalEvents.size()));
+}
+
+bool
+ScoreWidget::isSelectedAll() const
+{
+    return isSelectedFromStart() && isSelectedToEnd();
+}
+
+void
+ScoreWidget::getSelection(Fraction &start, EventLabel &startLabel,
+                          Fraction &end, EventLabel &endLabel) const
+{
+    start = getEvent(m_selectStart).location;
+    startLabel = getEvent(m_selectStart).label;
+    end = getEvent(m_selectEnd).location;
+    endLabel = getEvent(m_selectEnd).label;
+}
+
+void
+ScoreWidget::mouseDoubleClickEvent(QMouseEvent *e)
+{
+    if (e->button() != Qt::LeftButton) {
+        return;
+    }
 
 #ifdef DEBUG_SCORE_WIDGET
-    SVDEBUG << "ScoreWidget::paint: widget size " << ww << "x" << wh
-            << ", page size " << pw << "x" << ph << endl;
+    SVDEBUG << "ScoreWidget::mouseDoubleClickEvent" << endl;
 #endif
-    
-    if (!ww || !wh || !pw || !ph) {
-        SVDEBUG << "ScoreWidgetPDF::paint: one of our dimensions is zero, can't proceed" << endl;
-        return;
+        
+    if (m_mode == InteractionMode::Navigate) {
+        setInteractionMode(InteractionMode::Edit);
+    }
+
+    mousePressEvent(e);
+}
+
+int
+ScoreWidget::getNoteAtPoint(QPoint point) const
+{
+    if (m_page < 0 || m_page >= int(m_pageHitIndex.size())) {
+        return -1;
     }
+    const auto &systems = m_pageHitIndex[m_page].systems;
     
-    double scale = std::min(ww / pw, wh / ph);
-    double xorigin = (ww - (pw * scale)) / 2.0;
-    double yorigin = (wh - (ph * scale)) / 2.0;
+    QPointF pagePoint = m_widgetToPage.map(QPointF(point));
+    double px = pagePoint.x();
+    double py = pagePoint.y();
 
-    m_pageToWidget = QTransform();
-    m_pageToWidget.translate(xorigin, yorigin);
-    m_pageToWidget.scale(scale, scale);
+#ifdef DEBUG_EVENT_FINDING
+    SVDEBUG << "ScoreWidget::getNoteAtPoint: point " << point.x() << ","
+            << point.y() << " is " << px << "," << py << " on page" << endl;
+#endif
 
-    m_widgetToPage = QTransform();
-    m_widgetToPage.scale(1.0 / scale, 1.0 / scale);
-    m_widgetToPage.translate(-xorigin, -yorigin);
+    // Of the events whose rect spans py vertically and starts at or
+    // before px, we want the one that starts furthest right, or the
+    // later of two that start at the same place. Systems are sorted
+    // by top edge, with reach being the lowest bottom edge of any
+    // system so far, so we can stop looking back once that is above
+    // the point. Usually there is only one system to look at
     
-    // Show a highlight bar if the interaction mode is anything other
-    // than None - the colour and location depend on the mode
+    const HitEvent *found = nullptr;
     
-    if (m_mode != InteractionMode::None) {
+    auto sitr = std::upper_bound(systems.begin(), systems.end(), py,
+                                 [](double y, const HitSystem &s) {
+                                     return y < s.y0;
+                                 });
+    while (sitr != systems.begin()) {
+        --sitr;
+        if (sitr->reach < py) {
+            break;
+        }
+        if (sitr->y1 < py) {
+            continue;
+        }
+        const auto &events = sitr->events;
+        auto eitr = std::upper_bound(events.begin(), events.end(), px,
+                                     [](double x, const HitEvent &e) {
+                                         return x < e.x;
+                                     });
+        if (eitr == events.begin()) {
+            continue;
+        }
+        --eitr;
+        if (!found || eitr->x > found->x ||
+            (eitr->x == found->x && eitr->note > found->note)) {
+            found = &(*eitr);
+        }
+    }
+
+#ifdef DEBUG_EVENT_FINDING
+    SVDEBUG << "ScoreWidget::getNoteAtPoint: point " << point.x()
+            << "," << point.y() << " -> element id "
+            << (found ? m_notes[found->note].id : string()) << endl;
+#endif
+
+    if (!found) {
+        return -1;
+    }
+    return found->note;
+}
+
+QRectF
+ScoreWidget::getHighlightRectFor(int note) const
+{
+    if (note < 0 || note >= int(m_notes.size())) {
+        return {};
+    }
+    return m_pageToWidget.mapRect(m_notes[note].rectOnPage);
+}
+
+QRectF
+ScoreWidget::getCurrentHighlightRect()
+{
+    if (m_mode == InteractionMode::None) {
+        return {};
+    }
 
-        EventData event;
+    int note = -1;
 
-        if (m_mouseActive) {
-            event = m_eventUnderMouse;
+    if (m_mouseActive) {
+        note = m_noteUnderMouse;
 #ifdef DEBUG_SCORE_WIDGET
-            SVDEBUG << "ScoreWidget::paint: under mouse = "
-                    << event.label << endl;
+        SVDEBUG << "ScoreWidget::getCurrentHighlightRect: under mouse = "
+                << getEventOfNote(note).label << endl;
 #endif
-        } else {
-            event = m_eventToHighlight;
+    } else {
+        note = m_noteToHighlight;
 #ifdef DEBUG_SCORE_WIDGET
-            SVDEBUG << "ScoreWidget::paint: to highlight = "
-                    << event.label << endl;
+        SVDEBUG << "ScoreWidget::getCurrentHighlightRect: to highlight = "
+                << getEventOfNote(note).label << endl;
 #endif
-        }
+    }
 
-        if (!event.isNull()) {
-        
-            QRectF rect = getHighlightRectFor(event);
+    if (note < 0) {
+        return {};
+    }
 
-            QColor highlightColour;
+    return getHighlightRectFor(note);
+}
 
-            switch (m_mode) {
-            case InteractionMode::Navigate:
-                highlightColour = navigateHighlightColour;
-                break;
-            case InteractionMode::Edit:
-                highlightColour = editHighlightColour;
-                break;
-            case InteractionMode::SelectStart:
-            case InteractionMode::SelectEnd:
-                highlightColour = selectHighlightColour.darker();
-                break;
-            default: // None already handled in conditional above
-                throw std::runtime_error("Unhandled case in mode switch");
-            }
-            
-            highlightColour.setAlpha(160);
-            paint.setPen(Qt::NoPen);
-            paint.setBrush(highlightColour);
-            
-#ifdef DEBUG_SCORE_WIDGET
-            SVDEBUG << "ScoreWidget::paint: highlighting rect with origin "
-                    << rect.x() << "," << rect.y() << " and size "
-                    << rect.width() << "x" << rect.height()
-                    << " using colour " << highlightColour.name() << endl;
-#endif
+vector<QRectF>
+ScoreWidget::getSelectionRects()
+{
+    vector<QRectF> rects;
 
-            if (rect != QRectF()) {
-                paint.drawRect(rect);
-            }
-        }
+    if (m_page < 0 || m_page >= getPageCount()) {
+        return rects;
     }
-
-    // Highlight the current selection if there is one
+    
     if (!m_musicalEvents.empty() &&
         (!isSelectedAll() ||
          (m_mode == InteractionMode::SelectStart ||
           m_mode == InteractionMode::SelectEnd))) {
 
-        QColor fillColour = selectHighlightColour;
-        fillColour.setAlpha(100);
-        paint.setPen(Qt::NoPen);
-        paint.setBrush(fillColour);
+        if (m_renderedPages[m_page].svg.isEmpty()) {
+            return rects; // not rendered yet
+        }
+        QSizeF pageSize = m_renderedPages[m_page].getSize();
 
         auto exclusiveComparator =
             [](const Score::MusicalEvent &e, const Fraction &f) {
@@ -874,20 +1496,22 @@ ScoreWidget::paintEvent(QPaintEvent *e)
         };
         
         Score::MusicalEventList::iterator i0 = m_musicalEvents.begin();
-        if (!m_selectStart.isNull()) {
+        if (m_selectStart >= 0) {
             i0 = lower_bound(m_musicalEvents.begin(), m_musicalEvents.end(),
-                             m_selectStart.location, exclusiveComparator);
+                             getEvent(m_selectStart).location,
+                             exclusiveComparator);
         }
         Score::MusicalEventList::iterator i1 = m_musicalEvents.end();
-        if (!m_selectEnd.isNull()) {
+        if (m_selectEnd >= 0) {
             i1 = lower_bound(m_musicalEvents.begin(), m_musicalEvents.end(),
-                             m_selectEnd.location, inclusiveComparator);
+                             getEvent(m_selectEnd).location,
+                             inclusiveComparator);
         }
 
 #ifdef DEBUG_SCORE_WIDGET
-        SVDEBUG << "ScoreWidget::paint: selection spans from "
-                << m_selectStart.location << " to " << m_selectEnd.location
-                << " giving us iterators at "
+        SVDEBUG << "ScoreWidget::getSelectionRects: selection spans from "
+                << getEvent(m_selectStart).location << " to "
+                << getEvent(m_selectEnd).location << " giving us iterators at "
                 << (i0 == m_musicalEvents.end() ? "(end)" :
                     i0->notes.empty() ? "(location without note)" :
                     i0->notes[0].noteId)
@@ -904,15 +1528,20 @@ ScoreWidget::paintEvent(QPaintEvent *e)
         double prevY = -1.0;
         double furthestX = 0.0;
 
+        // Each event is placed by the first of its notes found
+        auto firstNoteOf = [this](Score::MusicalEventList::iterator i) {
+            return getEvent(int(i - m_musicalEvents.begin())).firstNote;
+        };
+        
         for (auto i = i0; i != i1 && i != m_musicalEvents.end(); ++i) {
-            EventData data = getEventForMusicalEvent(*i);
-            if (data.page < m_page) {
+            int note = firstNoteOf(i);
+            if (note < 0 || m_notes[note].page < m_page) {
                 continue;
             }
-            if (data.page > m_page) {
+            if (m_notes[note].page > m_page) {
                 break;
             }
-            QRectF rect = getHighlightRectFor(data);
+            QRectF rect = getHighlightRectFor(note);
 #ifdef DEBUG_EVENT_FINDING                    
             SVDEBUG << "I'm at " << rect.x() << "," << rect.y() << " with width "
                     << rect.width() << " (furthest X so far = " << furthestX
@@ -939,9 +1568,14 @@ ScoreWidget::paintEvent(QPaintEvent *e)
                 rect.setWidth(lineWidth - rect.x());
             }
             while (j != m_musicalEvents.end()) {
-                EventData nextData = getEventForMusicalEvent(*j);
-                QRectF nextRect = getHighlightRectFor(nextData);
-                if (nextData.page == m_page &&
+                int nextNote = firstNoteOf(j);
+                if (nextNote < 0) {
+                    ++j;
+                    continue;
+                }
+                int nextPage = m_notes[nextNote].page;
+                QRectF nextRect = getHighlightRectFor(nextNote);
+                if (nextPage == m_page &&
                     nextRect.y() <= rect.y() &&
                     nextRect.x() >= rect.x() &&
                     nextRect.width() > 0) {
@@ -954,22 +1588,363 @@ ScoreWidget::paintEvent(QPaintEvent *e)
                     }
                     break;
                 }
-                if (nextData.page > m_page ||
+                if (nextPage > m_page ||
                     nextRect.y() > rect.y()) {
                     break;
                 }
                 ++j;
             }
-            paint.drawRect(rect);
+            rects.push_back(rect);
             prevY = rect.y();
             furthestX = rect.x() + rect.width();
         }
     }
 
+    return rects;
+}
+
+QRect
+ScoreWidget::toDamageRect(const QRectF &rect)
+{
+    // Allow a pixel each side for antialiasing
+    return rect.toAlignedRect().adjusted(-1, -1, 1, 1);
+}
+
+void
+ScoreWidget::updateHighlight()
+{
+    // The transforms used by getCurrentHighlightRect are those of the
+    // last paint. Anything that changes them, such as a page flip or
+    // resize, calls update() for the whole widget anyway
+    QRect rect;
+    QRectF highlightRect = getCurrentHighlightRect();
+    if (highlightRect != QRectF()) {
+        rect = toDamageRect(highlightRect);
+    }
+    if (rect == m_paintedHighlightRect) {
+        return;
+    }
+    update(QRegion(m_paintedHighlightRect).united(rect));
+}
+
+void
+ScoreWidget::updateSelection()
+{
+    QRegion region;
+    for (const auto &rect : getSelectionRects()) {
+        region += toDamageRect(rect);
+    }
+    if (region == m_paintedSelection) {
+        return;
+    }
+    update(m_paintedSelection.united(region));
+}
+
+void
+ScoreWidget::paintEvent(QPaintEvent *e)
+{
+    QFrame::paintEvent(e);
+
+    if (m_page < 0 || m_page >= getPageCount()) {
+        SVDEBUG << "ScoreWidget::paintEvent: No page or page out of range, painting nothing" << endl;
+        return;
+    }
+
+    QPainter paint(this);
+
+    const RenderedPage &rendered = m_renderedPages[m_page];
+    if (rendered.svg.isEmpty()) {
+        // Still being rendered after a change of scale
+        return;
+    }
+
+    // When we actually paint the SVG, we just tell Qt to stick it on
+    // the paint device scaled while preserving aspect. But we still
+    // need to do the same calculations ourselves to construct the
+    // transforms needed for mapping to e.g. mouse interaction space
+    
+    QSizeF widgetSize = size();
+    QSizeF pageSize = rendered.getSize();
+
+    double ww = widgetSize.width(), wh = widgetSize.height();
+    double pw = pageSize.width(), ph = pageSize.height();
+
+#ifdef DEBUG_SCORE_WIDGET
+    SVDEBUG << "ScoreWidget::paint: widget size " << ww << "x" << wh
+            << ", page size " << pw << "x" << ph << endl;
+#endif
+    
+    if (!ww || !wh || !pw || !ph) {
+        SVDEBUG << "ScoreWidgetPDF::paint: one of our dimensions is zero, can't proceed" << endl;
+        return;
+    }
+    
+    double scale = std::min(ww / pw, wh / ph);
+    double xorigin = (ww - (pw * scale)) / 2.0;
+    double yorigin = (wh - (ph * scale)) / 2.0;
+
+    m_pageToWidget = QTransform();
+    m_pageToWidget.translate(xorigin, yorigin);
+    m_pageToWidget.scale(scale, scale);
+
+    m_widgetToPage = QTransform();
+    m_widgetToPage.scale(1.0 / scale, 1.0 / scale);
+    m_widgetToPage.translate(-xorigin, -yorigin);
+    
+    // Show a highlight bar if the interaction mode is anything other
+    // than None - the colour and location depend on the mode
+
+    QRectF highlightRect = getCurrentHighlightRect();
+    m_paintedHighlightRect = {};
+    
+    if (highlightRect != QRectF()) {
+
+        QColor highlightColour;
+
+        switch (m_mode) {
+        case InteractionMode::Navigate:
+            highlightColour = navigateHighlightColour;
+            break;
+        case InteractionMode::Edit:
+            highlightColour = editHighlightColour;
+            break;
+        case InteractionMode::SelectStart:
+        case InteractionMode::SelectEnd:
+            highlightColour = selectHighlightColour.darker();
+            break;
+        default: // None gives no highlight rect
+            throw std::runtime_error("Unhandled case in mode switch");
+        }
+            
+        highlightColour.setAlpha(160);
+        paint.setPen(Qt::NoPen);
+        paint.setBrush(highlightColour);
+            
+#ifdef DEBUG_SCORE_WIDGET
+        SVDEBUG << "ScoreWidget::paint: highlighting rect with origin "
+                << highlightRect.x() << "," << highlightRect.y()
+                << " and size " << highlightRect.width() << "x"
+                << highlightRect.height() << " using colour "
+                << highlightColour.name() << endl;
+#endif
+
+        paint.drawRect(highlightRect);
+        m_paintedHighlightRect = toDamageRect(highlightRect);
+    }
+
+    // Highlight the current selection if there is one
+
+    vector<QRectF> selectionRects = getSelectionRects();
+    m_paintedSelection = {};
+    
+    if (!selectionRects.empty()) {
+        
+        QColor fillColour = selectHighlightColour;
+        fillColour.setAlpha(100);
+        paint.setPen(Qt::NoPen);
+        paint.setBrush(fillColour);
+
+        for (const auto &rect : selectionRects) {
+            paint.drawRect(rect);
+            m_paintedSelection += toDamageRect(rect);
+        }
+    }
+
+    // The page itself goes on top of the highlights, as they are
+    // translucent and the page is transparent except for the notation
+    paint.drawPixmap(0, 0, getPageRaster(m_page, size()));
+}
+
+QPixmap
+ScoreWidget::getPageRaster(int page, QSize size)
+{
+    double ratio = devicePixelRatioF();
+    RasterKey key { m_renderedPages[page].serial, m_scale,
+                    size.width(), size.height(), ratio };
+
+    ++m_rasterCacheClock;
+    
+    auto itr = m_rasterCache.find(key);
+    if (itr != m_rasterCache.end()) {
+        itr->second.lastUsed = m_rasterCacheClock;
+        return itr->second.pixmap;
+    }
+
+    auto renderer = getPageRenderer(page);
+    if (!renderer) {
+        return {};
+    }
+
+    QPixmap pixmap(size * ratio);
+    pixmap.setDevicePixelRatio(ratio);
+    pixmap.fill(Qt::transparent);
+    
+    QPainter paint(&pixmap);
     paint.setPen(Qt::black);
     paint.setBrush(Qt::black);
+    renderer->render(&paint, QRectF(0, 0, size.width(), size.height()));
+    paint.end();
+
+#ifdef DEBUG_SCORE_WIDGET
+    SVDEBUG << "ScoreWidget::getPageRaster: Rendered " << pixmap.width()
+            << "x" << pixmap.height() << " raster" << endl;
+#endif
+
+    // Evict least recently used rasters until the new one fits. The
+    // new one is always kept, even if it is bigger than the budget
+    // on its own
+    auto bytesOf = [](const QPixmap &p) {
+        return uint64_t(p.width()) * p.height() * 4;
+    };
+    uint64_t total = bytesOf(pixmap);
+    for (const auto &e : m_rasterCache) {
+        total += bytesOf(e.second.pixmap);
+    }
+    while (total > rasterCacheBudget && !m_rasterCache.empty()) {
+        auto oldest = std::min_element
+            (m_rasterCache.begin(), m_rasterCache.end(),
+             [](const auto &a, const auto &b) {
+                 return a.second.lastUsed < b.second.lastUsed;
+             });
+        total -= bytesOf(oldest->second.pixmap);
+        m_rasterCache.erase(oldest);
+    }
+    
+    m_rasterCache[key] = { pixmap, m_rasterCacheClock };
+    return pixmap;
+}
+
+void
+ScoreWidget::pruneRasterCache()
+{
+    std::set<uint64_t> live;
+    for (const auto &rp : m_renderedPages) live.insert(rp.serial);
+    
+    for (auto itr = m_rasterCache.begin(); itr != m_rasterCache.end(); ) {
+        if (live.find(itr->first.serial) == live.end()) {
+            itr = m_rasterCache.erase(itr);
+        } else {
+            ++itr;
+        }
+    }
+}
 
-    renderer->render(&paint, QRectF(0, 0, ww, wh));
+shared_ptr<QSvgRenderer>
+ScoreWidget::getPageRenderer(int page)
+{
+    if (page < 0 || page >= int(m_svgPages.size())) {
+        return {};
+    }
+    
+    if (!m_svgPages[page]) {
+        const RenderedPage &rendered = m_renderedPages[page];
+        if (rendered.svg.isEmpty()) {
+            return {}; // not rendered yet
+        }
+        SVDEBUG << "ScoreWidget::getPageRenderer: Making renderer for page "
+                << page << endl;
+        auto renderer = make_shared<QSvgRenderer>(rendered.svg);
+        renderer->setAspectRatioMode(Qt::KeepAspectRatio);
+        installPageRenderer(page, renderer, true);
+    } else {
+        m_pageLastUsed[page] = ++m_pageUseClock;
+    }
+
+    return m_svgPages[page];
+}
+
+void
+ScoreWidget::installPageRenderer(int page,
+                                 shared_ptr<QSvgRenderer> renderer,
+                                 bool used)
+{
+    if (!renderer || page < 0 || page >= int(m_svgPages.size())) {
+        return;
+    }
+    
+    m_svgPages[page] = renderer;
+    m_pageLastUsed[page] = (used ? ++m_pageUseClock : 0);
+    evictPageRenderers();
+}
+
+void
+ScoreWidget::evictPageRenderers()
+{
+    auto isKept = [&](int p) {
+        return m_page >= 0 && std::abs(p - m_page) <= 1;
+    };
+    
+    int resident = 0;
+    for (const auto &r : m_svgPages) {
+        if (r) ++resident;
+    }
+
+    while (resident > m_pageRendererLimit) {
+
+        int victim = -1;
+        for (int p = 0; p < int(m_svgPages.size()); ++p) {
+            if (!m_svgPages[p] || isKept(p)) continue;
+            if (victim < 0 ||
+                m_pageLastUsed[p] < m_pageLastUsed[victim] ||
+                (m_pageLastUsed[p] == m_pageLastUsed[victim] &&
+                 std::abs(p - m_page) > std::abs(victim - m_page))) {
+                victim = p;
+            }
+        }
+        if (victim < 0) {
+            break;
+        }
+
+#ifdef DEBUG_SCORE_WIDGET
+        SVDEBUG << "ScoreWidget::evictPageRenderers: Dropping renderer for page "
+                << victim << endl;
+#endif
+
+        m_svgPages[victim] = {};
+        --resident;
+    }
+}
+
+void
+ScoreWidget::prefetchPages()
+{
+    // Make the renderers for the pages either side of the one shown
+    // in the background, so that paging through the score does not
+    // wait for them. Each comes back to the GUI thread, and is
+    // dropped there if its page has been rendered again since
+    
+    QThread *guiThread = thread();
+    
+    for (int p : { m_page + 1, m_page - 1 }) {
+
+        if (p < 0 || p >= int(m_svgPages.size()) || m_svgPages[p]) {
+            continue;
+        }
+        
+        const RenderedPage &rendered = m_renderedPages[p];
+        if (rendered.svg.isEmpty() ||
+            m_prefetching.find(rendered.serial) != m_prefetching.end()) {
+            continue;
+        }
+
+        uint64_t serial = rendered.serial;
+        QByteArray svg = rendered.svg;
+        m_prefetching.insert(serial);
+        
+        m_prefetchPool->start([this, p, serial, svg, guiThread]() {
+            auto renderer = make_shared<QSvgRenderer>(svg);
+            renderer->setAspectRatioMode(Qt::KeepAspectRatio);
+            renderer->moveToThread(guiThread);
+            QMetaObject::invokeMethod
+                (this, [this, p, serial, renderer]() {
+                    m_prefetching.erase(serial);
+                    if (p < int(m_svgPages.size()) && !m_svgPages[p] &&
+                        m_renderedPages[p].serial == serial) {
+                        installPageRenderer(p, renderer, false);
+                    }
+                }, Qt::QueuedConnection);
+        });
+    }
 }
 
 void
@@ -984,36 +1959,54 @@ ScoreWidget::showPage(int page)
     m_page = page;
     emit pageChanged(m_page);
     update();
+
+    prefetchPages();
 }
 
 void
 ScoreWidget::setHighlightEventByLabel(EventLabel label)
 {
-    m_eventToHighlight = getEventWithLabel(label);
-    if (m_eventToHighlight.isNull()) {
+    auto itr = m_eventByLabel.find(label);
+    if (itr == m_eventByLabel.end()) {
         SVDEBUG << "ScoreWidget::setHighlightEventByLabel: Label \"" << label
                 << "\" not found" << endl;
+        m_noteToHighlight = -1;
+        m_highlightEventLabel = "";
+        return;
+    }
+
+    setHighlightEventByIndex(itr->second);
+}
+
+void
+ScoreWidget::setHighlightEventByIndex(int indexInEvents)
+{
+    m_noteToHighlight = getHighlightNoteFor(indexInEvents);
+    if (m_noteToHighlight < 0) {
+        SVDEBUG << "ScoreWidget::setHighlightEventByIndex: No note found for event "
+                << indexInEvents << endl;
         m_highlightEventLabel = "";
         return;
     }
 
-    m_highlightEventLabel = label;
+    m_highlightEventLabel = getEvent(indexInEvents).label;
     
 #ifdef DEBUG_SCORE_WIDGET
-    SVDEBUG << "ScoreWidget::setHighlightEventByLabel: Event with label \""
-            << label << "\" found at " << m_eventToHighlight.location << endl;
+    SVDEBUG << "ScoreWidget::setHighlightEventByIndex: Event with label \""
+            << m_highlightEventLabel << "\" found at "
+            << getEvent(indexInEvents).location << endl;
 #endif
     
-    int page = m_eventToHighlight.page;
+    int page = m_notes[m_noteToHighlight].page;
     if (page != m_page) {
 #ifdef DEBUG_SCORE_WIDGET
-        SVDEBUG << "ScoreWidget::setHighlightEventByLabel: Flipping to page "
+        SVDEBUG << "ScoreWidget::setHighlightEventByIndex: Flipping to page "
                 << page << endl;
 #endif
         showPage(page);
+    } else {
+        updateHighlight();
     }
-
-    update();
 }
 
 void
@@ -1029,6 +2022,12 @@ ScoreWidget::setInteractionMode(InteractionMode mode)
 #endif
     
     m_mode = mode;
-    update();
+
+    // The highlight colour depends on the mode, so what is painted
+    // must be repainted even where nothing has moved; anything that
+    // has moved is added by the updates after
+    update(QRegion(m_paintedHighlightRect).united(m_paintedSelection));
+    updateHighlight();
+    updateSelection();
     emit interactionModeChanged(m_mode);
 }
@@ -15,13 +15,31 @@
 
 #include <QTemporaryDir>
 #include <QFrame>
+#include <QPixmap>
+#include <QRegion>
 
+#include <atomic>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <tuple>
+#include <unordered_map>
 
 #include "piano-precision-aligner/Score.h"
 
+#include "MeiMeasureTable.h"
+#include "SvgPageCache.h"
+
 class QSvgRenderer;
-class QDomElement;
+class QThread;
+class QThreadPool;
+class QTimer;
+
+namespace vrv {
+class Toolkit;
+}
 
 class ScoreWidget : public QFrame
 {
@@ -41,10 +59,32 @@ public:
     virtual ~ScoreWidget();
 
     /** 
-     * Load a score, by MEI filename. If loading fails, return false
-     * and set the error string accordingly.
+     * Load a score, by MEI filename, cancelling any background load
+     * in progress. If loading fails, return false and set the error
+     * string accordingly.
      */
     bool loadScoreFile(QString name, QString filename, QString &error);
+
+    /**
+     * Start loading a score, by MEI filename, in the background,
+     * cancelling any load already in progress. The pages are added
+     * in order as they are rendered, and the first is shown as soon
+     * as it is ready. Emits loadProgress as each page is added, then
+     * either loadCompleted or loadFailed. Nothing is emitted for a
+     * load that is cancelled.
+     */
+    void loadScoreFileAsync(QString name, QString filename);
+
+    /**
+     * Cancel any background load in progress. Pages already added
+     * are kept.
+     */
+    void cancelLoad();
+
+    /**
+     * Return true if a background load is in progress.
+     */
+    bool isLoading() const;
     
     /** 
      * Set the musical event list for the current score, containing
@@ -80,6 +120,20 @@ public:
      * Get the scale factor for score rendering.
      */
     int getScale() const;
+
+    /**
+     * Set the number of pages to keep ready to draw at once. Each
+     * page's SVG renderer is made when the page is first shown, or
+     * ahead of time when a neighbouring page is shown, and those of
+     * the least recently shown pages are dropped again beyond this
+     * number. The default is 6.
+     */
+    void setPageRendererLimit(int pages);
+
+    /**
+     * Get the number of pages to keep ready to draw at once.
+     */
+    int getPageRendererLimit() const;
     
     /**
      * Return the start and end locations and labels of the current
@@ -119,6 +173,13 @@ public slots:
      */
     void setHighlightEventByLabel(EventLabel label);
 
+    /**
+     * Set the current event to be highlighted, by its index in the
+     * musical event list. This is the same as setting it by the
+     * label of that event, without the lookup.
+     */
+    void setHighlightEventByIndex(int indexInEvents);
+
     /**
      * Select an interaction mode.
      */
@@ -137,6 +198,8 @@ public slots:
     
 signals:
     void loadFailed(QString scoreNameOrFile, QString errorMessage);
+    void loadProgress(QString scoreName, int pagesReady, int pageCount);
+    void loadCompleted(QString scoreName);
     void interactionModeChanged(InteractionMode newMode);
     void scoreLocationHighlighted(Fraction, EventLabel, InteractionMode);
     void scoreLocationActivated(Fraction, EventLabel, InteractionMode);
@@ -169,80 +232,237 @@ protected:
     void paintEvent(QPaintEvent *) override;
     
 private:
-    /**
-     * EventId is for MEI-derived note IDs (or other MEI element IDs)
-     * used within this class to identify specific elements. These are
-     * not exposed in the API.
-     */
-    typedef QString EventId;
-    
     QString m_scoreName;
     QString m_scoreFilename;
     std::string m_verovioResourcePath;
-    std::vector<std::shared_ptr<QSvgRenderer>> m_svgPages;
+    std::vector<std::shared_ptr<QSvgRenderer>> m_svgPages; // null if not made
     int m_page;
     int m_scale;
 
     Score::MusicalEventList m_musicalEvents;
-    
-    struct EventData {
-        EventId id;
+
+    // What was rendered on each page by the last load. This is
+    // enough to make the page's renderer again and to place events
+    // on it without one, so that renderers need be kept only for the
+    // pages recently shown. When the same score is loaded again
+    // after an edit, the pages whose measures the edit did not
+    // affect can be kept as they are
+    struct RenderedPage {
+        uint64_t serial; // unique to this rendering of the page
+        QByteArray svg; // SVG 1.2 Tiny, empty if not rendered yet
+        std::vector<std::string> measureIds;
+        VrvTrim::Geometry geometry; // size, system extents, note boxes
+
+        RenderedPage() : serial(0) { }
+        QSizeF getSize() const {
+            return QSizeF(geometry.width, geometry.height);
+        }
+    };
+    std::vector<RenderedPage> m_renderedPages; // parallel to m_svgPages
+    MeiMeasureTable m_renderedMeasureTable;
+    int m_renderedScale;
+
+    // Loading. The pages are rendered by renderPages, which touches
+    // no members and so may run on a worker thread, and are handed
+    // back to addLoadedPage and finishLoad on the GUI thread
+    struct LoadRequest {
+        QString scoreName;
+        QString scoreFile;
+        std::string resourcePath;
+        int scale;
+        // From the last complete load of the same score at the same
+        // scale, if any, for the pages that can be kept
+        std::vector<RenderedPage> previousPages;
+        MeiMeasureTable previousMeasureTable;
+        // A toolkit with this same score already loaded, if any, to
+        // be laid out again rather than loading the file a second
+        // time, and the hash of the MEI it was loaded from
+        std::shared_ptr<vrv::Toolkit> toolkit;
+        std::string toolkitContentHash;
+    };
+    struct LoadedPage {
         int page;
-        QRectF boxOnPage;
+        int pageCount;
+        int reusedFrom; // index in m_previousSvgPages, or -1
+        std::shared_ptr<QSvgRenderer> renderer; // null if reused or not made
+        RenderedPage rendered;
+    };
+    struct LoadJob {
+        std::atomic<bool> cancelled { false };
+        // For a relayout at a new scale, the job has the toolkit
+        // until it is done, and uses it only with the mutex held
+        bool rescaling = false;
+        std::shared_ptr<vrv::Toolkit> toolkit;
+        std::string contentHash;
+        std::mutex toolkitMutex;
+        int scale = 0;
+    };
+    std::shared_ptr<LoadJob> m_currentLoad;
+    std::vector<std::shared_ptr<QSvgRenderer>> m_previousSvgPages;
+    QThreadPool *m_loadPool;
+
+    // The toolkit with the current score loaded, kept so that a
+    // change of scale needs only a relayout. Null while a load or
+    // relayout is in progress. The pages laid out from it are cached
+    // under the hash of the MEI as the toolkit loaded it, which the
+    // file on disk may no longer match; empty if that is not known
+    std::shared_ptr<vrv::Toolkit> m_toolkit;
+    std::string m_toolkitContentHash;
+    QTimer *m_rescaleTimer;
+
+    bool loadScoreFile(QString scoreName, QString scoreFile,
+                       std::shared_ptr<vrv::Toolkit> toolkit,
+                       std::string toolkitContentHash,
+                       QString &errorString);
+    LoadRequest beginLoad(QString scoreName, QString scoreFile);
+    void addLoadedPage(LoadedPage page);
+    void finishLoad(const LoadRequest &request,
+                    const MeiMeasureTable &measureTable,
+                    std::shared_ptr<vrv::Toolkit> toolkit,
+                    std::string contentHash);
+    static bool renderPages(const LoadRequest &request,
+                            QThread *guiThread,
+                            const std::atomic<bool> &cancelled,
+                            std::function<void(LoadedPage)> pageReady,
+                            MeiMeasureTable &measureTable,
+                            std::shared_ptr<vrv::Toolkit> &toolkit,
+                            std::string &contentHash,
+                            QString &errorString);
+    static SvgPageCache::Page convertPage(const std::string &svgText);
+    static void preparePage(const SvgPageCache::Page &converted,
+                            QThread *guiThread, bool withRenderer,
+                            LoadedPage &page);
+    static std::string getLayoutOptions(int scale);
+    static void applyScale(vrv::Toolkit &toolkit, int scale);
+
+    void rescale();
+    void setLoadedPage(LoadedPage page);
+    void finishRescale(std::shared_ptr<LoadJob> job);
+
+    // Renderers for the pages in m_svgPages are made on demand from
+    // m_renderedPages. The neighbours of the page shown are made
+    // ahead of time in the prefetch pool; beyond the limit, those
+    // least recently used are dropped, furthest from the page shown
+    // first when there is nothing else to choose between them
+    std::vector<uint64_t> m_pageLastUsed; // parallel to m_svgPages
+    uint64_t m_pageUseClock;
+    int m_pageRendererLimit;
+    QThreadPool *m_prefetchPool;
+    std::set<uint64_t> m_prefetching; // serials
+    std::shared_ptr<QSvgRenderer> getPageRenderer(int page);
+    void installPageRenderer(int page, std::shared_ptr<QSvgRenderer>,
+                             bool used);
+    void evictPageRenderers();
+    void prefetchPages();
+
+    // The musical events, and the notes of them found on the pages,
+    // referred to by index in these tables with -1 for none. The
+    // events are indexed as in m_musicalEvents and are generated when
+    // the musical event data is set. The notes are found after the
+    // score has been loaded, and are in score order so that those of
+    // any one event, and those on any one page, are contiguous
+    struct EventData {
         Fraction location;
         EventLabel label;
-        int indexInEvents;
+        int firstNote; // index in m_notes
+        int noteCount;
 
-        bool isNull() const { return id == ""; }
+        EventData() : firstNote(-1), noteCount(0) { }
     };
-
-    // MEI id-to-extent relations: these are generated from the SVG
-    // XML when the score is loaded
-    struct Extent {
-        double y;
-        double height;
-
-        Extent() : y(0.0), height(0.0) { }
-        Extent(double y_, double height_) : y(y_), height(height_) { }
-        bool isNull() const { return y == 0.0 && height == 0.0; }
+    struct NoteData {
+        std::string id; // MEI note ID
+        int event; // index in m_events
+        int page;
+        QRectF rectOnPage; // the note's box, the height of its system
     };
-    std::map<EventId, Extent> m_noteSystemExtentMap;
+    std::vector<EventData> m_events;
+    std::vector<NoteData> m_notes;
+    std::unordered_map<EventLabel, int> m_eventByLabel;
+    std::unordered_map<std::string, int> m_noteById;
+    void clearNotes();
 
-    // Relations between MEI IDs and musical events: these are
-    // generated when the musical event data is set, after the score
-    // has been loaded
-    std::map<EventId, EventData> m_idDataMap;
-    std::map<EventLabel, EventId> m_labelIdMap;
-    std::map<int, std::vector<EventId>> m_pageEventsMap;
+    // Per-page index for hit-testing, built in page coordinates
+    // along with the notes. The notes on a page are grouped by system
+    // (strictly, by vertical extent), with the systems sorted by top
+    // edge and the notes in each by left edge
+    struct HitEvent {
+        double x;
+        int note; // index in m_notes, also used to break ties
+    };
+    struct HitSystem {
+        double y0;
+        double y1;
+        double reach; // greatest y1 of this and all earlier systems
+        std::vector<HitEvent> events;
+    };
+    struct PageHitIndex {
+        std::vector<HitSystem> systems;
+    };
+    std::vector<PageHitIndex> m_pageHitIndex; // by page
+    void buildHitIndex();
 
     InteractionMode m_mode;
-    EventData m_eventUnderMouse;
+    int m_noteUnderMouse;
     EventLabel m_highlightEventLabel;
-    EventData m_eventToHighlight;
-    EventData m_selectStart;
-    EventData m_selectEnd;
+    int m_noteToHighlight;
+    int m_selectStart; // event
+    int m_selectEnd; // event
     bool m_mouseActive;
 
-    EventData getEventAtPoint(QPoint);
-
-    EventData getEventWithId(EventId id) const;
-    EventData getEventWithId(const std::string &id) const;
-    EventData getEventWithLabel(EventLabel label) const;
-    EventData getEventForMusicalEvent(const Score::MusicalEvent &) const;
+    int getNoteAtPoint(QPoint) const;
+    int getHighlightNoteFor(int event) const;
+    const EventData &getEventOfNote(int note) const;
+    const EventData &getEvent(int event) const;
     
-    EventData getScoreStartEvent() const;
-    EventData getScoreEndEvent() const;
+    int getScoreStartEvent() const;
+    int getScoreEndEvent() const;
 
     bool isSelectedFromStart() const;
     bool isSelectedToEnd() const;
     bool isSelectedAll() const;
 
-    QRectF getHighlightRectFor(const EventData &);
-    
-    void findSystemExtents(QByteArray, std::shared_ptr<QSvgRenderer>);
+    QRectF getHighlightRectFor(int note) const;
+    QRectF getCurrentHighlightRect();
+    std::vector<QRectF> getSelectionRects();
+
+    // What the last paint drew over the page, so that a change to
+    // the highlight or selection can repaint just what it affects
+    QRect m_paintedHighlightRect;
+    QRegion m_paintedSelection;
+    static QRect toDamageRect(const QRectF &);
+    void updateHighlight();
+    void updateSelection();
     
     QTransform m_widgetToPage;
     QTransform m_pageToWidget;
+
+    // Pages rasterised at the size last painted, so that a repaint
+    // that only moves the highlight or selection - which happens on
+    // every mouse move - need not render the SVG again, nor even
+    // have a renderer for the page. Keyed by the serial of the
+    // rendered page rather than page number so that pages kept
+    // across a reload keep their rasters too
+    struct RasterKey {
+        uint64_t serial;
+        int scale;
+        int width;
+        int height;
+        double devicePixelRatio;
+        bool operator<(const RasterKey &k) const {
+            return std::tie(serial, scale, width, height, devicePixelRatio) <
+                std::tie(k.serial, k.scale, k.width, k.height,
+                         k.devicePixelRatio);
+        }
+    };
+    struct RasterEntry {
+        QPixmap pixmap;
+        uint64_t lastUsed;
+    };
+    std::map<RasterKey, RasterEntry> m_rasterCache;
+    uint64_t m_rasterCacheClock;
+
+    QPixmap getPageRaster(int page, QSize size);
+    void pruneRasterCache();
 };
 
 #endif
@@ -29,6 +29,8 @@
 #include <QMessageBox>
 #include <QFileInfo>
 
+#include <algorithm>
+
 using namespace std;
 using namespace sv;
 
@@ -76,6 +78,7 @@ Session::setDocument(Document *doc,
     m_inEditMode = false;
 
     resetAlignmentEntries();
+    invalidateOnsetFrames();
 }
 
 void
@@ -361,6 +364,7 @@ Session::modelChanged(ModelId id)
     SVDEBUG << "Session::modelChanged: model is " << id << endl;
 
     if (m_displayedOnsetsLayer && id == m_displayedOnsetsLayer->getModel()) {
+        invalidateOnsetFrames();
         recalculateTempoLayer();
         emit alignmentModified();
     }
@@ -622,6 +626,7 @@ Session::importAlignmentFrom(QString path)
 
     disconnect(existingModel.get(), SIGNAL(modelChanged(ModelId)),
                this, nullptr);
+    invalidateOnsetFrames();
     
     EventVector oldEvents = existingModel->getAllEvents();
     EventVector newEvents = stvm->getAllEvents();
@@ -650,20 +655,115 @@ Session::setMusicalEvents(const Score::MusicalEventList &musicalEvents)
 {
     m_musicalEvents = musicalEvents;
     resetAlignmentEntries();
+    invalidateOnsetFrames();
 }
 
 void
 Session::resetAlignmentEntries()
 {
     m_alignmentEntries.clear();
+    m_eventIndexByLabel.clear();
     // Calculating the mapping from score musical events to m_alignmentEntries
     for (auto &event : m_musicalEvents) {
         Score::MeasureInfo info = event.measureInfo;
         std::string label = info.toLabel();
+        // If a label is repeated, the first event with it is used
+        m_eventIndexByLabel.insert({ label, int(m_alignmentEntries.size()) });
         m_alignmentEntries.push_back(AlignmentEntry(label, -1)); // -1 is placeholder
     }
 }
 
+void
+Session::invalidateOnsetFrames()
+{
+    m_onsetFrames.clear();
+    m_onsetFramesModel = {};
+    m_onsetCursor = 0;
+}
+
+bool
+Session::updateOnsetFrames()
+{
+    if (!m_displayedOnsetsLayer) {
+        invalidateOnsetFrames();
+        return false;
+    }
+
+    ModelId modelId = m_displayedOnsetsLayer->getModel();
+    auto model = ModelById::getAs<SparseOneDimensionalModel>(modelId);
+    if (!model) {
+        invalidateOnsetFrames();
+        return false;
+    }
+
+    // We hear about edits to the accepted onsets through modelChanged,
+    // but not about the pending ones, which are added to as the
+    // aligner runs: so check the count as well
+    if (modelId == m_onsetFramesModel &&
+        int(m_onsetFrames.size()) == model->getEventCount()) {
+        return true;
+    }
+
+    invalidateOnsetFrames();
+
+    auto onsets = model->getAllEvents(); // in frame order
+    m_onsetFrames.reserve(onsets.size());
+    for (const auto &onset : onsets) {
+        auto itr = m_eventIndexByLabel.find(onset.getLabel().toStdString());
+        m_onsetFrames.push_back
+            ({ onset.getFrame(),
+               itr == m_eventIndexByLabel.end() ? -1 : itr->second });
+    }
+
+    m_onsetFramesModel = modelId;
+    return true;
+}
+
+int
+Session::getMusicalEventIndexAtFrame(sv_frame_t frame)
+{
+    if (!updateOnsetFrames() || m_onsetFrames.empty()) {
+        return -1;
+    }
+
+    // Find the first onset not before the frame, starting from where
+    // we found it last time. During playback that is the same onset
+    // or one of the next few; otherwise we have jumped, and search
+    
+    static const int maxCursorSteps = 8;
+    
+    auto begin = m_onsetFrames.begin();
+    auto end = m_onsetFrames.end();
+    auto before = [](const OnsetFrame &onset, sv_frame_t f) {
+        return onset.frame < f;
+    };
+
+    int n = int(m_onsetFrames.size());
+    int i = std::min(m_onsetCursor, n);
+
+    if (i > 0 && m_onsetFrames[i-1].frame >= frame) {
+        i = int(std::lower_bound(begin, begin + i, frame, before) - begin);
+    } else {
+        int steps = 0;
+        while (i < n && m_onsetFrames[i].frame < frame) {
+            if (++steps > maxCursorSteps) {
+                i = int(std::lower_bound(begin + i, end, frame, before) - begin);
+                break;
+            }
+            ++i;
+        }
+    }
+
+    m_onsetCursor = i;
+
+    // The onset at the frame if there is one, otherwise the one
+    // before it, or the first if there is none before
+    if (i < n && m_onsetFrames[i].frame == frame) {
+        return m_onsetFrames[i].event;
+    }
+    return m_onsetFrames[std::max(i - 1, 0)].event;
+}
+
 bool
 Session::updateAlignmentEntries()
 {
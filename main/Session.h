@@ -27,6 +27,9 @@
 
 #include "piano-precision-aligner/Score.h"
 
+#include <map>
+#include <vector>
+
 class Session : public QObject
 {
     Q_OBJECT
@@ -54,6 +57,17 @@ public:
 
     void setMusicalEvents(const Score::MusicalEventList &musicalEvents);
 
+    /**
+     * Return the index in the musical event list of the score
+     * position reached at the given audio frame, according to the
+     * displayed onsets: that of the onset at the frame, or the last
+     * one before it, or the first one if the frame precedes them
+     * all. Return -1 if there are no onsets or the onset's label is
+     * not that of any musical event. Calls for frames a little after
+     * the previous one, as during playback, need no search.
+     */
+    int getMusicalEventIndexAtFrame(sv::sv_frame_t frame);
+
 public slots:
     void setDocument(sv::Document *,
                      sv::Pane *topPane,
@@ -134,6 +148,20 @@ private:
 
     Score::MusicalEventList m_musicalEvents;
     std::vector<AlignmentEntry> m_alignmentEntries;
+    std::map<std::string, int> m_eventIndexByLabel;
+
+    // The displayed onsets in frame order, each with its index in
+    // m_musicalEvents (or -1), and a cursor into them that follows
+    // the frames asked for by getMusicalEventIndexAtFrame
+    struct OnsetFrame {
+        sv::sv_frame_t frame;
+        int event;
+    };
+    std::vector<OnsetFrame> m_onsetFrames;
+    sv::ModelId m_onsetFramesModel; // none if m_onsetFrames out of date
+    int m_onsetCursor; // index of the first onset not before last frame
+    void invalidateOnsetFrames();
+    bool updateOnsetFrames();
 };
 
 #endif
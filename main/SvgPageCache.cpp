@@ -0,0 +1,205 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "SvgPageCache.h"
+#include "ScoreCache.h"
+
+#include "verovio/include/vrv/vrv.h"
+
+#include "base/Debug.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QTemporaryFile>
+
+using std::string;
+using std::vector;
+
+// The extension of the file holding the pages in a ScoreCache entry
+static const string pagesExtension = "svgpages";
+
+static const quint32 pagesMagic = 0x50505350; // "PPSP"
+
+// Increment this whenever the file layout, or the output of VrvTrim,
+// changes: it is part of the key, so older entries are then ignored
+static const quint32 pagesFormatVersion = 2;
+
+string
+SvgPageCache::makeKey(string contentHash, string layoutOptions, int scale)
+{
+    string parameters = "verovio " + vrv::GetVersion() +
+        "\nsvgpages " + std::to_string(pagesFormatVersion) +
+        "\nlayout " + layoutOptions +
+        "\nscale " + std::to_string(scale);
+
+    return ScoreCache::makeKeyForContent(contentHash, parameters);
+}
+
+bool
+SvgPageCache::contains(string key)
+{
+    return ScoreCache::getEntryFile(key, pagesExtension) != "";
+}
+
+bool
+SvgPageCache::retrieve(string key, vector<Page> &pages)
+{
+    pages.clear();
+
+    string path = ScoreCache::getEntryFile(key, pagesExtension);
+    if (path == "") {
+        return false;
+    }
+
+    QFile file(QString::fromStdString(path));
+    if (!file.open(QIODevice::ReadOnly)) {
+        SVDEBUG << "SvgPageCache::retrieve: Failed to open " << path
+                << ": " << file.errorString() << endl;
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+
+    quint32 magic = 0, version = 0;
+    qint32 pageCount = 0;
+    stream >> magic >> version >> pageCount;
+    if (magic != pagesMagic || version != pagesFormatVersion ||
+        pageCount < 0) {
+        SVDEBUG << "SvgPageCache::retrieve: Unexpected header in "
+                << path << endl;
+        return false;
+    }
+
+    pages.resize(pageCount);
+
+    for (auto &page : pages) {
+
+        qint32 measureCount = 0, extentCount = 0, boxCount = 0;
+        VrvTrim::Geometry &geometry = page.geometry;
+
+        stream >> page.svg >> geometry.width >> geometry.height
+               >> measureCount;
+        if (stream.status() != QDataStream::Ok || measureCount < 0) break;
+
+        for (qint32 i = 0; i < measureCount; ++i) {
+            QByteArray id;
+            stream >> id;
+            page.measureIds.push_back(id.toStdString());
+        }
+
+        stream >> extentCount;
+        if (stream.status() != QDataStream::Ok || extentCount < 0) break;
+
+        for (qint32 i = 0; i < extentCount; ++i) {
+            QByteArray id;
+            VrvTrim::Extent extent;
+            stream >> id >> extent.y >> extent.height;
+            geometry.noteSystemExtents[id.toStdString()] = extent;
+        }
+
+        stream >> boxCount;
+        if (stream.status() != QDataStream::Ok || boxCount < 0) break;
+
+        for (qint32 i = 0; i < boxCount; ++i) {
+            QByteArray id;
+            VrvTrim::NoteBox box;
+            stream >> id >> box.x >> box.y >> box.width >> box.height;
+            box.id = id.toStdString();
+            geometry.noteBoxes.push_back(box);
+        }
+    }
+
+    if (stream.status() != QDataStream::Ok) {
+        SVDEBUG << "SvgPageCache::retrieve: Failed to read pages from "
+                << path << endl;
+        pages.clear();
+        return false;
+    }
+
+    SVDEBUG << "SvgPageCache::retrieve: Read " << pages.size()
+            << " page(s) for key " << key << endl;
+
+    return true;
+}
+
+bool
+SvgPageCache::store(string key, const vector<Page> &pages,
+                    string scoreName, int scale)
+{
+    if (key == "" || ScoreCache::getCacheDirectory() == "") {
+        return false;
+    }
+
+    // ScoreCache stores files by extension, so write the pages to a
+    // temporary file with the right one and have it copy that
+    QTemporaryFile file(QDir::temp().filePath
+                        (QString("piano-precision-XXXXXX.%1")
+                         .arg(QString::fromStdString(pagesExtension))));
+    if (!file.open()) {
+        SVDEBUG << "SvgPageCache::store: Failed to create temporary file: "
+                << file.errorString() << endl;
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+
+    stream << pagesMagic << pagesFormatVersion << qint32(pages.size());
+
+    for (const auto &page : pages) {
+        const VrvTrim::Geometry &geometry = page.geometry;
+        stream << page.svg << geometry.width << geometry.height
+               << qint32(page.measureIds.size());
+        for (const auto &id : page.measureIds) {
+            stream << QByteArray::fromStdString(id);
+        }
+        stream << qint32(geometry.noteSystemExtents.size());
+        for (const auto &e : geometry.noteSystemExtents) {
+            stream << QByteArray::fromStdString(e.first)
+                   << e.second.y << e.second.height;
+        }
+        stream << qint32(geometry.noteBoxes.size());
+        for (const auto &box : geometry.noteBoxes) {
+            stream << QByteArray::fromStdString(box.id)
+                   << box.x << box.y << box.width << box.height;
+        }
+    }
+
+    if (stream.status() != QDataStream::Ok || !file.flush()) {
+        SVDEBUG << "SvgPageCache::store: Failed to write pages: "
+                << file.errorString() << endl;
+        return false;
+    }
+
+    if (!ScoreCache::store(key, { file.fileName().toStdString() })) {
+        return false;
+    }
+    if (scoreName == "") {
+        return true;
+    }
+
+    // The key already covers everything the pages depend on, so
+    // the latest key for each score and scale is recorded with a
+    // fixed parameters string, and replaces whatever was there
+    // whatever Verovio version made it
+    string latestName = scoreName + "@" + pagesExtension + "-" +
+        std::to_string(scale);
+    string previous = ScoreCache::getLatestKey(latestName, pagesExtension);
+    ScoreCache::setLatestKey(latestName, pagesExtension, key);
+    if (previous != "" && previous != key) {
+        ScoreCache::removeUnlessLatest(previous);
+    }
+    
+    return true;
+}
@@ -0,0 +1,74 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_SVG_PAGE_CACHE_H
+#define SV_SVG_PAGE_CACHE_H
+
+#include "vrvtrim.h"
+
+#include <QByteArray>
+
+#include <string>
+#include <vector>
+
+/**
+ * Persistent store for the rendered pages of a score, as converted
+ * by VrvTrim and ready to hand to QSvgRenderer, together with what
+ * ScoreWidget needs to know about each page - its measures and the
+ * geometry VrvTrim found for it - so that a page needs no renderer
+ * until it is drawn. A set of pages is kept as a single file in a
+ * ScoreCache entry, keyed by the content of the MEI file as it was
+ * when loaded, the Verovio version and the layout options, so that
+ * reopening a score at a scale it has been shown at before needs no
+ * Verovio layout or SVG conversion at all.
+ */
+class SvgPageCache
+{
+public:
+    struct Page {
+        QByteArray svg; // SVG 1.2 Tiny
+        std::vector<std::string> measureIds;
+        VrvTrim::Geometry geometry;
+    };
+
+    /** Return the key for the pages rendered from an MEI file whose
+     *  bytes had the given hash (from ScoreCache::hashFile) with the
+     *  given Verovio layout options (as JSON) and scale. Return the
+     *  empty string if the hash is empty.
+     */
+    static std::string makeKey(std::string contentHash,
+                               std::string layoutOptions,
+                               int scale);
+
+    /** Return true if there are pages stored for the given key.
+     */
+    static bool contains(std::string key);
+
+    /** Read the pages stored for the given key into pages. Return
+     *  false, with pages empty, if there are none or they cannot be
+     *  read.
+     */
+    static bool retrieve(std::string key, std::vector<Page> &pages);
+
+    /** Store the given pages for the given key, as the latest pages
+     *  for the given score name at the given scale. The pages last
+     *  stored for that score and scale under a different key are
+     *  removed, so that the cache keeps one set per scale of each
+     *  score rather than one for every version of it. Return true
+     *  on success; failure to store is not fatal to anything but the
+     *  cache.
+     */
+    static bool store(std::string key, const std::vector<Page> &pages,
+                      std::string scoreName, int scale);
+};
+
+#endif
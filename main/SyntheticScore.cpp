@@ -0,0 +1,87 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "SyntheticScore.h"
+
+#include <sstream>
+
+using std::string;
+
+static const char *const pitchNames = "cdefgab";
+
+static void
+writeNote(std::ostringstream &out, int &noteNo, int step, int octave,
+          const char *tie)
+{
+    out << "<note xml:id=\"n" << noteNo++ << "\" pname=\""
+        << pitchNames[step % 7] << "\" oct=\"" << octave + step / 7
+        << "\" dur=\"4\"";
+    if (tie) {
+        out << " tie=\"" << tie << "\"";
+    }
+    out << "/>";
+}
+
+string
+SyntheticScore::makeMei(int measures)
+{
+    std::ostringstream out;
+
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        << "<mei xmlns=\"http://www.music-encoding.org/ns/mei\" meiversion=\"5.0\">\n"
+        << "<meiHead><fileDesc><titleStmt><title>Synthetic score</title>"
+        << "</titleStmt><pubStmt/></fileDesc></meiHead>\n"
+        << "<music><body><mdiv><score>\n"
+        << "<scoreDef meter.count=\"4\" meter.unit=\"4\"><staffGrp symbol=\"brace\">"
+        << "<staffDef n=\"1\" lines=\"5\" clef.shape=\"G\" clef.line=\"2\"/>"
+        << "<staffDef n=\"2\" lines=\"5\" clef.shape=\"F\" clef.line=\"4\"/>"
+        << "</staffGrp></scoreDef>\n"
+        << "<section>\n";
+
+    int noteNo = 0;
+    
+    for (int m = 0; m < measures; ++m) {
+
+        // The treble line climbs a step per measure and wraps round
+        // every two octaves; a tie into the next measure repeats its
+        // last pitch as that measure's first
+        int base = m % 14;
+        bool tieOut = (m % 4 == 3 && m + 1 < measures);
+        bool tieIn = (m % 4 == 0 && m > 0);
+        
+        out << "<measure xml:id=\"m" << m << "\" n=\"" << m + 1 << "\">";
+
+        out << "<staff n=\"1\"><layer n=\"1\">";
+        for (int i = 0; i < 4; ++i) {
+            int step = (tieIn && i == 0) ? ((m - 1) % 14 + 3) : base + i;
+            const char *tie = nullptr;
+            if (tieIn && i == 0) tie = "t";
+            if (tieOut && i == 3) tie = "i";
+            writeNote(out, noteNo, step, 4, tie);
+        }
+        out << "</layer></staff>";
+        
+        out << "<staff n=\"2\"><layer n=\"1\">";
+        for (int i = 0; i < 4; ++i) {
+            writeNote(out, noteNo, (base + i * 2) % 7, 2, nullptr);
+        }
+        out << "</layer></staff>";
+
+        out << "</measure>\n";
+    }
+
+    out << "</section>\n"
+        << "</score></mdiv></body></music>\n"
+        << "</mei>\n";
+
+    return out.str();
+}
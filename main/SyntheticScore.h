@@ -0,0 +1,37 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SV_SYNTHETIC_SCORE_H
+#define SV_SYNTHETIC_SCORE_H
+
+#include <string>
+
+/**
+ * Generator of MEI scores of any length, for the benchmarks. Each
+ * measure is in 4/4 on a two-staff piano system, with four quarter
+ * notes in each staff, so a score of n measures has 8n notes. The
+ * last treble note of every fourth measure is tied into the next
+ * measure. Measures have IDs "m0", "m1" ... and notes "n0", "n1"
+ * ... in document order.
+ */
+class SyntheticScore
+{
+public:
+    static const int notesPerMeasure = 8;
+    
+    /** Return the MEI text of a score with the given number of
+     *  measures.
+     */
+    static std::string makeMei(int measures);
+};
+
+#endif
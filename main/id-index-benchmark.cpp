@@ -0,0 +1,173 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+ * Scaling benchmark for the element lookups in the patched Verovio
+ * toolkit. For synthetic scores of a range of sizes, times
+ * GetNoteTable, the first lookup by ID (which builds the ID index),
+ * and then the per-note lookups ScoreParser makes for every note in
+ * a score. With the index, the time per lookup should stay flat as
+ * the score grows; without it, it grows with the number of notes.
+ */
+
+#include "ScoreParser.h"
+#include "SyntheticScore.h"
+
+#include "verovio-replace/include/vrv/toolkit.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../version.h"
+
+using std::string;
+using std::vector;
+
+typedef std::chrono::steady_clock Clock;
+
+static double
+msSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>
+        (Clock::now() - start).count();
+}
+
+static bool
+run(vrv::Toolkit &toolkit, int notes)
+{
+    int measures = (notes + SyntheticScore::notesPerMeasure - 1) /
+        SyntheticScore::notesPerMeasure;
+    string mei = SyntheticScore::makeMei(measures);
+
+    auto start = Clock::now();
+    if (!toolkit.LoadData(mei)) {
+        std::cerr << "Failed to load synthetic score of " << measures
+                  << " measures" << std::endl;
+        return false;
+    }
+    double loadMs = msSince(start);
+
+    start = Clock::now();
+    vrv::NoteTable table;
+    if (!toolkit.GetNoteTable(table)) {
+        std::cerr << "Failed to make note table for synthetic score of "
+                  << measures << " measures" << std::endl;
+        return false;
+    }
+    double tableMs = msSince(start);
+
+    // The first lookup after loading builds the index
+    start = Clock::now();
+    toolkit.GetMeasureIndexForNote(table.noteId[0]);
+    double indexMs = msSince(start);
+
+    // Then the lookups ScoreParser makes for each note
+    int found = 0;
+    start = Clock::now();
+    for (const auto &id : table.noteId) {
+        if (toolkit.GetMeasureIndexForNote(id) >= 0) {
+            ++found;
+        }
+        toolkit.GetTiedPartnerForNote(id);
+        toolkit.GetTimesForElement(id);
+    }
+    double lookupMs = msSince(start);
+
+    if (found != int(table.size())) {
+        std::cerr << "Found only " << found << " of " << table.size()
+                  << " notes by ID" << std::endl;
+        return false;
+    }
+    
+    std::cout << std::fixed
+              << table.size() << "\t"
+              << measures << "\t"
+              << std::setprecision(1) << loadMs << "ms\t"
+              << tableMs << "ms\t"
+              << indexMs << "ms\t"
+              << lookupMs << "ms\t"
+              << std::setprecision(2)
+              << lookupMs * 1000.0 / double(table.size()) << "us"
+              << std::endl;
+
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    QCoreApplication application(argc, argv);
+
+    QCoreApplication::setOrganizationName("sonic-visualiser");
+    QCoreApplication::setOrganizationDomain("sonicvisualiser.org");
+    QCoreApplication::setApplicationName("Piano Precision ID Index Benchmark");
+    QCoreApplication::setApplicationVersion(SV_VERSION);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription
+        ("\nTime note lookups by ID in the Verovio toolkit, for synthetic scores of a range of sizes.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    parser.addOption(QCommandLineOption
+                     ({ "n", "notes" },
+                      "Use scores of each of the comma-separated numbers of <notes>. The default is 1000,10000,50000.",
+                      "notes"));
+
+    parser.process(application);
+
+    vector<int> sizes { 1000, 10000, 50000 };
+    if (parser.isSet("notes")) {
+        sizes.clear();
+        for (auto s : parser.value("notes").split(",", Qt::SkipEmptyParts)) {
+            bool ok = false;
+            int n = s.toInt(&ok);
+            if (!ok || n < 1) {
+                std::cerr << "Invalid note count \"" << s.toStdString()
+                          << "\"" << std::endl;
+                return 2;
+            }
+            sizes.push_back(n);
+        }
+    }
+
+    string resourcePath = ScoreParser::getResourcePath();
+    if (resourcePath == "") {
+        std::cerr << "Failed to unpack Verovio resources" << std::endl;
+        return 1;
+    }
+
+    vrv::Toolkit toolkit(false);
+    if (!toolkit.SetResourcePath(resourcePath)) {
+        std::cerr << "Failed to set Verovio resource path" << std::endl;
+        return 1;
+    }
+
+    std::cout << "notes\tmeasures\tload\tnote table\tindex\tlookups\ttime/note"
+              << std::endl;
+
+    int failed = 0;
+    
+    for (int notes : sizes) {
+        if (!run(toolkit, notes)) {
+            ++failed;
+        }
+    }
+
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+ * Micro-benchmark for the placement of off notes in the .solo file,
+ * ScoreParser::addOffNotes. For made-up note lists of a range of
+ * lengths in measures, times it against the linear scan from the
+ * first measure that it replaced, and checks that the two place
+ * every off note in the same measure at the same beat.
+ */
+
+#include "ScoreParser.h"
+
+#include "verovio-replace/include/vrv/toolkit.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../version.h"
+
+using std::string;
+using std::vector;
+
+static const int notesPerMeasure = 8;
+
+// Measures cycle through 4/4, 3/4 and 6/8 so that their starts are
+// not evenly spaced
+static vector<int64_t>
+makeMeasureStarts(int measures)
+{
+    const int64_t lengths[] = {
+        4 * vrv::SCORE_TICKS_PER_QUARTER,
+        3 * vrv::SCORE_TICKS_PER_QUARTER,
+        3 * vrv::SCORE_TICKS_PER_QUARTER
+    };
+    vector<int64_t> starts { 0 };
+    for (int m = 1; m < measures; ++m) {
+        starts.push_back(starts.back() + lengths[(m - 1) % 3]);
+    }
+    return starts;
+}
+
+// Notes evenly spaced through each measure, of lengths from an eighth
+// to a whole note, so that some end within their measure, some
+// exactly at a later measure's start and some part way through it
+static vector<vrv::SoloNote>
+makeOnNotes(const vector<int64_t> &starts, int64_t end)
+{
+    vector<vrv::SoloNote> notes;
+    int measures = int(starts.size());
+    for (int m = 0; m < measures; ++m) {
+        int64_t length = (m + 1 < measures ? starts[m+1] : end) - starts[m];
+        for (int i = 0; i < notesPerMeasure; ++i) {
+            int64_t beat = length * i / notesPerMeasure;
+            int64_t duration = vrv::SCORE_TICKS_PER_QUARTER / 2 * (1 + (m + i) % 8);
+            notes.push_back(vrv::SoloNote
+                            (m + 1, beat, starts[m] + beat, duration,
+                             60 + (m + i) % 24,
+                             "n" + std::to_string(m * notesPerMeasure + i),
+                             1));
+        }
+    }
+    return notes;
+}
+
+// The off-note placement as it was before ScoreParser::addOffNotes,
+// searching from the first measure for each note
+static vector<vrv::SoloNote>
+addOffNotesByScan(const vector<vrv::SoloNote> &onNotes,
+                  const vector<int64_t> &starts)
+{
+    vector<vrv::SoloNote> lines = onNotes;
+    for (const auto &note : onNotes) {
+        int64_t end = note.cumulative + note.duration;
+        int endMeasure;
+        int64_t endBeat;
+        int m = 0;
+        while (m < int(starts.size()) && starts.at(m) < end) m++;
+        if (m < int(starts.size()) && end == starts.at(m)) {
+            endMeasure = m+1;
+            endBeat = 0;
+        } else {
+            endMeasure = m;
+            endBeat = end - starts.at(m-1);
+        }
+        lines.push_back(vrv::SoloNote(endMeasure, endBeat, end, note.duration, note.pitch, note.noteId, 0));
+    }
+    return lines;
+}
+
+template <typename F>
+static double
+timePerNote(F f, size_t notes, int repeats)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeats; ++i) {
+        f();
+    }
+    double sec = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+    return sec * 1.0e9 / (double(notes) * repeats);
+}
+
+static bool
+run(int measures, int repeats)
+{
+    auto starts = makeMeasureStarts(measures);
+    auto onNotes = makeOnNotes(starts, starts.back() +
+                               4 * vrv::SCORE_TICKS_PER_QUARTER);
+
+    auto expected = addOffNotesByScan(onNotes, starts);
+    auto actual = ScoreParser::addOffNotes(onNotes, starts);
+    if (actual.size() != expected.size()) {
+        std::cerr << "Got " << actual.size() << " lines, expected "
+                  << expected.size() << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < actual.size(); ++i) {
+        if (actual[i].measureIndex != expected[i].measureIndex ||
+            actual[i].beat != expected[i].beat ||
+            actual[i].cumulative != expected[i].cumulative) {
+            std::cerr << "Off note for " << actual[i].noteId
+                      << " placed at " << actual[i].measureIndex << "+"
+                      << actual[i].beat << ", expected "
+                      << expected[i].measureIndex << "+"
+                      << expected[i].beat << std::endl;
+            return false;
+        }
+    }
+
+    double scanNs = timePerNote([&]() {
+        auto lines = addOffNotesByScan(onNotes, starts);
+    }, onNotes.size(), repeats);
+    
+    double searchNs = timePerNote([&]() {
+        auto lines = ScoreParser::addOffNotes(onNotes, starts);
+    }, onNotes.size(), repeats);
+
+    std::cout << std::fixed
+              << measures << "\t"
+              << onNotes.size() << "\t"
+              << std::setprecision(1) << scanNs << "ns\t"
+              << searchNs << "ns\t"
+              << std::setprecision(1) << scanNs / searchNs << "x"
+              << std::endl;
+
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    QCoreApplication application(argc, argv);
+
+    QCoreApplication::setOrganizationName("sonic-visualiser");
+    QCoreApplication::setOrganizationDomain("sonicvisualiser.org");
+    QCoreApplication::setApplicationName("Piano Precision Off Note Benchmark");
+    QCoreApplication::setApplicationVersion(SV_VERSION);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription
+        ("\nTime the placement of off notes in measures, for made-up scores of a range of lengths.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    parser.addOption(QCommandLineOption
+                     ({ "m", "measures" },
+                      "Use scores of each of the comma-separated numbers of <measures>. The default is 100,500,2000,10000.",
+                      "measures"));
+    parser.addOption(QCommandLineOption
+                     ({ "r", "repeats" },
+                      "Place the off notes for each score <n> times. The default is 10.",
+                      "n"));
+
+    parser.process(application);
+
+    vector<int> sizes { 100, 500, 2000, 10000 };
+    if (parser.isSet("measures")) {
+        sizes.clear();
+        for (auto s : parser.value("measures").split(",", Qt::SkipEmptyParts)) {
+            bool ok = false;
+            int n = s.toInt(&ok);
+            if (!ok || n < 1) {
+                std::cerr << "Invalid measure count \"" << s.toStdString()
+                          << "\"" << std::endl;
+                return 2;
+            }
+            sizes.push_back(n);
+        }
+    }
+
+    int repeats = 10;
+    if (parser.isSet("repeats")) {
+        bool ok = false;
+        repeats = parser.value("repeats").toInt(&ok);
+        if (!ok || repeats < 1) {
+            std::cerr << "Invalid repeat count \""
+                      << parser.value("repeats").toStdString() << "\""
+                      << std::endl;
+            return 2;
+        }
+    }
+
+    std::cout << "measures\tnotes\tscan/note\tsearch/note\tspeedup"
+              << std::endl;
+
+    int failed = 0;
+    
+    for (int measures : sizes) {
+        if (!run(measures, repeats)) {
+            ++failed;
+        }
+    }
+
+    return failed > 0 ? 1 : 0;
+}
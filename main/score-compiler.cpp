@@ -0,0 +1,355 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+ * Headless score compiler: run ScoreParser::generateScoreFiles over
+ * every MEI file found below a directory, producing the .json, .meter
+ * and .solo files that the application would otherwise generate when
+ * a score is opened in the GUI.
+ *
+ * Scores are processed on a small work-stealing thread pool. Each
+ * worker owns its own Verovio toolkit, and all of them share the one
+ * unpacked Verovio resource directory.
+ */
+
+#include "ScoreParser.h"
+#include "BinaryScoreFile.h"
+
+#include "verovio-replace/include/vrv/toolkit.h"
+
+#include "base/Debug.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "../version.h"
+
+using std::string;
+using std::vector;
+
+namespace fs = std::filesystem;
+
+struct CompileJob
+{
+    fs::path meiFile;
+    fs::path outputDir;
+    fs::path previousBinaryFile; // empty if none
+    std::uintmax_t size;
+};
+
+/**
+ * Return the peak resident set size of this process so far, in
+ * bytes, or 0 if it cannot be determined. Note that this is
+ * process-wide: with several workers running, a figure reported
+ * against one score includes whatever the others had resident at
+ * the time.
+ */
+static std::size_t
+getPeakRSS()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                              sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return std::size_t(usage.ru_maxrss); // bytes on macOS
+#else
+    return std::size_t(usage.ru_maxrss) * 1024; // kilobytes elsewhere
+#endif
+#endif
+}
+
+/**
+ * A fixed set of jobs shared out between per-worker queues. A worker
+ * takes from the front of its own queue (largest job first) and, once
+ * that is empty, steals from the back of the others'. No jobs are
+ * added once the workers have started, so a worker that finds every
+ * queue empty can simply stop.
+ */
+class WorkStealingQueues
+{
+public:
+    WorkStealingQueues(int nworkers, const vector<CompileJob> &jobs) :
+        m_queues(nworkers) {
+        for (int i = 0; i < int(jobs.size()); ++i) {
+            m_queues[i % nworkers].jobs.push_back(jobs[i]);
+        }
+    }
+
+    bool take(int worker, CompileJob &job) {
+        {
+            Queue &own = m_queues[worker];
+            std::lock_guard<std::mutex> guard(own.mutex);
+            if (!own.jobs.empty()) {
+                job = own.jobs.front();
+                own.jobs.pop_front();
+                return true;
+            }
+        }
+        int n = int(m_queues.size());
+        for (int i = 1; i < n; ++i) {
+            Queue &other = m_queues[(worker + i) % n];
+            std::lock_guard<std::mutex> guard(other.mutex);
+            if (!other.jobs.empty()) {
+                job = other.jobs.back();
+                other.jobs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<CompileJob> jobs;
+    };
+    vector<Queue> m_queues;
+};
+
+static vector<CompileJob>
+findJobs(fs::path inputRoot, fs::path outputRoot, fs::path previousRoot)
+{
+    vector<CompileJob> jobs;
+
+    for (const auto &entry : fs::recursive_directory_iterator
+             (inputRoot, fs::directory_options::skip_permission_denied)) {
+
+        if (!entry.is_regular_file()) continue;
+
+        fs::path path = entry.path();
+        string ext = path.extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+        if (ext != ".mei") continue;
+
+        CompileJob job;
+        job.meiFile = path;
+        if (outputRoot.empty()) {
+            job.outputDir = path.parent_path();
+        } else {
+            job.outputDir = outputRoot /
+                fs::relative(path.parent_path(), inputRoot);
+        }
+        if (!previousRoot.empty()) {
+            fs::path previous = previousRoot /
+                fs::relative(path.parent_path(), inputRoot) /
+                (path.stem().string() + "." +
+                 BinaryScoreFile::extension);
+            std::error_code ec;
+            if (fs::is_regular_file(previous, ec)) {
+                job.previousBinaryFile = previous;
+            }
+        }
+        job.size = entry.file_size();
+        jobs.push_back(job);
+    }
+
+    // Queue the largest scores first, so that the longest single job
+    // is not left until the end with the other workers idle
+    std::sort(jobs.begin(), jobs.end(),
+              [](const CompileJob &a, const CompileJob &b) {
+                  return a.size > b.size;
+              });
+
+    return jobs;
+}
+
+int
+main(int argc, char **argv)
+{
+    QCoreApplication application(argc, argv);
+
+    QCoreApplication::setOrganizationName("sonic-visualiser");
+    QCoreApplication::setOrganizationDomain("sonicvisualiser.org");
+    QCoreApplication::setApplicationName("Piano Precision Score Compiler");
+    QCoreApplication::setApplicationVersion(SV_VERSION);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription
+        ("\nGenerate the .json, .meter and .solo files for every MEI score found below a directory.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    parser.addOption(QCommandLineOption
+                     ({ "o", "output" },
+                      "Write generated files into a tree below <dir> that mirrors the input tree, rather than alongside each MEI file.",
+                      "dir"));
+    parser.addOption(QCommandLineOption
+                     ({ "j", "jobs" },
+                      "Process up to <n> scores at once. The default is the number of hardware threads available.",
+                      "n"));
+    parser.addOption(QCommandLineOption
+                     ({ "p", "previous" },
+                      "Take the notes of measures unaffected by any edit since from the files generated earlier for the same scores in a tree below <dir>, as the application does when a score it has opened before has changed. The output should be the same as without this option; the number of measures taken from the earlier files is reported for each score.",
+                      "dir"));
+
+    parser.addPositionalArgument
+        ("<dir>", "Directory to search (recursively) for .mei files.");
+
+    parser.process(application);
+
+    QStringList args = parser.positionalArguments();
+    if (args.size() != 1) {
+        parser.showHelp(2);
+    }
+
+    fs::path inputRoot = fs::path(args[0].toStdString());
+    fs::path outputRoot;
+    if (parser.isSet("output")) {
+        outputRoot = fs::path(parser.value("output").toStdString());
+    }
+    fs::path previousRoot;
+    if (parser.isSet("previous")) {
+        previousRoot = fs::path(parser.value("previous").toStdString());
+    }
+
+    int nworkers = int(std::thread::hardware_concurrency());
+    if (parser.isSet("jobs")) {
+        bool ok = false;
+        nworkers = parser.value("jobs").toInt(&ok);
+        if (!ok || nworkers < 1) {
+            std::cerr << "Invalid job count \""
+                      << parser.value("jobs").toStdString() << "\"" << std::endl;
+            return 2;
+        }
+    }
+    if (nworkers < 1) nworkers = 1;
+
+    std::error_code ec;
+    if (!fs::is_directory(inputRoot, ec)) {
+        std::cerr << "Input location " << inputRoot.string()
+                  << " is not a directory" << std::endl;
+        return 1;
+    }
+
+    vector<CompileJob> jobs = findJobs(inputRoot, outputRoot, previousRoot);
+    if (jobs.empty()) {
+        std::cerr << "No .mei files found below " << inputRoot.string()
+                  << std::endl;
+        return 1;
+    }
+
+    // Unpack the resources once, here, before any worker asks for
+    // them; every toolkit then points at the same directory
+    string resourcePath = ScoreParser::getResourcePath();
+    if (resourcePath == "") {
+        std::cerr << "Failed to unpack Verovio resources" << std::endl;
+        return 1;
+    }
+
+    if (nworkers > int(jobs.size())) {
+        nworkers = int(jobs.size());
+    }
+
+    std::cerr << "Compiling " << jobs.size() << " score(s) using "
+              << nworkers << " worker(s)" << std::endl;
+
+    WorkStealingQueues queues(nworkers, jobs);
+    std::mutex outputMutex;
+    std::atomic<int> succeeded(0);
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto work = [&](int worker) {
+
+        vrv::Toolkit toolkit(false);
+        if (!toolkit.SetResourcePath(resourcePath)) {
+            std::lock_guard<std::mutex> guard(outputMutex);
+            std::cerr << "Worker " << worker
+                      << ": Failed to set Verovio resource path" << std::endl;
+            return; // its queued jobs will be stolen by the others
+        }
+
+        CompileJob job;
+        while (queues.take(worker, job)) {
+
+            string scoreName = job.meiFile.stem().string();
+            bool ok = true;
+            int reused = 0;
+
+            auto t0 = std::chrono::steady_clock::now();
+
+            std::error_code ec;
+            fs::create_directories(job.outputDir, ec);
+            if (ec) {
+                ok = false;
+            } else {
+                auto generated = ScoreParser::generateScoreFiles
+                    (toolkit, job.outputDir.string(), scoreName,
+                     job.meiFile.string(), job.previousBinaryFile.string(),
+                     &reused);
+                ok = !generated.empty();
+                if (!ok) reused = 0;
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            double sec = std::chrono::duration<double>(t1 - t0).count();
+            double rssMB = double(getPeakRSS()) / (1024.0 * 1024.0);
+
+            if (ok) ++succeeded;
+
+            std::lock_guard<std::mutex> guard(outputMutex);
+            std::cout << (ok ? "ok" : "FAILED") << "\t"
+                      << std::fixed << std::setprecision(3) << sec << "s\t"
+                      << std::setprecision(1) << rssMB << "MB\t"
+                      << reused << " reused\t"
+                      << job.meiFile.string() << std::endl;
+        }
+    };
+
+    vector<std::thread> threads;
+    for (int i = 0; i < nworkers; ++i) {
+        threads.push_back(std::thread(work, i));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    double total = std::chrono::duration<double>(end - start).count();
+
+    std::cerr << "Compiled " << succeeded << " of "
+              << jobs.size() << " score(s) in " << std::fixed
+              << std::setprecision(1) << total << "s, peak RSS "
+              << double(getPeakRSS()) / (1024.0 * 1024.0) << "MB"
+              << std::endl;
+
+    return (succeeded < int(jobs.size())) ? 1 : 0;
+}
@@ -0,0 +1,408 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+ * Benchmark for VrvTrim::transformSvgToTiny. Feeds it real Verovio
+ * page output, either rendered here from MEI files at a range of
+ * scales - a smaller scale fits more notation on each page - or read
+ * from SVG files previously saved from Verovio, and reports the time
+ * taken per page and the throughput.
+ *
+ * It also times the conversion without the page geometry, and the
+ * QDomDocument pass ScoreWidget used to find the system extents with
+ * before they were found during the conversion, so as to show what
+ * finding them in the same pass saves.
+ */
+
+#include "ScoreParser.h"
+#include "vrvtrim.h"
+
+#include "verovio-replace/include/vrv/toolkit.h"
+
+#include <QCommandLineParser>
+#include <QDomDocument>
+#include <QDomElement>
+#include <QGuiApplication>
+#include <QSvgRenderer>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../version.h"
+
+using std::string;
+using std::vector;
+
+namespace fs = std::filesystem;
+
+struct PageSet
+{
+    string label;
+    vector<string> pages;
+};
+
+static bool
+renderPages(vrv::Toolkit &toolkit, const fs::path &meiFile, int scale,
+            PageSet &set)
+{
+    toolkit.SetOptions("{\"scaleToPageSize\": true, \"footer\": \"none\"}");
+    toolkit.SetScale(scale);
+
+    if (!toolkit.LoadFile(meiFile.string())) {
+        return false;
+    }
+
+    int pp = toolkit.GetPageCount();
+    for (int p = 0; p < pp; ++p) {
+        set.pages.push_back(toolkit.RenderToSVG(p + 1));
+    }
+
+    std::ostringstream label;
+    label << meiFile.filename().string() << " @" << scale << "%";
+    set.label = label.str();
+    return true;
+}
+
+static bool
+readPage(const fs::path &svgFile, PageSet &set)
+{
+    std::ifstream in(svgFile, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::ostringstream content;
+    content << in.rdbuf();
+    set.pages.push_back(content.str());
+    set.label = svgFile.filename().string();
+    return true;
+}
+
+// The pass ScoreWidget made over each converted page to find the
+// system extents, before VrvTrim found them itself. Kept here, with
+// only its debug output removed, to compare against
+static void
+findSystemExtentsWithDom(QByteArray svgData, QSvgRenderer &renderer,
+                         VrvTrim::ExtentMap &extents)
+{
+    QDomDocument doc;
+    doc.setContent(svgData);
+
+    VrvTrim::Extent currentExtent { 0.0, 0.0 };
+    bool haveExtent = false;
+    vector<double> staffLines;
+
+    auto mapExtent = [&](QString id, double y0, double y1) {
+        QRectF mapped = renderer.transformForElement(id)
+            .mapRect(QRectF(0, y0, 1, y1 - y0));
+        currentExtent = { mapped.y(), mapped.height() };
+        haveExtent = true;
+    };
+    
+    auto extractExtent = [&](QDomElement path,
+                             QString systemId,
+                             QString staffId) {
+        
+        // We're looking for a path of the form Mx0 y0 Lx1 y1
+        
+        QStringList dd = path.attribute("d").split(" ", Qt::SkipEmptyParts);
+        if (dd.size() != 4) return;
+
+        if (dd[0].startsWith("M", Qt::CaseInsensitive)) {
+            dd[0] = dd[0].right(dd[0].length()-1);
+        } else return;
+
+        if (dd[2].startsWith("L", Qt::CaseInsensitive)) {
+            dd[2] = dd[2].right(dd[2].length()-1);
+        } else return;
+        
+        bool ok = false;
+        double x0 = dd[0].toDouble(&ok); if (!ok) return;
+        double y0 = dd[1].toDouble(&ok); if (!ok) return;
+        double x1 = dd[2].toDouble(&ok); if (!ok) return;
+        double y1 = dd[3].toDouble(&ok); if (!ok) return;
+        
+        if (systemId != "" && y1 > y0 && x1 == x0) {
+            mapExtent(systemId, y0, y1);
+            return;
+        }
+
+        if (staffId != "" && x1 > x0 && y1 == y0 &&
+            staffLines.size() < 5) {
+            staffLines.push_back(y0);
+            if (staffLines.size() == 5) {
+                mapExtent(staffId, staffLines[0], staffLines[4]);
+            }
+        }                
+    };
+    
+    std::function<void(QDomNode, QString, QString)> descend =
+        [&](QDomNode node, QString systemId, QString staffId) {
+
+        if (!node.isElement()) {
+            return;
+        }
+
+        QDomElement elt = node.toElement();
+        QString tag = elt.tagName();
+
+        if (systemId != "" || staffId != "") {
+            if (!haveExtent && tag == "path") {
+                extractExtent(elt, systemId, staffId);
+            }
+        }
+        
+        if (tag == "g") {
+
+            QStringList classes =
+                elt.attribute("class").split(" ", Qt::SkipEmptyParts);
+
+            if (systemId == "" && classes.contains("system")) {
+                systemId = elt.attribute("id");
+                haveExtent = false;
+            }
+
+            if (staffId == "" && classes.contains("staff")) {
+                staffId = elt.attribute("id");
+                staffLines.clear();
+                if (systemId == "") { // a staff outside a system
+                    haveExtent = false;
+                }
+            }
+            
+            if (haveExtent && classes.contains("note")) {
+                QString noteId = elt.attribute("id");
+                if (noteId != "") {
+                    extents[noteId.toStdString()] = currentExtent;
+                }
+            }
+        }
+            
+        auto children = node.childNodes();
+        for (int i = 0; i < children.size(); ++i) {
+            descend(children.at(i), systemId, staffId);
+        }
+    };
+
+    descend(doc.documentElement(), "", "");
+}
+
+template <typename F>
+static double
+timePerPage(const PageSet &set, int repeats, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeats; ++i) {
+        for (size_t p = 0; p < set.pages.size(); ++p) {
+            f(p);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(end - start).count();
+    return sec / (double(repeats) * double(set.pages.size()));
+}
+
+static void
+run(const PageSet &set, int repeats)
+{
+    if (set.pages.empty()) {
+        return;
+    }
+
+    size_t bytes = 0;
+    for (const auto &page : set.pages) {
+        bytes += page.size();
+    }
+
+    // One untimed pass, which also gives us the extent and box
+    // counts, and the converted pages and their renderers that the
+    // QDom pass needs
+    size_t extentCount = 0, boxCount = 0, domExtentCount = 0;
+    vector<QByteArray> converted;
+    vector<std::unique_ptr<QSvgRenderer>> renderers;
+    for (const auto &page : set.pages) {
+        VrvTrim::Geometry geometry;
+        converted.push_back(QByteArray::fromStdString
+                            (VrvTrim::transformSvgToTiny(page, geometry)));
+        extentCount += geometry.noteSystemExtents.size();
+        boxCount += geometry.noteBoxes.size();
+        renderers.push_back(std::make_unique<QSvgRenderer>(converted.back()));
+        VrvTrim::ExtentMap extents;
+        findSystemExtentsWithDom(converted.back(), *renderers.back(), extents);
+        domExtentCount += extents.size();
+    }
+
+    if (domExtentCount != extentCount) {
+        std::cerr << "QDom pass found " << domExtentCount
+                  << " note extents in " << set.label << ", conversion found "
+                  << extentCount << std::endl;
+    }
+    
+    double fused = timePerPage(set, repeats, [&](size_t p) {
+        VrvTrim::Geometry geometry;
+        VrvTrim::transformSvgToTiny(set.pages[p], geometry);
+    });
+    double plain = timePerPage(set, repeats, [&](size_t p) {
+        VrvTrim::transformSvgToTiny(set.pages[p]);
+    });
+    double dom = timePerPage(set, repeats, [&](size_t p) {
+        VrvTrim::ExtentMap extents;
+        findSystemExtentsWithDom(converted[p], *renderers[p], extents);
+    });
+
+    double kbPerPage = double(bytes) / 1024.0 / double(set.pages.size());
+    double mbPerSec = double(bytes) / double(set.pages.size()) /
+        (1024.0 * 1024.0) / fused;
+
+    // What finding the geometry in the conversion saves over
+    // converting and then making the QDom pass
+    double saved = plain + dom - fused;
+
+    std::cout << std::fixed
+              << set.pages.size() << "\t"
+              << std::setprecision(1) << kbPerPage << "KB\t"
+              << extentCount << "\t"
+              << boxCount << "\t"
+              << std::setprecision(3) << fused * 1000.0 << "ms\t"
+              << std::setprecision(1) << mbPerSec << "MB/s\t"
+              << std::setprecision(3) << plain * 1000.0 << "ms\t"
+              << dom * 1000.0 << "ms\t"
+              << saved * 1000.0 << "ms\t"
+              << set.label << std::endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    // QSvgRenderer, used for the QDom pass, needs a GUI application
+    // but not a display
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    
+    QGuiApplication application(argc, argv);
+
+    QCoreApplication::setOrganizationName("sonic-visualiser");
+    QCoreApplication::setOrganizationDomain("sonicvisualiser.org");
+    QCoreApplication::setApplicationName("Piano Precision SVG Benchmark");
+    QCoreApplication::setApplicationVersion(SV_VERSION);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription
+        ("\nTime the conversion of Verovio SVG output to SVG Tiny, using pages rendered from MEI files or read from SVG files, and compare it with converting and then finding the system extents in a separate QDom pass.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    parser.addOption(QCommandLineOption
+                     ({ "s", "scales" },
+                      "Render MEI files at each of the comma-separated percentage <scales>. The default is 40,70,100,150.",
+                      "scales"));
+    parser.addOption(QCommandLineOption
+                     ({ "r", "repeats" },
+                      "Convert each page <n> times. The default is 10.",
+                      "n"));
+
+    parser.addPositionalArgument
+        ("<file>", "MEI or SVG file(s) to use.", "<file> [<file> ...]");
+
+    parser.process(application);
+
+    QStringList args = parser.positionalArguments();
+    if (args.empty()) {
+        parser.showHelp(2);
+    }
+
+    vector<int> scales { 40, 70, 100, 150 };
+    if (parser.isSet("scales")) {
+        scales.clear();
+        for (auto s : parser.value("scales").split(",", Qt::SkipEmptyParts)) {
+            bool ok = false;
+            int scale = s.toInt(&ok);
+            if (!ok || scale < 1) {
+                std::cerr << "Invalid scale \"" << s.toStdString()
+                          << "\"" << std::endl;
+                return 2;
+            }
+            scales.push_back(scale);
+        }
+    }
+
+    int repeats = 10;
+    if (parser.isSet("repeats")) {
+        bool ok = false;
+        repeats = parser.value("repeats").toInt(&ok);
+        if (!ok || repeats < 1) {
+            std::cerr << "Invalid repeat count \""
+                      << parser.value("repeats").toStdString() << "\""
+                      << std::endl;
+            return 2;
+        }
+    }
+
+    string resourcePath = ScoreParser::getResourcePath();
+    if (resourcePath == "") {
+        std::cerr << "Failed to unpack Verovio resources" << std::endl;
+        return 1;
+    }
+
+    vrv::Toolkit toolkit(false);
+    if (!toolkit.SetResourcePath(resourcePath)) {
+        std::cerr << "Failed to set Verovio resource path" << std::endl;
+        return 1;
+    }
+
+    std::cout << "pages\tsize/page\textents\tboxes\ttime/page\tthroughput\tplain/page\tqdom/page\tsaved/page\tsource"
+              << std::endl;
+
+    int failed = 0;
+
+    for (auto arg : args) {
+
+        fs::path path(arg.toStdString());
+        string ext = path.extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+
+        if (ext == ".svg") {
+            PageSet set;
+            if (!readPage(path, set)) {
+                std::cerr << "Failed to read " << path.string() << std::endl;
+                ++failed;
+                continue;
+            }
+            run(set, repeats);
+            continue;
+        }
+
+        for (int scale : scales) {
+            PageSet set;
+            if (!renderPages(toolkit, path, scale, set)) {
+                std::cerr << "Failed to render " << path.string()
+                          << " at scale " << scale << std::endl;
+                ++failed;
+                continue;
+            }
+            run(set, repeats);
+        }
+    }
+
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,204 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    SV Piano Precision
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+/*
+ * Allocation benchmark for timemap generation. For synthetic scores
+ * of a range of sizes, counts the heap allocations made, and times,
+ * the GenerateTimemapFunctor pass that fills a vrv::Timemap, and
+ * separately the writing of it as JSON. Allocations are counted by
+ * replacing the global operator new for this program.
+ */
+
+#include "ScoreParser.h"
+#include "SyntheticScore.h"
+
+#include "verovio-replace/include/vrv/timemap.h"
+#include "verovio-replace/include/vrv/toolkit.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../version.h"
+
+using std::string;
+using std::vector;
+
+static std::atomic<size_t> allocationCount { 0 };
+static std::atomic<size_t> allocationBytes { 0 };
+
+void *
+operator new(size_t size)
+{
+    ++allocationCount;
+    allocationBytes += size;
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+struct Count
+{
+    size_t allocations;
+    size_t bytes;
+    double ms;
+};
+
+template <typename F>
+static Count
+measure(F f)
+{
+    size_t allocations = allocationCount;
+    size_t bytes = allocationBytes;
+    auto start = Clock::now();
+    f();
+    double ms = std::chrono::duration<double, std::milli>
+        (Clock::now() - start).count();
+    return { allocationCount - allocations, allocationBytes - bytes, ms };
+}
+
+static bool
+run(vrv::Toolkit &toolkit, int notes)
+{
+    int measures = (notes + SyntheticScore::notesPerMeasure - 1) /
+        SyntheticScore::notesPerMeasure;
+
+    if (!toolkit.LoadData(SyntheticScore::makeMei(measures))) {
+        std::cerr << "Failed to load synthetic score of " << measures
+                  << " measures" << std::endl;
+        return false;
+    }
+
+    // One untimed pass, which also calculates the MIDI timemap the
+    // functor reads from, so that it is not counted below
+    {
+        vrv::Timemap timemap;
+        if (!toolkit.GenerateTimemap(timemap)) {
+            std::cerr << "Failed to generate timemap for synthetic score of "
+                      << measures << " measures" << std::endl;
+            return false;
+        }
+    }
+
+    vrv::Timemap timemap;
+    Count generate = measure([&]() { toolkit.GenerateTimemap(timemap); });
+
+    std::ostringstream json;
+    Count write = measure([&]() {
+        timemap.ToJson(json, true, true);
+    });
+
+    size_t entries = timemap.GetEntries().size();
+    double n = double(measures) * SyntheticScore::notesPerMeasure;
+
+    std::cout << std::fixed
+              << size_t(n) << "\t"
+              << entries << "\t"
+              << generate.allocations << "\t"
+              << std::setprecision(2) << double(generate.allocations) / n << "\t"
+              << std::setprecision(1) << double(generate.bytes) / 1024.0 << "KB\t"
+              << std::setprecision(2) << generate.ms << "ms\t"
+              << write.allocations << "\t"
+              << std::setprecision(1) << double(write.bytes) / 1024.0 << "KB\t"
+              << std::setprecision(2) << write.ms << "ms"
+              << std::endl;
+
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    QCoreApplication application(argc, argv);
+
+    QCoreApplication::setOrganizationName("sonic-visualiser");
+    QCoreApplication::setOrganizationDomain("sonicvisualiser.org");
+    QCoreApplication::setApplicationName("Piano Precision Timemap Benchmark");
+    QCoreApplication::setApplicationVersion(SV_VERSION);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription
+        ("\nCount the heap allocations made in generating the timemap, for synthetic scores of a range of sizes.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    parser.addOption(QCommandLineOption
+                     ({ "n", "notes" },
+                      "Use scores of each of the comma-separated numbers of <notes>. The default is 1000,10000,50000.",
+                      "notes"));
+
+    parser.process(application);
+
+    vector<int> sizes { 1000, 10000, 50000 };
+    if (parser.isSet("notes")) {
+        sizes.clear();
+        for (auto s : parser.value("notes").split(",", Qt::SkipEmptyParts)) {
+            bool ok = false;
+            int n = s.toInt(&ok);
+            if (!ok || n < 1) {
+                std::cerr << "Invalid note count \"" << s.toStdString()
+                          << "\"" << std::endl;
+                return 2;
+            }
+            sizes.push_back(n);
+        }
+    }
+
+    string resourcePath = ScoreParser::getResourcePath();
+    if (resourcePath == "") {
+        std::cerr << "Failed to unpack Verovio resources" << std::endl;
+        return 1;
+    }
+
+    vrv::Toolkit toolkit(false);
+    if (!toolkit.SetResourcePath(resourcePath)) {
+        std::cerr << "Failed to set Verovio resource path" << std::endl;
+        return 1;
+    }
+
+    std::cout << "notes\tentries\tallocs\tallocs/note\tallocated\ttime\tjson allocs\tjson allocated\tjson time"
+              << std::endl;
+
+    int failed = 0;
+    
+    for (int notes : sizes) {
+        if (!run(toolkit, notes)) {
+            ++failed;
+        }
+    }
+
+    return failed > 0 ? 1 : 0;
+}
@@ -11,9 +11,11 @@
 #include "pugixml.hpp"
 
 #include <algorithm>
+#include <cctype>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
 #include <map>
-#include <regex>
 #include <set>
 #include <sstream>
 #include <vector>
@@ -33,6 +35,249 @@ inline static void vrvSvgTrimLetters(std::string &s)
     vrvSvgTrim(s, [](int c) { return !std::isalpha(c); });
 }
 
+/**
+ * Parse up to max numbers separated by whitespace and/or commas,
+ * starting at p, stopping at the first thing that is not a number.
+ * Return the number of numbers found, and leave p after the last.
+ */
+static int parseSvgNumbers(const char *&p, double *out, int max)
+{
+    int n = 0;
+    while (n < max) {
+        while (*p == ' ' || *p == ',' || *p == '\t' ||
+               *p == '\n' || *p == '\r') ++p;
+        char *end = nullptr;
+        double v = std::strtod(p, &end);
+        if (end == p) break;
+        out[n++] = v;
+        p = end;
+    }
+    return n;
+}
+
+/**
+ * Parse the factors from the first "scale(x, y)" in a transform
+ * attribute. Return false if there is none with two factors.
+ */
+static bool parseSvgScale(const char *transform, double &x, double &y)
+{
+    const char *p = std::strstr(transform, "scale(");
+    if (!p) return false;
+    p += 6;
+    double v[2];
+    if (parseSvgNumbers(p, v, 2) != 2) return false;
+    while (*p == ' ') ++p;
+    if (*p != ')') return false;
+    x = v[0];
+    y = v[1];
+    return true;
+}
+
+/**
+ * Parse the width and height from a viewBox attribute. Return false
+ * if it does not have four numbers.
+ */
+static bool parseSvgViewBoxSize(const char *viewBox, double &w, double &h)
+{
+    const char *p = viewBox;
+    double v[4];
+    if (parseSvgNumbers(p, v, 4) != 4) return false;
+    w = v[2];
+    h = v[3];
+    return true;
+}
+
+/**
+ * 2D affine transform, as in an SVG transform attribute, mapping
+ * (x, y) to (a x + c y + e, b x + d y + f).
+ */
+struct SvgTransform {
+    double a = 1.0, b = 0.0, c = 0.0, d = 1.0, e = 0.0, f = 0.0;
+
+    SvgTransform operator*(const SvgTransform &t) const {
+        SvgTransform r;
+        r.a = a * t.a + c * t.b;
+        r.b = b * t.a + d * t.b;
+        r.c = a * t.c + c * t.d;
+        r.d = b * t.c + d * t.d;
+        r.e = a * t.e + c * t.f + e;
+        r.f = b * t.e + d * t.f + f;
+        return r;
+    }
+
+    double mapX(double x, double y) const {
+        return a * x + c * y + e;
+    }
+
+    double mapY(double x, double y) const {
+        return b * x + d * y + f;
+    }
+};
+
+/**
+ * Axis-aligned bounds accumulated from points, empty to start with.
+ */
+struct SvgBounds {
+    double x0 = std::numeric_limits<double>::infinity();
+    double y0 = std::numeric_limits<double>::infinity();
+    double x1 = -std::numeric_limits<double>::infinity();
+    double y1 = -std::numeric_limits<double>::infinity();
+
+    bool empty() const {
+        return x1 < x0;
+    }
+
+    void add(double x, double y) {
+        x0 = std::min(x0, x); x1 = std::max(x1, x);
+        y0 = std::min(y0, y); y1 = std::max(y1, y);
+    }
+
+    void add(const SvgTransform &t, double x, double y) {
+        add(t.mapX(x, y), t.mapY(x, y));
+    }
+
+    void add(const SvgTransform &t, const SvgBounds &b) {
+        if (b.empty()) return;
+        add(t, b.x0, b.y0); add(t, b.x1, b.y0);
+        add(t, b.x0, b.y1); add(t, b.x1, b.y1);
+    }
+};
+
+/**
+ * Parse an SVG transform attribute. Unknown or malformed parts are
+ * ignored.
+ */
+static SvgTransform parseSvgTransform(const char *p)
+{
+    SvgTransform result;
+
+    while (*p) {
+
+        while (*p && !std::isalpha((unsigned char)*p)) ++p;
+        const char *name = p;
+        while (std::isalpha((unsigned char)*p)) ++p;
+        size_t len = p - name;
+        while (*p == ' ') ++p;
+        if (*p != '(') break;
+        ++p;
+
+        double v[6];
+        int n = parseSvgNumbers(p, v, 6);
+        while (*p && *p != ')') ++p;
+        if (*p == ')') ++p;
+
+        SvgTransform t;
+        if (len == 9 && !std::strncmp(name, "translate", len) && n >= 1) {
+            t.e = v[0];
+            t.f = (n > 1 ? v[1] : 0.0);
+        } else if (len == 5 && !std::strncmp(name, "scale", len) && n >= 1) {
+            t.a = v[0];
+            t.d = (n > 1 ? v[1] : v[0]);
+        } else if (len == 6 && !std::strncmp(name, "matrix", len) && n == 6) {
+            t.a = v[0]; t.b = v[1]; t.c = v[2];
+            t.d = v[3]; t.e = v[4]; t.f = v[5];
+        } else {
+            continue;
+        }
+        result = result * t;
+    }
+
+    return result;
+}
+
+/**
+ * Extend bounds by the points of SVG path data, mapped through t.
+ * The control points of curves are included, so the result may be
+ * a little larger than the true bounds; arcs are included by their
+ * end points only. Parsing stops at anything unexpected.
+ */
+static void addSvgPathBounds(const char *p, const SvgTransform &t,
+                             SvgBounds &bounds)
+{
+    double x = 0.0, y = 0.0;           // current point
+    double startX = 0.0, startY = 0.0; // of the current subpath
+    char cmd = 0;
+
+    while (true) {
+
+        while (*p == ' ' || *p == ',' || *p == '\t' ||
+               *p == '\n' || *p == '\r') ++p;
+        if (!*p) break;
+
+        if (std::isalpha((unsigned char)*p)) {
+            cmd = *p++;
+            if (cmd == 'Z' || cmd == 'z') {
+                x = startX;
+                y = startY;
+            }
+            continue;
+        }
+
+        bool relative = std::islower((unsigned char)cmd);
+        char type = char(std::toupper((unsigned char)cmd));
+        
+        int count = 0;
+        switch (type) {
+        case 'H': case 'V': count = 1; break;
+        case 'M': case 'L': case 'T': count = 2; break;
+        case 'S': case 'Q': count = 4; break;
+        case 'C': count = 6; break;
+        case 'A': count = 7; break;
+        default: return;
+        }
+
+        double v[7];
+        if (parseSvgNumbers(p, v, count) != count) return;
+
+        double baseX = relative ? x : 0.0, baseY = relative ? y : 0.0;
+        
+        if (type == 'H') {
+            x = baseX + v[0];
+        } else if (type == 'V') {
+            y = baseY + v[0];
+        } else if (type == 'A') {
+            x = baseX + v[5];
+            y = baseY + v[6];
+        } else {
+            for (int i = 0; i + 2 < count; i += 2) {
+                bounds.add(t, baseX + v[i], baseY + v[i + 1]);
+            }
+            x = baseX + v[count - 2];
+            y = baseY + v[count - 1];
+        }
+        bounds.add(t, x, y);
+
+        if (type == 'M') {
+            startX = x;
+            startY = y;
+            cmd = relative ? 'l' : 'L'; // further pairs are lines
+        }
+    }
+}
+
+/**
+ * Parse a numeric attribute, ignoring any unit suffix.
+ */
+static double svgNumber(pugi::xml_node node, const char *name)
+{
+    return std::strtod(node.attribute(name).value(), nullptr);
+}
+
+static bool hasSvgClass(pugi::xml_node node, const char *cls)
+{
+    const char *classes = node.attribute("class").value();
+    size_t len = std::strlen(cls);
+    for (const char *p = classes; *p; ) {
+        while (*p == ' ') ++p;
+        const char *word = p;
+        while (*p && *p != ' ') ++p;
+        if (size_t(p - word) == len && !std::strncmp(word, cls, len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * Verovio has an svg element as a child of the root svg. Flatten it out.
  */
@@ -54,28 +299,55 @@ static void removeInnerSvg(const pugi::xml_document &svgXml)
 }
 
 /**
- * Merge whitelisted attributes from the element with the supplied mapping.
+ * Whitelisted text attributes, as forwarded from an element to its
+ * tspan children. Held in alphabetical order of name, which is the
+ * order they are written in.
  */
-static std::map<std::string, std::string> mergeTextAttributes(
-    pugi::xml_node child,
-    std::map<std::string, std::string> parentAttr)
+struct TextAttributes {
+    static constexpr int count = 7;
+    static const char *const names[count];
+    const char *values[count] = {};
+
+    int size() const {
+        int n = 0;
+        for (int i = 0; i < count; ++i) if (values[i]) ++n;
+        return n;
+    }
+
+    const char *find(const char *name) const {
+        for (int i = 0; i < count; ++i) {
+            if (!std::strcmp(names[i], name)) return values[i];
+        }
+        return nullptr;
+    }
+};
+
+const char *const TextAttributes::names[TextAttributes::count] = {
+    "class",
+    "font-family",
+    "font-size",
+    "font-style",
+    "text-anchor",
+    "x",
+    "y"
+};
+
+/**
+ * Merge whitelisted attributes from the element with those of its
+ * parent.
+ */
+static TextAttributes mergeTextAttributes(pugi::xml_node child,
+                                          const TextAttributes &parentAttr)
 {
-    std::vector<std::string> knownAttrs{
-        "x",
-        "y",
-        "font-family",
-        "font-size",
-        "font-style",
-        "text-anchor",
-        "class"};
-    std::map<std::string, std::string> output;
-    for (const std::string &attr : knownAttrs) {
-        pugi::xml_attribute childAttr = child.attribute(attr.c_str());
+    TextAttributes output;
+    for (int i = 0; i < TextAttributes::count; ++i) {
+        pugi::xml_attribute childAttr =
+            child.attribute(TextAttributes::names[i]);
         if (!childAttr.empty()) {
-            output[attr] = childAttr.value();
-        } else if (parentAttr.find(attr) != parentAttr.end()) {
+            output.values[i] = childAttr.value();
+        } else {
             // Attribute not in child? Take forwarded from parent, if exists.
-            output[attr] = parentAttr[attr];
+            output.values[i] = parentAttr.values[i];
         }
     }
     return output;
@@ -87,15 +359,15 @@ static std::map<std::string, std::string> mergeTextAttributes(
 static int appendFlatTspan(
     pugi::xml_node flatTextNode,
     pugi::xml_node elem,
-    std::map<std::string, std::string> newAttrs)
+    const TextAttributes &newAttrs)
 {
     // Try to merge nodes.
     pugi::xml_node prevTspan = flatTextNode.last_child();
     if (std::strcmp(prevTspan.name(), "tspan") == 0) {
         int attrMatchCount = 0;
         for (pugi::xml_attribute attr : prevTspan.attributes()) {
-            auto itr = newAttrs.find(attr.name());
-            if (itr != newAttrs.end() && itr->second == attr.value()) {
+            const char *value = newAttrs.find(attr.name());
+            if (value && !std::strcmp(value, attr.value())) {
                 attrMatchCount += 1;
             } else {
                 attrMatchCount = -1;
@@ -117,8 +389,11 @@ static int appendFlatTspan(
     // Append new node.
     pugi::xml_node textNode = flatTextNode.append_child("tspan");
     textNode.append_child(pugi::node_pcdata).set_value(elem.text().get());
-    for (const auto &attr : newAttrs) {
-        textNode.append_attribute(attr.first.c_str()) = attr.second.c_str();
+    for (int i = 0; i < TextAttributes::count; ++i) {
+        if (newAttrs.values[i]) {
+            textNode.append_attribute(TextAttributes::names[i]) =
+                newAttrs.values[i];
+        }
     }
     return 1;
 }
@@ -137,7 +412,7 @@ static int appendFlatTspan(
 static int recurseFlattenTextNode(
     pugi::xml_node flatTextNode,
     pugi::xml_node elem,
-    const std::map<std::string, std::string> &parentAttr)
+    const TextAttributes &parentAttr)
 {
     int numAdded = 0;
     bool hasChild = false;
@@ -155,25 +430,18 @@ static int recurseFlattenTextNode(
 }
 
 /**
- * Recursively reduce nested tspan elements to a single layer.
+ * Reduce the nested tspan elements within a text element to a single
+ * layer.
  */
-static void removeNestedTspan(const pugi::xml_document &svgXml)
+static void removeNestedTspan(pugi::xml_node node)
 {
-    for (pugi::xpath_node selectedNode :
-         svgXml.select_nodes("//*[local-name()=\"text\"]")) {
-        pugi::xml_node node = selectedNode.node();
-
-        pugi::xml_node flatTextNode =
-            node.parent().insert_copy_after(node, node);
-        flatTextNode.remove_children();
-        if (recurseFlattenTextNode(
-                flatTextNode,
-                node,
-                std::map<std::string, std::string>()) > 0) {
-            node.parent().remove_child(node);
-        } else {
-            node.parent().remove_child(flatTextNode);
-        }
+    pugi::xml_node flatTextNode =
+        node.parent().insert_copy_after(node, node);
+    flatTextNode.remove_children();
+    if (recurseFlattenTextNode(flatTextNode, node, TextAttributes()) > 0) {
+        node.parent().remove_child(node);
+    } else {
+        node.parent().remove_child(flatTextNode);
     }
 }
 
@@ -188,23 +456,147 @@ static void styleVerseText(const pugi::xml_document &svgXml)
 }
 
 /**
- * Convert svg symbol defs to path defs, and other manipulations
- * needed to conform to SVG 1.2 Tiny.
+ * A single walk through the document, which retargets symbol uses as
+ * it goes, collects the symbol and text elements to be converted
+ * once the walk is done, and finds the system extents and note
+ * boxes.
+ *
+ * A system's extent is taken from the vertical path that joins its
+ * staves, or if there is only one staff, from the first and fifth
+ * lines of that staff. Extents are mapped through the transforms of
+ * the system's (or staff's) parents - but not its own - to give
+ * document coordinates, as QSvgRenderer's transformForElement would.
+ * The inner svg element that removeInnerSvg later flattens out has
+ * no transform of its own, so the coordinates are the same before
+ * and after conversion.
+ *
+ * A note's box is the union of the bounds of the paths, shapes and
+ * symbol uses within it, mapped to document coordinates, which is
+ * what QSvgRenderer's boundsOnElement and transformForElement would
+ * give for it, except that stroke widths are not included. Symbols
+ * are defined before they are used, so their bounds are known by
+ * the time a use is reached.
  */
-std::string
-VrvTrim::transformSvgToTiny(const std::string &svg)
+class VrvSvgWalker
 {
-    pugi::xml_document svgXml;
-    pugi::xml_parse_result parseResult = svgXml.load_string(svg.c_str());
-    if (parseResult.status != pugi::status_ok) {
-        return parseResult.description();
+public:
+    VrvSvgWalker(VrvTrim::Geometry &geometry) :
+        m_geometry(geometry), m_haveExtent(false) { }
+
+    void walk(pugi::xml_node root) {
+        parseSvgViewBoxSize(root.child("svg").attribute("viewBox").value(),
+                            m_geometry.width, m_geometry.height);
+        descend(root, SvgTransform(), {}, {}, nullptr);
     }
 
-    // Find symbol usages.
+    // Symbol id -> the set of "width-height" sizes it is used at
     std::map<std::string, std::set<std::string>> useConfigs;
-    for (pugi::xpath_node selectedNode :
-         svgXml.select_nodes("//*[local-name()=\"use\"]")) {
-        pugi::xml_node node = selectedNode.node();
+    std::vector<pugi::xml_node> symbols;
+    std::vector<pugi::xml_node> texts;
+
+private:
+    struct Scope {
+        const char *id = nullptr;
+        SvgTransform transform; // of the parents
+    };
+
+    struct SymbolGeometry {
+        double scaleX;
+        double scaleY;
+        double viewBoxWidth;
+        double viewBoxHeight;
+        SvgBounds bounds; // of the path, before scaling
+    };
+    std::map<std::string, SymbolGeometry> m_symbolGeometry;
+    
+    VrvTrim::Geometry &m_geometry;
+    bool m_haveExtent;
+    VrvTrim::Extent m_extent;
+    std::vector<double> m_staffLines;
+
+    void measureSymbol(pugi::xml_node node) {
+
+        pugi::xml_node path = node.child("path");
+        SymbolGeometry g;
+        if (!parseSvgScale(path.attribute("transform").value(),
+                           g.scaleX, g.scaleY) ||
+            !parseSvgViewBoxSize(node.attribute("viewBox").value(),
+                                 g.viewBoxWidth, g.viewBoxHeight) ||
+            g.viewBoxWidth == 0.0 || g.viewBoxHeight == 0.0) {
+            return;
+        }
+        addSvgPathBounds(path.attribute("d").value(), SvgTransform(),
+                         g.bounds);
+        m_symbolGeometry[node.attribute("id").value()] = g;
+    }
+
+    void addUseBounds(pugi::xml_node node, const SvgTransform &transform,
+                      SvgBounds &bounds) {
+
+        // This must be called before retargetUse, which removes the
+        // size of the use
+        
+        const char *href = node.attribute("xlink:href").value();
+        if (*href != '#') return;
+        auto itr = m_symbolGeometry.find(href + 1);
+        if (itr == m_symbolGeometry.end()) return;
+        const SymbolGeometry &g = itr->second;
+
+        // The symbol's path is scaled as convertSymbols will scale
+        // it, then placed at the use's position
+        SvgTransform placement;
+        placement.a = g.scaleX * svgNumber(node, "width") / g.viewBoxWidth;
+        placement.d = g.scaleY * svgNumber(node, "height") / g.viewBoxHeight;
+        placement.e = svgNumber(node, "x");
+        placement.f = svgNumber(node, "y");
+
+        bounds.add(transform * placement, g.bounds);
+    }
+
+    static void addShapeBounds(pugi::xml_node node, const char *tag,
+                               const SvgTransform &t, SvgBounds &bounds) {
+
+        if (!std::strcmp(tag, "path")) {
+            addSvgPathBounds(node.attribute("d").value(), t, bounds);
+            
+        } else if (!std::strcmp(tag, "rect")) {
+            double x = svgNumber(node, "x"), y = svgNumber(node, "y");
+            bounds.add(t, x, y);
+            bounds.add(t, x + svgNumber(node, "width"),
+                       y + svgNumber(node, "height"));
+            
+        } else if (!std::strcmp(tag, "circle") ||
+                   !std::strcmp(tag, "ellipse")) {
+            double cx = svgNumber(node, "cx"), cy = svgNumber(node, "cy");
+            double rx = svgNumber(node, tag[0] == 'c' ? "r" : "rx");
+            double ry = svgNumber(node, tag[0] == 'c' ? "r" : "ry");
+            bounds.add(t, cx - rx, cy - ry);
+            bounds.add(t, cx + rx, cy + ry);
+            
+        } else if (!std::strcmp(tag, "line")) {
+            bounds.add(t, svgNumber(node, "x1"), svgNumber(node, "y1"));
+            bounds.add(t, svgNumber(node, "x2"), svgNumber(node, "y2"));
+            
+        } else if (!std::strcmp(tag, "polygon") ||
+                   !std::strcmp(tag, "polyline")) {
+            const char *p = node.attribute("points").value();
+            double v[2];
+            while (parseSvgNumbers(p, v, 2) == 2) {
+                bounds.add(t, v[0], v[1]);
+            }
+        }
+    }
+
+    static SvgTransform ownTransform(pugi::xml_node node,
+                                     const SvgTransform &parentTransform) {
+        pugi::xml_attribute attr = node.attribute("transform");
+        if (!attr) {
+            return parentTransform;
+        }
+        return parentTransform * parseSvgTransform(attr.value());
+    }
+
+    void retargetUse(pugi::xml_node node) {
 
         pugi::xml_attribute hrefAttr = node.attribute("xlink:href");
         std::string oldHref(hrefAttr.value());
@@ -220,46 +612,223 @@ VrvTrim::transformSvgToTiny(const std::string &svg)
         node.remove_attribute("width");
         node.remove_attribute("height");
 
-        std::string symbolId(oldHref.substr(1));
-        useConfigs[symbolId].insert(elemConfig);
+        if (!oldHref.empty()) {
+            useConfigs[oldHref.substr(1)].insert(elemConfig);
+        }
+    }
+
+    static VrvTrim::Extent mapExtent(const SvgTransform &t,
+                                     double y0, double y1) {
+        // Map the rect (0, y0) -> (1, y1) and take its bounds
+        double ys[4] = { t.mapY(0, y0), t.mapY(1, y0),
+                         t.mapY(0, y1), t.mapY(1, y1) };
+        double lo = *std::min_element(ys, ys + 4);
+        double hi = *std::max_element(ys, ys + 4);
+        return { lo, hi - lo };
+    }
+
+    static bool isNull(const VrvTrim::Extent &e) {
+        return e.y == 0.0 && e.height == 0.0;
+    }
+
+    void extractExtent(pugi::xml_node path,
+                       const Scope &system, const Scope &staff) {
+
+        // We're looking for a path of the form Mx0 y0 Lx1 y1
+
+        const char *p = path.attribute("d").value();
+        while (*p == ' ') ++p;
+        if (*p != 'M' && *p != 'm') return;
+        ++p;
+        double v[2];
+        if (parseSvgNumbers(p, v, 2) != 2) return;
+        double x0 = v[0], y0 = v[1];
+        while (*p == ' ') ++p;
+        if (*p != 'L' && *p != 'l') return;
+        ++p;
+        if (parseSvgNumbers(p, v, 2) != 2) return;
+        double x1 = v[0], y1 = v[1];
+        while (*p == ' ') ++p;
+        if (*p) return;
+
+        if (system.id && y1 > y0 && x1 == x0) {
+            m_extent = mapExtent(system.transform, y0, y1);
+            m_haveExtent = !isNull(m_extent);
+            return;
+        }
+
+        if (staff.id && x1 > x0 && y1 == y0 && m_staffLines.size() < 5) {
+            m_staffLines.push_back(y0);
+            if (m_staffLines.size() == 5) {
+                m_extent = mapExtent(staff.transform,
+                                     m_staffLines[0], m_staffLines[4]);
+                m_haveExtent = !isNull(m_extent);
+            }
+        }
+    }
+
+    void descend(pugi::xml_node node, const SvgTransform &parentTransform,
+                 Scope system, Scope staff, SvgBounds *note) {
+
+        if (node.type() != pugi::node_element) {
+            return;
+        }
+
+        const char *tag = node.name();
+
+        switch (tag[0]) {
+
+        case 'p':
+            if (!std::strcmp(tag, "path")) {
+                if ((system.id || staff.id) && !m_haveExtent) {
+                    extractExtent(node, system, staff);
+                }
+                if (note) {
+                    addShapeBounds(node, tag,
+                                   ownTransform(node, parentTransform),
+                                   *note);
+                }
+                return;
+            }
+            break;
+
+        case 'u':
+            if (!std::strcmp(tag, "use")) {
+                if (note) {
+                    addUseBounds(node, ownTransform(node, parentTransform),
+                                 *note);
+                }
+                retargetUse(node);
+                return;
+            }
+            break;
+
+        case 's':
+            if (!std::strcmp(tag, "symbol")) {
+                measureSymbol(node);
+                symbols.push_back(node);
+                return;
+            }
+            break;
+
+        case 't':
+            if (!std::strcmp(tag, "text")) {
+                texts.push_back(node);
+                return;
+            }
+            break;
+
+        case 'g':
+            if (tag[1] == '\0') {
+                // The remaining elements we're interested in (system,
+                // staff, note) are all defined using group tags
+
+                if (!system.id && hasSvgClass(node, "system")) {
+                    system.id = node.attribute("id").value();
+                    system.transform = parentTransform;
+                    m_haveExtent = false;
+                }
+
+                if (!staff.id && hasSvgClass(node, "staff")) {
+                    staff.id = node.attribute("id").value();
+                    staff.transform = parentTransform;
+                    m_staffLines.clear();
+                    if (!system.id) { // a staff outside a system
+                        m_haveExtent = false;
+                    }
+                }
+
+                if (hasSvgClass(node, "note")) {
+                    const char *noteId = node.attribute("id").value();
+                    if (*noteId) {
+                        if (m_haveExtent) {
+                            m_geometry.noteSystemExtents[noteId] = m_extent;
+                        }
+                        descendNote(node, parentTransform, system, staff,
+                                    noteId, note);
+                        return;
+                    }
+                }
+            }
+            break;
+        }
+
+        SvgTransform transform = ownTransform(node, parentTransform);
+
+        if (note) {
+            addShapeBounds(node, tag, transform, *note);
+        }
+
+        for (pugi::xml_node child : node.children()) {
+            descend(child, transform, system, staff, note);
+        }
+    }
+
+    void descendNote(pugi::xml_node node, const SvgTransform &parentTransform,
+                     Scope system, Scope staff, const char *noteId,
+                     SvgBounds *enclosingNote) {
+        
+        SvgTransform transform = ownTransform(node, parentTransform);
+        SvgBounds bounds;
+        
+        for (pugi::xml_node child : node.children()) {
+            descend(child, transform, system, staff, &bounds);
+        }
+
+        if (bounds.empty()) {
+            return;
+        }
+        
+        m_geometry.noteBoxes.push_back({ noteId, bounds.x0, bounds.y0,
+                                         bounds.x1 - bounds.x0,
+                                         bounds.y1 - bounds.y0 });
+
+        // A note within another (as a grace note may be) is part of
+        // the other's bounds too
+        if (enclosingNote) {
+            enclosingNote->add(SvgTransform(), bounds);
+        }
     }
+};
 
-    // Create path defs.
-    pugi::xml_node defs = svgXml.first_child().child("defs");
-    std::regex transformRe(R"(scale\((\d+),\s*(-?\d+)\))");
-    std::regex viewBoxRe(R"(\d+\s+\d+\s+(\d+)\s+(\d+))");
-    for (pugi::xpath_node selectedNode :
-         svgXml.select_nodes("//*[local-name()=\"symbol\"]")) {
-        pugi::xml_node node = selectedNode.node();
+/**
+ * Replace each symbol def with a path def for every size it is used
+ * at, and remove the symbol.
+ */
+static void convertSymbols(pugi::xml_node defs, const VrvSvgWalker &walker)
+{
+    for (pugi::xml_node node : walker.symbols) {
 
         std::string symbolId(node.attribute("id").value());
-        std::string viewBox(node.attribute("viewBox").value());
         pugi::xml_node pathElem = node.child("path");
-        std::string transform(pathElem.attribute("transform").value());
         std::string coords(pathElem.attribute("d").value());
 
+        double transformX = 0.0, transformY = 0.0;
+        double viewBoxWidth = 0.0, viewBoxHeight = 0.0;
+        bool ok =
+            parseSvgScale(pathElem.attribute("transform").value(),
+                          transformX, transformY) &&
+            parseSvgViewBoxSize(node.attribute("viewBox").value(),
+                                viewBoxWidth, viewBoxHeight);
+
         // Remove symbol def.
         node.parent().remove_child(node);
 
-        // Parse attributes.
-        std::smatch parsedTransform;
-        if (!std::regex_search(transform, parsedTransform, transformRe)) {
+        if (!ok) {
             continue;
         }
-        std::smatch parsedViewBox;
-        if (!std::regex_search(viewBox, parsedViewBox, viewBoxRe)) {
+
+        auto itr = walker.useConfigs.find(symbolId);
+        if (itr == walker.useConfigs.end()) {
             continue;
         }
-        double transformX = std::stod(parsedTransform[1]);
-        double transformY = std::stod(parsedTransform[2]);
-        double viewBoxWidth = std::stod(parsedViewBox[1]);
-        double viewBoxHeight = std::stod(parsedViewBox[2]);
 
         // Create def nodes for each required transform of the symbol.
-        for (const std::string &elemConfig : useConfigs[symbolId]) {
+        for (const std::string &elemConfig : itr->second) {
             size_t dashIdx = elemConfig.find('-');
-            double width = std::stod(elemConfig.substr(0, dashIdx));
-            double height = std::stod(elemConfig.substr(dashIdx + 1));
+            double width = std::strtod(elemConfig.c_str(), nullptr);
+            double height = std::strtod(elemConfig.c_str() + dashIdx + 1,
+                                        nullptr);
 
             pugi::xml_node newPathElem = defs.append_child("path");
             newPathElem.append_attribute("id") =
@@ -275,8 +844,53 @@ VrvTrim::transformSvgToTiny(const std::string &svg)
             newPathElem.append_attribute("d") = coords.c_str();
         }
     }
+}
+
+std::string
+VrvTrim::transformSvgToTiny(const std::string &svg)
+{
+    Geometry geometry;
+    return transformSvgToTiny(svg, geometry);
+}
+
+std::string
+VrvTrim::transformSvgToTiny(const std::string &svg,
+                            ExtentMap &noteSystemExtents)
+{
+    Geometry geometry;
+    std::string result = transformSvgToTiny(svg, geometry);
+    noteSystemExtents.insert(geometry.noteSystemExtents.begin(),
+                             geometry.noteSystemExtents.end());
+    return result;
+}
+
+/**
+ * Convert svg symbol defs to path defs, and other manipulations
+ * needed to conform to SVG 1.2 Tiny.
+ */
+std::string
+VrvTrim::transformSvgToTiny(const std::string &svg, Geometry &geometry)
+{
+    geometry = Geometry();
+    
+    pugi::xml_document svgXml;
+    pugi::xml_parse_result parseResult = svgXml.load_string(svg.c_str());
+    if (parseResult.status != pugi::status_ok) {
+        return parseResult.description();
+    }
+
+    VrvSvgWalker walker(geometry);
+    walker.walk(svgXml.document_element());
+
+    std::sort(geometry.noteBoxes.begin(), geometry.noteBoxes.end(),
+              [](const NoteBox &a, const NoteBox &b) { return a.id < b.id; });
+    
+    convertSymbols(svgXml.first_child().child("defs"), walker);
+
+    for (pugi::xml_node text : walker.texts) {
+        removeNestedTspan(text);
+    }
 
-    removeNestedTspan(svgXml);
     removeInnerSvg(svgXml);
     styleVerseText(svgXml);
 
@@ -284,3 +898,16 @@ VrvTrim::transformSvgToTiny(const std::string &svg)
     svgXml.save(result);
     return result.str();
 }
+
+const VrvTrim::NoteBox *
+VrvTrim::findNoteBox(const NoteBoxTable &boxes, const std::string &id)
+{
+    auto itr = std::lower_bound(boxes.begin(), boxes.end(), id,
+                                [](const NoteBox &box, const std::string &id) {
+                                    return box.id < id;
+                                });
+    if (itr == boxes.end() || itr->id != id) {
+        return nullptr;
+    }
+    return &*itr;
+}
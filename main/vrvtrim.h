@@ -8,16 +8,84 @@
 #ifndef SV_VRV_TRIM_H
 #define SV_VRV_TRIM_H
 
+#include <map>
 #include <string>
+#include <vector>
 
 class VrvTrim
 {
 public:
+    /**
+     * Vertical extent of a system, in the coordinates of the
+     * converted document.
+     */
+    struct Extent {
+        double y;
+        double height;
+    };
+
+    /**
+     * Map from note element id to the extent of the system
+     * containing the note.
+     */
+    typedef std::map<std::string, Extent> ExtentMap;
+
+    /**
+     * Bounding box of a note element, in the coordinates of the
+     * converted document.
+     */
+    struct NoteBox {
+        std::string id;
+        double x;
+        double y;
+        double width;
+        double height;
+    };
+
+    /**
+     * Note boxes, sorted by id.
+     */
+    typedef std::vector<NoteBox> NoteBoxTable;
+
+    /**
+     * What we can find out about the layout of a page while it is
+     * converted.
+     */
+    struct Geometry {
+        double width = 0.0;  // of the view box
+        double height = 0.0;
+        ExtentMap noteSystemExtents;
+        NoteBoxTable noteBoxes;
+    };
+    
     /**
      * Convert svg symbol defs to path defs, and other manipulations
      * needed to conform to SVG 1.2 Tiny.
      */
     static std::string transformSvgToTiny(const std::string &svg);
+
+    /**
+     * Convert as above, and also find the system extent for each
+     * note while the document is parsed, adding them to
+     * noteSystemExtents.
+     */
+    static std::string transformSvgToTiny(const std::string &svg,
+                                          ExtentMap &noteSystemExtents);
+
+    /**
+     * Convert as above, and also find the page size, the system
+     * extent for each note and the bounding box of each note while
+     * the document is parsed, replacing the contents of geometry.
+     */
+    static std::string transformSvgToTiny(const std::string &svg,
+                                          Geometry &geometry);
+
+    /**
+     * Return the box for the note with the given id, or nullptr if
+     * there is none.
+     */
+    static const NoteBox *findNoteBox(const NoteBoxTable &boxes,
+                                      const std::string &id);
 };
 
 #endif
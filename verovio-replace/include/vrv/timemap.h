@@ -9,8 +9,11 @@
 #define __VRV_TIMEMAP_H__
 
 #include <cassert>
-#include <map>
+#include <memory>
+#include <ostream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 //----------------------------------------------------------------------------
@@ -19,22 +22,45 @@ namespace vrv {
 
 class Object;
 
+// Yucong Jiang
+
+/**
+ * Handle to a string interned in a Timemap. Handles are only meaningful for the timemap that issued them.
+ */
+using TimemapId = int;
+
+/** The handle of no string, as held by entries that have no measure or meter */
+constexpr TimemapId TIMEMAP_ID_NONE = -1;
+
+/**
+ * A list of handles, stored as a chain of nodes in the timemap's node pool.
+ */
+struct TimemapIdList {
+    int head = -1;
+    int tail = -1;
+
+    bool empty() const { return head < 0; }
+};
+
+// end of Yucong Jiang
+
 //----------------------------------------------------------------------------
 // TimemapEntry
 //----------------------------------------------------------------------------
 
 /**
- * Helper struct to store timemap entries
+ * Helper struct to store timemap entries. Element IDs are held as handles into the timemap's string table.
  */
 struct TimemapEntry {
+    double tstamp; // added by Yucong Jiang
     double tempo = -1000.0;
     double qstamp;
-    std::vector<std::string> notesOn;
-    std::vector<std::string> notesOff;
-    std::vector<std::string> restsOn;
-    std::vector<std::string> restsOff;
-    std::string measureOn;
-    std::string meterSig; // added by Yucong Jiang
+    TimemapIdList notesOn;
+    TimemapIdList notesOff;
+    TimemapIdList restsOn;
+    TimemapIdList restsOff;
+    TimemapId measureOn = TIMEMAP_ID_NONE;
+    TimemapId meterSig = TIMEMAP_ID_NONE; // added by Yucong Jiang
 };
 
 //----------------------------------------------------------------------------
@@ -43,6 +69,9 @@ struct TimemapEntry {
 
 /**
  * This class holds a timemap for exporting onset / offset values.
+ *
+ * Entries are kept in a vector sorted by time, and the element IDs they refer to are interned once each in an
+ * arena, so that generating a timemap for a large score does not make a heap allocation per ID reference.
  */
 class Timemap {
 public:
@@ -52,6 +81,8 @@ public:
     ///@{
     Timemap();
     virtual ~Timemap();
+    Timemap(const Timemap &) = delete;
+    Timemap &operator=(const Timemap &) = delete;
     ///@}
 
     /** Resets the timemap */
@@ -59,21 +90,82 @@ public:
 
     /**
      * Return (and possibly add) an entry for the given time.
+     * The reference remains valid only until the next call that adds an entry.
+     */
+    TimemapEntry &GetEntry(double time);
+
+    // Yucong Jiang
+    /**
+     * Return all entries, ordered by time in milliseconds.
+     */
+    const std::vector<TimemapEntry> &GetEntries() const { return m_entries; }
+
+    /**
+     * Return the handle for the given string, interning it if it is not there already.
+     */
+    TimemapId Intern(std::string_view str);
+
+    /**
+     * Return the string for the given handle, or an empty string for TIMEMAP_ID_NONE.
+     */
+    std::string_view GetString(TimemapId id) const
+    {
+        if (id == TIMEMAP_ID_NONE) return std::string_view();
+        return m_strings.at(id);
+    }
+
+    /**
+     * Intern the given string and append its handle to the list.
      */
-    TimemapEntry &GetEntry(double time) { return m_map[time]; }
+    void Append(TimemapIdList &list, std::string_view str);
+
+    /**
+     * Call f with the string for each handle in the list, in order.
+     */
+    template <typename F> void ForEach(const TimemapIdList &list, F f) const
+    {
+        for (int n = list.head; n >= 0; n = m_nodes[n].next) {
+            f(m_strings[m_nodes[n].id]);
+        }
+    }
+    // end of Yucong Jiang
 
     /**
      * Write the current timemap to a JSON string
      */
     void ToJson(std::string &output, bool includetRests, bool includetMeasures);
 
+    // Yucong Jiang
+    /**
+     * Write the current timemap as JSON directly to a stream, with the same content as the string version
+     */
+    void ToJson(std::ostream &output, bool includeRests, bool includeMeasures) const;
+    // end of Yucong Jiang
+
 private:
-    //
+    void WriteJsonIdList(std::ostream &output, const char *key, const TimemapIdList &list) const; // Yucong Jiang
 public:
     //
 private:
-    /** The map with time values as keys */
-    std::map<double, TimemapEntry> m_map;
+    /** The entries, sorted by time value */
+    std::vector<TimemapEntry> m_entries;
+
+    // Yucong Jiang
+    struct IdNode {
+        TimemapId id;
+        int next;
+    };
+    /** The pool of list nodes shared by all entries */
+    std::vector<IdNode> m_nodes;
+
+    /** Fixed-size blocks holding the interned characters; blocks are never moved or resized */
+    std::vector<std::unique_ptr<char[]>> m_arena;
+    size_t m_arenaUsed;
+
+    /** The interned strings by handle, and the handles by string, both viewing the arena */
+    std::vector<std::string_view> m_strings;
+    std::unordered_map<std::string_view, TimemapId> m_ids;
+    // end of Yucong Jiang
 
 }; // class Timemap
 
@@ -8,7 +8,9 @@
 #ifndef __VRV_TOOLKIT_H__
 #define __VRV_TOOLKIT_H__
 
+#include <cstdint>
 #include <string>
+#include <unordered_map>
 
 //----------------------------------------------------------------------------
 
@@ -23,6 +25,7 @@ namespace vrv {
 
 class EditorToolkit;
 class RuntimeClock;
+class Timemap; // Yucong Jiang
 
 // Yucong Jiang
 
@@ -99,19 +102,105 @@ struct Fraction // Simplest form using GCD.
 
 std::ostream& operator<<(std::ostream &strm, Fraction &f);
 
+/**
+ * Resolution of score time in ticks per quarter note. This is 2^5 * 3^2 * 5 * 7 * 11 * 13, so that any note
+ * value down to a 128th, including within nested tuplets of 3, 5, 7, 9, 11 or 13, is a whole number of ticks.
+ */
+constexpr int64_t SCORE_TICKS_PER_QUARTER = 1441440;
+constexpr int64_t SCORE_TICKS_PER_WHOLE = 4 * SCORE_TICKS_PER_QUARTER;
+
+/**
+ * A 64-bit rational number. Unlike Fraction, it is not reduced on every operation: sums and differences over a
+ * common denominator are taken as they are, and a result is reduced only when its denominator grows large, or
+ * when it is compared or reduced() is called explicitly.
+ */
+struct Rational
+{
+    int64_t numerator;
+    int64_t denominator;
+
+    Rational() : numerator{0}, denominator{1} { }
+    Rational(int64_t n, int64_t d = 1) : numerator{n}, denominator{d} { }
+
+    static int64_t gcd(int64_t p, int64_t q) {
+        if (p < 0) p = -p;
+        if (q < 0) q = -q;
+        while (q != 0) {
+            int64_t r = p % q;
+            p = q;
+            q = r;
+        }
+        return p;
+    }
+
+    static Rational fromString(const std::string &s) { // e.g. "3/4"
+        std::string n, d;
+        std::istringstream iss(s);
+        getline(iss, n, '/');
+        getline(iss, d, '/');
+        return Rational(stoll(n), stoll(d));
+    }
+
+    static Rational fromTicks(int64_t ticks) { // in whole notes
+        return Rational(ticks, SCORE_TICKS_PER_WHOLE);
+    }
+
+    /** Return the value in ticks, taking the value to be in whole notes. Exact unless the
+     *  denominator does not divide SCORE_TICKS_PER_WHOLE, in which case it rounds toward zero. */
+    int64_t toTicks() const {
+        Rational r = reduced();
+        return r.numerator * (SCORE_TICKS_PER_WHOLE / gcd(r.denominator, SCORE_TICKS_PER_WHOLE)) /
+            (r.denominator / gcd(r.denominator, SCORE_TICKS_PER_WHOLE));
+    }
+
+    /** Return the simplest form, with the sign (if any) on the numerator. */
+    Rational reduced() const {
+        int64_t div = gcd(numerator, denominator);
+        if (div == 0) return Rational(0, 1);
+        if (denominator < 0) div = -div;
+        return Rational(numerator / div, denominator / div);
+    }
+
+    bool operator==(const Rational &other) const {
+        Rational a = reduced(), b = other.reduced();
+        return a.numerator == b.numerator && a.denominator == b.denominator;
+    }
+
+    bool operator<(const Rational &other) const {
+        Rational a = reduced(), b = other.reduced();
+        return a.numerator * b.denominator < b.numerator * a.denominator;
+    }
+
+    Rational operator+(const Rational &other) const {
+        if (denominator == other.denominator) return Rational(numerator + other.numerator, denominator);
+        return Rational(numerator * other.denominator + other.numerator * denominator,
+            denominator * other.denominator).normalisedIfLarge();
+    }
+
+    Rational operator-(const Rational &other) const {
+        return *this + Rational(-other.numerator, other.denominator);
+    }
+
+private:
+    Rational normalisedIfLarge() const {
+        if (denominator > INT32_MAX || denominator < -INT32_MAX) return reduced();
+        return *this;
+    }
+};
+
 struct SoloNote
 {
     int measureIndex;
-    Fraction beat;
-    Fraction cumulative;
-    float duration; // quarter note = 0.25
+    int64_t beat; // ticks from the start of the measure
+    int64_t cumulative; // ticks from the start of the score
+    int64_t duration; // ticks
     int pitch; // midi pitch
     std::string noteId;
     bool on;
     
-    SoloNote() : measureIndex{-1}, beat{Fraction()}, cumulative{Fraction()}, duration{-1}, pitch{0}, noteId{""}, on{1} { }
+    SoloNote() : measureIndex{-1}, beat{0}, cumulative{0}, duration{-1}, pitch{0}, noteId{""}, on{1} { }
     
-    SoloNote(int m, Fraction b, Fraction c, float d, int p, std::string n, bool o) {
+    SoloNote(int m, int64_t b, int64_t c, int64_t d, int p, std::string n, bool o) {
         measureIndex = m;
         beat = b;
         cumulative = c;
@@ -122,6 +211,64 @@ struct SoloNote
     }
 };
 
+/**
+ * The notes of a document as parallel arrays, one element per note in each, in document order.
+ * Score times are in ticks (see SCORE_TICKS_PER_QUARTER).
+ *
+ * measureId and measureIndexOf list every measure of the document in document order, including
+ * any whose notes were left out of the table.
+ */
+struct NoteTable
+{
+    std::vector<std::string> measureId;
+    std::vector<int> measureIndexOf; // the measure index used in measureIndex below
+
+    std::vector<std::string> noteId;
+    std::vector<int> measureIndex;
+    std::vector<int64_t> onset; // score time from the start of the measure
+    std::vector<int64_t> duration;
+    std::vector<int64_t> tiedDuration; // time added by notes tied onto this one; 0 if it is not a tie leader
+    std::vector<int> pitch; // midi pitch
+    std::vector<bool> tieLeader; // false if the note continues a tie from an earlier note
+
+    size_t size() const { return noteId.size(); }
+
+    void clear()
+    {
+        measureId.clear();
+        measureIndexOf.clear();
+        noteId.clear();
+        measureIndex.clear();
+        onset.clear();
+        duration.clear();
+        tiedDuration.clear();
+        pitch.clear();
+        tieLeader.clear();
+    }
+};
+
+/**
+ * A summary of the loaded document, gathered in one traversal by Toolkit::GetScoreMetadata. Score times are in
+ * ticks (see SCORE_TICKS_PER_QUARTER).
+ */
+struct ScoreMetadata
+{
+    struct TempoChange
+    {
+        int measureIndex; // the measure from which the tempo applies
+        double bpm;
+    };
+
+    bool hasTimes = false; // whether pickupLength and tempoChanges have been filled in
+    bool hasPickup = false; // the first measure has metcon="false"
+    int64_t pickupLength = 0; // the latest end of any note, cue notes included, in the first measure, if it is a pickup
+    std::vector<Rational> meters; // the meter of each measure in document order; 0/1 if it has none
+    int measureCount = 0;
+    int noteCount = 0;
+    int pageCount = 0;
+    std::vector<TempoChange> tempoChanges; // the tempo of the first measure, then each change after it
+};
+
 // end of Yucong Jiang
 
 
@@ -533,6 +680,31 @@ public:
      */
     bool RenderToTimemapFile(const std::string &filename, const std::string &jsonOptions = "");
 
+    // Yucong Jiang
+    /**
+     * Render a document to timemap, save it to the file and also return it.
+     *
+     * The timemap is generated once and written to the file directly, so that a caller needing both the file and
+     * the timemap content does not have to render it twice or parse the JSON back.
+     *
+     * @remark nojs
+     *
+     * @param filename The output filename
+     * @param jsonOptions A stringified JSON objects with the timemap options
+     * @param timemap The timemap to fill; the options affect only what is written to the file
+     * @return True if the timemap was generated and the file successfully written
+     */
+    bool RenderToTimemapFile(const std::string &filename, const std::string &jsonOptions, Timemap &timemap);
+
+    /**
+     * Fill a timemap as RenderToTimemapFile does, without writing it anywhere.
+     *
+     * @param timemap The timemap to fill; any previous content is discarded
+     * @return False if the MIDI timemap could not be calculated
+     */
+    bool GenerateTimemap(Timemap &timemap);
+    // end of Yucong Jiang
+
     /**
      * Render a document's expansionMap and save it to a file.
      *
@@ -717,6 +889,9 @@ public:
     
     // Yucong Jiang
 
+    /**
+     * Return true if the first measure is a pickup (anacrusis). Equivalent to GetScoreMetadata().hasPickup.
+     */
     bool HasPickupMeasure();
     
     Fraction GetClosestFraction(float num);
@@ -738,6 +913,36 @@ public:
      * @return the ID (\@xml:id) of the ending note of a tie (emtpy string if not found)
      */
     std::string GetTiedPartnerForNote(const std::string &xmlId);
+
+    /**
+     * Fill a table with the times, pitch and measure index of every note in the document, in one traversal.
+     *
+     * The notes are those that RenderToTimemap would list as "on": grace notes are skipped, as are cue notes
+     * when midiNoCue is set, and notes reached through \@sameas are reported as the note they link to.
+     *
+     * @param table the table to fill; any previous content is discarded
+     * @param measures if given, only notes in the measures marked true are included, where the measures
+     * are numbered from 0 in document order
+     * @return false if the MIDI timemap could not be calculated, in which case the table is left empty
+     */
+    bool GetNoteTable(NoteTable &table, const std::vector<bool> *measures = NULL);
+
+    /**
+     * Return the IDs of the measures on the given page (1-based) of the current layout, in order, or
+     * an empty list if there is no such page.
+     */
+    std::vector<std::string> GetMeasureIDsOnPage(int pageNo);
+
+    /**
+     * Return a summary of the loaded document: pickup, meters, counts of measures, notes and pages, and tempo
+     * changes. It is gathered in one traversal on first use and kept until the document is reloaded, edited or
+     * laid out again, so it is cheap to call repeatedly.
+     *
+     * The times in it (pickupLength and tempoChanges) need the MIDI timemap, which this does not calculate:
+     * they are filled in, and hasTimes set, only once something else has done so, such as GetNoteTable or
+     * RenderToTimemap.
+     */
+    const ScoreMetadata &GetScoreMetadata();
     
     // end of Yucong Jiang
     
@@ -900,6 +1105,22 @@ private:
     bool LoadZipData(const std::vector<unsigned char> &bytes);
     void GetClassIds(const std::vector<std::string> &classStrings, std::vector<ClassId> &classIds);
 
+    // Yucong Jiang
+
+    /**
+     * Return the element with the given ID (\@xml:id) anywhere in the document, or NULL if there is none.
+     * Equivalent to m_doc.FindDescendantByID, but looked up in an index that is built by a single traversal
+     * on first use and kept until the document is reloaded, edited or laid out again.
+     */
+    Object *FindElementByID(const std::string &xmlId);
+
+    /**
+     * Discard the ID index and the score metadata. Called wherever the document tree or layout may change.
+     */
+    void InvalidateDocumentCaches();
+
+    // end of Yucong Jiang
+
     /**
      * Return a dictionary of all the options
      *
@@ -926,6 +1147,15 @@ private:
 
     EditorToolkit *m_editorToolkit;
 
+    // Yucong Jiang
+    /** Index of all elements in m_doc by ID, valid only if m_idIndexValid */
+    std::unordered_map<std::string, Object *> m_idIndex;
+    bool m_idIndexValid;
+    /** Summary of m_doc, valid only if m_scoreMetadataValid */
+    ScoreMetadata m_scoreMetadata;
+    bool m_scoreMetadataValid;
+    // end of Yucong Jiang
+
 #ifndef NO_RUNTIME
     /** Measuring runtime */
     RuntimeClock *m_runtimeClock;
@@ -956,8 +956,8 @@ void GenerateTimemapFunctor::AddTimemapEntry(const Object *object)
         startEntry.qstamp = scoreTimeStart;
 
         // Store the element ID in list to turn on at given time - note or rest
-        if (!isRest) startEntry.notesOn.push_back(object->GetID());
-        if (isRest) startEntry.restsOn.push_back(object->GetID());
+        if (!isRest) m_timemap->Append(startEntry.notesOn, object->GetID());
+        if (isRest) m_timemap->Append(startEntry.restsOn, object->GetID());
 
         // Also add the tempo
         startEntry.tempo = m_currentTempo;
@@ -971,8 +971,8 @@ void GenerateTimemapFunctor::AddTimemapEntry(const Object *object)
         endEntry.qstamp = scoreTimeEnd;
 
         // Store the element ID in list to turn off at given time - notes or rest
-        if (!isRest) endEntry.notesOff.push_back(object->GetID());
-        if (isRest) endEntry.restsOff.push_back(object->GetID());
+        if (!isRest) m_timemap->Append(endEntry.notesOff, object->GetID());
+        if (isRest) m_timemap->Append(endEntry.restsOff, object->GetID());
     }
     else if (object->Is(MEASURE)) {
 
@@ -990,7 +990,7 @@ void GenerateTimemapFunctor::AddTimemapEntry(const Object *object)
         startEntry.qstamp = scoreTimeStart;
 
         // Add the measureOn
-        startEntry.measureOn = measure->GetID();
+        startEntry.measureOn = m_timemap->Intern(measure->GetID());
         
         // Yucong Jiang
         const Layer *layer = vrv_cast<const Layer *>(measure->FindDescendantByType(LAYER));
@@ -998,10 +998,10 @@ void GenerateTimemapFunctor::AddTimemapEntry(const Object *object)
             // layer->GetCurrentMeterSig()->GetID()
             auto sig = layer->GetCurrentMeterSig();
             if (!sig->GetSym()) {
-                startEntry.meterSig = std::to_string(measure->GetIndex())+" "+
-                  std::to_string(sig->GetTotalCount())+"/"+std::to_string(sig->GetUnit());
+                startEntry.meterSig = m_timemap->Intern(std::to_string(measure->GetIndex())+" "+
+                  std::to_string(sig->GetTotalCount())+"/"+std::to_string(sig->GetUnit()));
             } else if (sig->GetSym() == METERSIGN_common) {
-                startEntry.meterSig = std::to_string(measure->GetIndex())+" 4/4";
+                startEntry.meterSig = m_timemap->Intern(std::to_string(measure->GetIndex())+" 4/4");
             } else {
                 std::cout<<"Warning: check special time signature!"<<std::endl;
             }
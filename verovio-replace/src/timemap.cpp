@@ -9,11 +9,14 @@
 
 //----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <cassert>
+#include <iomanip>
+#include <limits>
+#include <sstream>
 
 //----------------------------------------------------------------------------
 
-#include "jsonxx.h"
 #include "measure.h"
 #include "note.h"
 #include "rest.h"
@@ -25,6 +28,11 @@ namespace vrv {
 // Timemap
 //----------------------------------------------------------------------------
 
+// Yucong Jiang
+// Size of each arena block; longer strings get a block to themselves
+static const size_t TIMEMAP_ARENA_BLOCK_SIZE = 64 * 1024;
+// end of Yucong Jiang
+
 Timemap::Timemap()
 {
     this->Reset();
@@ -34,45 +42,165 @@ Timemap::~Timemap() {}
 
 void Timemap::Reset()
 {
-    m_map.clear();
+    m_entries.clear();
+    m_nodes.clear();
+    m_arena.clear();
+    m_arenaUsed = TIMEMAP_ARENA_BLOCK_SIZE;
+    m_strings.clear();
+    m_ids.clear();
 }
 
-void Timemap::ToJson(std::string &output, bool includeRests, bool includeMeasures)
+TimemapEntry &Timemap::GetEntry(double time)
+{
+    // Elements are visited measure by measure, so the time is nearly always at or close to the end
+    if (m_entries.empty() || m_entries.back().tstamp < time) {
+        m_entries.push_back(TimemapEntry());
+        m_entries.back().tstamp = time;
+        return m_entries.back();
+    }
+
+    auto iter = std::lower_bound(m_entries.begin(), m_entries.end(), time,
+        [](const TimemapEntry &entry, double t) { return entry.tstamp < t; });
+    if (iter == m_entries.end() || iter->tstamp != time) {
+        iter = m_entries.insert(iter, TimemapEntry());
+        iter->tstamp = time;
+    }
+    return *iter;
+}
+
+TimemapId Timemap::Intern(std::string_view str)
+{
+    auto iter = m_ids.find(str);
+    if (iter != m_ids.end()) return iter->second;
+
+    char *chars = NULL;
+    if (str.size() > TIMEMAP_ARENA_BLOCK_SIZE) {
+        // Give it a block of its own, and start a new block for whatever comes next
+        m_arena.push_back(std::make_unique<char[]>(str.size()));
+        chars = m_arena.back().get();
+        m_arenaUsed = TIMEMAP_ARENA_BLOCK_SIZE;
+    }
+    else {
+        if (m_arena.empty() || m_arenaUsed + str.size() > TIMEMAP_ARENA_BLOCK_SIZE) {
+            m_arena.push_back(std::make_unique<char[]>(TIMEMAP_ARENA_BLOCK_SIZE));
+            m_arenaUsed = 0;
+        }
+        chars = m_arena.back().get() + m_arenaUsed;
+        m_arenaUsed += str.size();
+    }
+    std::copy(str.begin(), str.end(), chars);
+
+    const TimemapId id = TimemapId(m_strings.size());
+    m_strings.push_back(std::string_view(chars, str.size()));
+    m_ids.emplace(m_strings.back(), id);
+    return id;
+}
+
+void Timemap::Append(TimemapIdList &list, std::string_view str)
+{
+    const int node = int(m_nodes.size());
+    m_nodes.push_back({ this->Intern(str), -1 });
+    if (list.tail >= 0) {
+        m_nodes[list.tail].next = node;
+    }
+    else {
+        list.head = node;
+    }
+    list.tail = node;
+}
+
+// Yucong Jiang
+//
+// The JSON is written directly to the stream, without building a document first. The layout is exactly that of
+// jsonxx::Array::json() as used before, so that existing output is reproduced byte for byte:
+// - tab indentation, one value per line, keys in std::map order (so "tstamp" is always the last)
+// - ",\n" after each value except the last in an array or object, which gets " \n"
+// - numbers as long double with digits10 + 1 significant digits
+// - strings escaped as jsonxx::escape_string does
+
+static void WriteJsonString(std::ostream &output, std::string_view str)
+{
+    static const char *hex = "0123456789abcdef";
+
+    output << '"';
+    for (char c : str) {
+        switch (c) {
+            case '"': output << "\\\""; break;
+            case '\\': output << "\\\\"; break;
+            case '/': output << "\\/"; break;
+            case '\b': output << "\\b"; break;
+            case '\f': output << "\\f"; break;
+            case '\n': output << "\\n"; break;
+            case '\r': output << "\\r"; break;
+            case '\t': output << "\\t"; break;
+            default:
+                if ((unsigned char)c < 32) {
+                    output << "\\u00" << hex[(unsigned char)c >> 4] << hex[(unsigned char)c & 0xf];
+                }
+                else {
+                    output << c;
+                }
+        }
+    }
+    output << '"';
+}
+
+static void WriteJsonNumber(std::ostream &output, double value)
+{
+    output << std::setprecision(std::numeric_limits<long double>::digits10 + 1) << (long double)value;
+}
+
+void Timemap::WriteJsonIdList(std::ostream &output, const char *key, const TimemapIdList &list) const
+{
+    output << "\t\t\"" << key << "\": [\n";
+    for (int n = list.head; n >= 0; n = m_nodes[n].next) {
+        output << "\t\t\t";
+        WriteJsonString(output, m_strings[m_nodes[n].id]);
+        output << ((m_nodes[n].next >= 0) ? ",\n" : " \n");
+    }
+    output << "\t\t],\n";
+}
+
+void Timemap::ToJson(std::ostream &output, bool includeRests, bool includeMeasures) const
 {
     double currentTempo = -1000.0;
     double newTempo;
 
-    jsonxx::Array timemap;
+    const std::streamsize precision = output.precision();
 
-    for (auto &[tstamp, entry] : m_map) {
-        jsonxx::Object o;
-        o << "tstamp" << tstamp;
-        o << "qstamp" << entry.qstamp;
+    output << "[\n";
 
-        // on / off
-        if (!entry.notesOn.empty()) {
-            jsonxx::Array notesOn;
-            for (auto note : entry.notesOn) notesOn << note;
-            o << "on" << notesOn;
+    for (auto iter = m_entries.begin(); iter != m_entries.end(); ++iter) {
+        const TimemapEntry &entry = *iter;
+
+        output << "\t{\n";
+
+        // measureOn
+        if (includeMeasures && entry.measureOn != TIMEMAP_ID_NONE) {
+            output << "\t\t\"measureOn\": ";
+            WriteJsonString(output, this->GetString(entry.measureOn));
+            output << ",\n";
         }
-        if (!entry.notesOff.empty()) {
-            jsonxx::Array notesOff;
-            for (auto note : entry.notesOff) notesOff << note;
-            o << "off" << notesOff;
+
+        // meterSig
+        if (entry.meterSig != TIMEMAP_ID_NONE) {
+            output << "\t\t\"meterSig\": ";
+            WriteJsonString(output, this->GetString(entry.meterSig));
+            output << ",\n";
         }
 
+        // on / off
+        if (!entry.notesOff.empty()) this->WriteJsonIdList(output, "off", entry.notesOff);
+        if (!entry.notesOn.empty()) this->WriteJsonIdList(output, "on", entry.notesOn);
+
+        output << "\t\t\"qstamp\": ";
+        WriteJsonNumber(output, entry.qstamp);
+        output << ",\n";
+
         // restsOn / restsOff
         if (includeRests) {
-            if (!entry.restsOn.empty()) {
-                jsonxx::Array restsOn;
-                for (auto rest : entry.restsOn) restsOn << rest;
-                o << "restsOn" << restsOn;
-            }
-            if (!entry.restsOff.empty()) {
-                jsonxx::Array restsOff;
-                for (auto rest : entry.restsOff) restsOff << rest;
-                o << "restsOff" << restsOff;
-            }
+            if (!entry.restsOff.empty()) this->WriteJsonIdList(output, "restsOff", entry.restsOff);
+            if (!entry.restsOn.empty()) this->WriteJsonIdList(output, "restsOn", entry.restsOn);
         }
 
         // tempo
@@ -80,23 +208,31 @@ void Timemap::ToJson(std::string &output, bool includeRests, bool includeMeasure
             newTempo = entry.tempo;
             if (newTempo != currentTempo) {
                 currentTempo = newTempo;
-                o << "tempo" << std::to_string(currentTempo);
+                output << "\t\t\"tempo\": ";
+                WriteJsonString(output, std::to_string(currentTempo));
+                output << ",\n";
             }
         }
 
-        // measureOn
-        if (includeMeasures && !entry.measureOn.empty()) {
-            o << "measureOn" << entry.measureOn;
-        }
-        
-        // Yucong Jiang added
-        if (!entry.meterSig.empty()) {
-            o << "meterSig" << entry.meterSig;
-        }
+        output << "\t\t\"tstamp\": ";
+        WriteJsonNumber(output, entry.tstamp);
+        output << " \n";
 
-        timemap << o;
+        output << ((iter + 1 != m_entries.end()) ? "\t},\n" : "\t} \n");
     }
-    output = timemap.json();
+
+    output << "] \n";
+
+    output.precision(precision);
+}
+
+void Timemap::ToJson(std::string &output, bool includeRests, bool includeMeasures)
+{
+    std::ostringstream stream;
+    this->ToJson(stream, includeRests, includeMeasures);
+    output = stream.str();
 }
 
+// end of Yucong Jiang
+
 } // namespace vrv
@@ -9,7 +9,9 @@
 
 //----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <codecvt>
 #include <locale>
 #include <regex>
@@ -30,16 +32,20 @@
 #include "iopae.h"
 #include "layer.h"
 #include "measure.h"
+#include "metersig.h"
+#include "midifunctor.h"
 #include "nc.h"
 #include "neume.h"
 #include "note.h"
 #include "options.h"
 #include "page.h"
+#include "pages.h"
 #include "runtimeclock.h"
 #include "score.h"
 #include "slur.h"
 #include "staff.h"
 #include "svgdevicecontext.h"
+#include "timemap.h"
 #include "vrv.h"
 
 //----------------------------------------------------------------------------
@@ -58,6 +64,179 @@ const char *UTF_16_BE_BOM = "\xFE\xFF";
 const char *UTF_16_LE_BOM = "\xFF\xFE";
 const char *ZIP_SIGNATURE = "\x50\x4B\x03\x04";
 
+// Yucong Jiang
+
+//----------------------------------------------------------------------------
+// IndexByIDFunctor
+//----------------------------------------------------------------------------
+
+/**
+ * This class collects every object of the tree into a map by ID. Where an ID occurs more than once, the first
+ * object in traversal order is kept, as FindDescendantByID would find it.
+ */
+class IndexByIDFunctor : public ConstFunctor {
+public:
+    IndexByIDFunctor(std::unordered_map<std::string, Object *> &index) : m_index(index) {}
+
+    bool ImplementsEndInterface() const override { return false; }
+
+    FunctorCode VisitObject(const Object *object) override
+    {
+        // The index is handed out by a non-const Toolkit, just as FindDescendantByID on a non-const Doc would be
+        m_index.emplace(object->GetID(), const_cast<Object *>(object));
+        return FUNCTOR_CONTINUE;
+    }
+
+private:
+    std::unordered_map<std::string, Object *> &m_index;
+};
+
+//----------------------------------------------------------------------------
+// GenerateNoteTableFunctor
+//----------------------------------------------------------------------------
+
+/**
+ * This class fills a NoteTable. It visits notes the way GenerateTimemapFunctor does, so that the table holds
+ * the same notes as the "on" lists of the timemap.
+ */
+// Score times are calculated in quarter notes as doubles, from durations that are exact fractions, so rounding to
+// the nearest tick recovers the exact value for any duration the tick resolution can express
+static int64_t ToTicks(double quarters)
+{
+    return std::llround(quarters * SCORE_TICKS_PER_QUARTER);
+}
+
+class GenerateNoteTableFunctor : public ConstFunctor {
+public:
+    GenerateNoteTableFunctor(NoteTable &table, bool cueExclusion, const std::vector<bool> *measures)
+        : m_table(table), m_cueExclusion(cueExclusion), m_measures(measures)
+    {
+    }
+
+    bool ImplementsEndInterface() const override { return false; }
+
+    FunctorCode VisitMeasure(const Measure *measure) override
+    {
+        const size_t position = m_table.measureId.size();
+        m_table.measureId.push_back(measure->GetID());
+        m_table.measureIndexOf.push_back(measure->GetIndex());
+
+        if (m_measures && ((position >= m_measures->size()) || !(*m_measures)[position])) {
+            return FUNCTOR_SIBLINGS;
+        }
+
+        return FUNCTOR_CONTINUE;
+    }
+
+    FunctorCode VisitLayerElement(const LayerElement *layerElement) override
+    {
+        if (layerElement->IsScoreDefElement()) return FUNCTOR_SIBLINGS;
+
+        // Only resolve simple sameas links to avoid infinite recursion
+        const LayerElement *sameas = dynamic_cast<const LayerElement *>(layerElement->GetSameasLink());
+        if (sameas && !sameas->HasSameasLink()) {
+            sameas->Process(*this);
+        }
+
+        return FUNCTOR_CONTINUE;
+    }
+
+    FunctorCode VisitNote(const Note *note) override
+    {
+        if (note->HasGrace()) return FUNCTOR_SIBLINGS;
+
+        if ((note->GetCue() == BOOLEAN_true) && m_cueExclusion) {
+            return FUNCTOR_SIBLINGS;
+        }
+
+        note = dynamic_cast<const Note *>(note->ThisOrSameasLink());
+        assert(note);
+
+        const Measure *measure = vrv_cast<const Measure *>(note->GetFirstAncestor(MEASURE));
+        assert(measure);
+
+        const double tiedDuration = note->GetScoreTimeTiedDuration();
+        const bool tieLeader = (tiedDuration != -1);
+
+        m_table.noteId.push_back(note->GetID());
+        m_table.measureIndex.push_back(measure->GetIndex());
+        m_table.onset.push_back(ToTicks(note->GetScoreTimeOnset()));
+        m_table.duration.push_back(ToTicks(note->GetScoreTimeDuration()));
+        m_table.tiedDuration.push_back(tieLeader ? ToTicks(tiedDuration) : 0);
+        m_table.pitch.push_back(note->GetMIDIPitch());
+        m_table.tieLeader.push_back(tieLeader);
+
+        return FUNCTOR_SIBLINGS;
+    }
+
+private:
+    NoteTable &m_table;
+    bool m_cueExclusion;
+    const std::vector<bool> *m_measures;
+};
+
+class GenerateScoreMetadataFunctor : public ConstFunctor {
+public:
+    GenerateScoreMetadataFunctor(ScoreMetadata &metadata, bool withTimes)
+        : m_metadata(metadata), m_withTimes(withTimes), m_inPickup(false)
+    {
+    }
+
+    bool ImplementsEndInterface() const override { return false; }
+
+    FunctorCode VisitMeasure(const Measure *measure) override
+    {
+        const bool first = (m_metadata.measureCount == 0);
+        ++m_metadata.measureCount;
+
+        if (first) {
+            m_metadata.hasPickup = (measure->GetMetcon() == BOOLEAN_false);
+        }
+        m_inPickup = first && m_metadata.hasPickup;
+
+        // As for the meterSig of the timemap
+        Rational meter(0, 1);
+        const Layer *layer = vrv_cast<const Layer *>(measure->FindDescendantByType(LAYER));
+        if (layer && layer->GetCurrentMeterSig()) {
+            const MeterSig *sig = layer->GetCurrentMeterSig();
+            if (!sig->GetSym()) {
+                meter = Rational(sig->GetTotalCount(), sig->GetUnit());
+            }
+            else if (sig->GetSym() == METERSIGN_common) {
+                meter = Rational(4, 4);
+            }
+        }
+        m_metadata.meters.push_back(meter);
+
+        if (m_withTimes) {
+            const double tempo = measure->GetCurrentTempo();
+            if (m_metadata.tempoChanges.empty() || (m_metadata.tempoChanges.back().bpm != tempo)) {
+                m_metadata.tempoChanges.push_back({ measure->GetIndex(), tempo });
+            }
+        }
+
+        return FUNCTOR_CONTINUE;
+    }
+
+    FunctorCode VisitNote(const Note *note) override
+    {
+        ++m_metadata.noteCount;
+
+        if (m_inPickup && m_withTimes) {
+            m_metadata.pickupLength = std::max(m_metadata.pickupLength, ToTicks(note->GetScoreTimeOffset()));
+        }
+
+        return FUNCTOR_CONTINUE;
+    }
+
+private:
+    ScoreMetadata &m_metadata;
+    bool m_withTimes;
+    bool m_inPickup;
+};
+
+// end of Yucong Jiang
+
 //----------------------------------------------------------------------------
 // Toolkit
 //----------------------------------------------------------------------------
@@ -81,6 +260,11 @@ Toolkit::Toolkit(bool initFont)
 
     m_editorToolkit = NULL;
 
+    // Yucong Jiang
+    m_idIndexValid = false;
+    m_scoreMetadataValid = false;
+    // end of Yucong Jiang
+
 #ifndef NO_RUNTIME
     m_runtimeClock = NULL;
 #endif
@@ -468,6 +652,10 @@ bool Toolkit::LoadData(const std::string &data)
     std::string newData;
     Input *input = NULL;
 
+    // Yucong Jiang
+    this->InvalidateDocumentCaches();
+    // end of Yucong Jiang
+
     m_doc.m_expansionMap.Reset();
 
     if (m_options->m_xmlIdChecksum.GetValue()) {
@@ -893,6 +1081,10 @@ std::string Toolkit::ValidatePAEFile(const std::string &filename)
 
 std::string Toolkit::ValidatePAE(const std::string &data)
 {
+    // Yucong Jiang
+    this->InvalidateDocumentCaches();
+    // end of Yucong Jiang
+
     PAEInput input(&m_doc);
     input.Import(data);
     m_doc.Reset();
@@ -1265,14 +1457,10 @@ std::string Toolkit::GetElementAttr(const std::string &xmlId)
 
     const Object *element = NULL;
 
-    // Try to get the element on the current drawing page - it is usually the case and fast
-    if (m_doc.GetDrawingPage()) {
-        element = m_doc.GetDrawingPage()->FindDescendantByID(xmlId);
-    }
-    // If it wasn't there, try on the whole doc
-    if (!element) {
-        element = m_doc.FindDescendantByID(xmlId);
-    }
+    // Yucong Jiang
+    // Look it up in the ID index, which covers the whole doc (including the current drawing page)
+    element = this->FindElementByID(xmlId);
+    // end of Yucong Jiang
     // If not found again, try looking in the layer staffdefs
     if (!element) {
         FindElementInLayerStaffDefFunctor findElementInLayerStaffDef(xmlId);
@@ -1292,7 +1480,7 @@ std::string Toolkit::GetElementAttr(const std::string &xmlId)
             const LinkingInterface *link = element->GetLinkingInterface();
             if (link && link->HasCorresp()) {
                 const std::string correspId = ExtractIDFragment(link->GetCorresp());
-                Object *origin = m_doc.FindDescendantByID(correspId);
+                Object *origin = this->FindElementByID(correspId);
                 // if no original element was found, try searching through scoredef in score (only for certain elements)
                 if (!origin && element->Is({ CLEF, GRPSYM, KEYSIG, MENSUR, METERSIG, METERSIGGRP })) {
                     Page *page = vrv_cast<Page *>(m_doc.FindDescendantByType(PAGE));
@@ -1351,6 +1539,10 @@ bool Toolkit::Edit(const std::string &editorAction)
 {
     this->ResetLogBuffer();
 
+    // Yucong Jiang
+    this->InvalidateDocumentCaches();
+    // end of Yucong Jiang
+
     return m_editorToolkit->ParseEditorAction(editorAction);
 }
 
@@ -1407,6 +1599,10 @@ void Toolkit::RedoLayout(const std::string &jsonOptions)
         return;
     }
 
+    // Yucong Jiang
+    this->InvalidateDocumentCaches();
+    // end of Yucong Jiang
+
     if (m_docSelection.m_isPending) {
         m_doc.InitSelectionDoc(m_docSelection, resetCache);
     }
@@ -1649,10 +1845,11 @@ bool Toolkit::RenderToPAEFile(const std::string &filename)
     return true;
 }
 
-std::string Toolkit::RenderToTimemap(const std::string &jsonOptions)
+// Yucong Jiang
+static void ReadTimemapOptions(const std::string &jsonOptions, bool &includeRests, bool &includeMeasures)
 {
-    bool includeMeasures = false;
-    bool includeRests = false;
+    includeMeasures = false;
+    includeRests = false;
 
     jsonxx::Object json;
 
@@ -1667,6 +1864,15 @@ std::string Toolkit::RenderToTimemap(const std::string &jsonOptions)
             if (json.has<jsonxx::Boolean>("includeRests")) includeRests = json.get<jsonxx::Boolean>("includeRests");
         }
     }
+}
+// end of Yucong Jiang
+
+std::string Toolkit::RenderToTimemap(const std::string &jsonOptions)
+{
+    bool includeMeasures = false;
+    bool includeRests = false;
+
+    ReadTimemapOptions(jsonOptions, includeRests, includeMeasures);
 
     this->ResetLogBuffer();
 
@@ -1762,16 +1968,58 @@ bool Toolkit::RenderToMIDIFile(const std::string &filename)
 
 bool Toolkit::RenderToTimemapFile(const std::string &filename, const std::string &jsonOptions)
 {
-    std::string outputString = this->RenderToTimemap(jsonOptions);
+    // Yucong Jiang
+    // Stream the timemap to the file rather than building the whole JSON string first
+    Timemap timemap;
+    return this->RenderToTimemapFile(filename, jsonOptions, timemap);
+    // end of Yucong Jiang
+}
+
+// Yucong Jiang
+bool Toolkit::RenderToTimemapFile(const std::string &filename, const std::string &jsonOptions, Timemap &timemap)
+{
+    bool includeMeasures = false;
+    bool includeRests = false;
+
+    ReadTimemapOptions(jsonOptions, includeRests, includeMeasures);
+
+    this->ResetLogBuffer();
+
+    if (!this->GenerateTimemap(timemap)) {
+        return false;
+    }
 
     std::ofstream output(filename.c_str());
     if (!output.is_open()) {
         return false;
     }
-    output << outputString;
+    timemap.ToJson(output, includeRests, includeMeasures);
+    output.close();
+
+    return !output.fail();
+}
+
+bool Toolkit::GenerateTimemap(Timemap &timemap)
+{
+    timemap.Reset();
+
+    // As Doc::ExportTimemap, but keeping the timemap
+    if (!m_doc.HasTimemap()) {
+        // generate MIDI timemap before progressing
+        m_doc.CalculateTimemap();
+    }
+    if (!m_doc.HasTimemap()) {
+        LogWarning("Calculation of MIDI timemap failed, not exporting timemap.");
+        return false;
+    }
+
+    GenerateTimemapFunctor generateTimemap(&timemap);
+    generateTimemap.SetCueExclusion(m_options->m_midiNoCue.GetValue());
+    m_doc.Process(generateTimemap);
 
     return true;
 }
+// end of Yucong Jiang
 
 bool Toolkit::RenderToExpansionMapFile(const std::string &filename)
 {
@@ -1801,7 +2049,7 @@ std::string Toolkit::GetDescriptiveFeatures(const std::string &options)
 
 int Toolkit::GetPageWithElement(const std::string &xmlId)
 {
-    Object *element = m_doc.FindDescendantByID(xmlId);
+    Object *element = this->FindElementByID(xmlId);
     if (!element) {
         LogWarning("Element '%s' not found", xmlId.c_str());
         return 0;
@@ -1817,7 +2065,7 @@ int Toolkit::GetTimeForElement(const std::string &xmlId)
 {
     this->ResetLogBuffer();
 
-    Object *element = m_doc.FindDescendantByID(xmlId);
+    Object *element = this->FindElementByID(xmlId);
 
     if (!element) {
         LogWarning("Element '%s' not found", xmlId.c_str());
@@ -1865,7 +2113,7 @@ std::string Toolkit::GetTimesForElement(const std::string &xmlId)
 {
     this->ResetLogBuffer();
 
-    Object *element = m_doc.FindDescendantByID(xmlId);
+    Object *element = this->FindElementByID(xmlId);
     jsonxx::Object o;
 
     if (!element) {
@@ -1919,7 +2167,7 @@ std::string Toolkit::GetMIDIValuesForElement(const std::string &xmlId)
 {
     this->ResetLogBuffer();
 
-    Object *element = m_doc.FindDescendantByID(xmlId);
+    Object *element = this->FindElementByID(xmlId);
     jsonxx::Object o;
 
     if (!element) {
@@ -1951,22 +2199,7 @@ std::string Toolkit::GetMIDIValuesForElement(const std::string &xmlId)
 // Yucong Jiang
 
 bool Toolkit::HasPickupMeasure() {
-    jsonxx::Object elements;
-    elements.parse(GetElementsAtTime(0)); // beginning measure
-    if (elements.has<jsonxx::String>("measure")) {
-        std::string measureID = elements.get<jsonxx::String>("measure");
-        jsonxx::Object attributes;
-        attributes.parse(GetElementAttr(measureID));
-        if (attributes.has<jsonxx::String>("metcon")) {
-            if (attributes.get<jsonxx::String>("metcon") == "false") {
-                return true; // has pickup measure
-            }
-        } else {
-            return false; // no pickup measure
-        }
-    }
-
-    return false;
+    return this->GetScoreMetadata().hasPickup;
 }
 
 
@@ -2019,7 +2252,7 @@ Fraction Toolkit::GetCumulativeFraction(int measure, Fraction pos, const std::ve
 
 int Toolkit::GetMeasureIndexForNote(const std::string &xmlId)
 {
-    Object *element = m_doc.FindDescendantByID(xmlId);
+    Object *element = this->FindElementByID(xmlId);
 
     if (!element) {
         LogWarning("Element '%s' not found", xmlId.c_str());
@@ -2041,7 +2274,7 @@ int Toolkit::GetMeasureIndexForNote(const std::string &xmlId)
 
 std::string Toolkit::GetTiedPartnerForNote(const std::string &xmlId)
 {
-    Object *element = m_doc.FindDescendantByID(xmlId);
+    Object *element = this->FindElementByID(xmlId);
 
     if (!element) {
         LogWarning("Element '%s' not found", xmlId.c_str());
@@ -2066,6 +2299,89 @@ std::string Toolkit::GetTiedPartnerForNote(const std::string &xmlId)
     return "";
 }
 
+Object *Toolkit::FindElementByID(const std::string &xmlId)
+{
+    if (!m_idIndexValid) {
+        m_idIndex.clear();
+        IndexByIDFunctor indexByID(m_idIndex);
+        m_doc.Process(indexByID, UNLIMITED_DEPTH, true);
+        m_idIndexValid = true;
+    }
+
+    auto iter = m_idIndex.find(xmlId);
+    if (iter == m_idIndex.end()) {
+        return NULL;
+    }
+    return iter->second;
+}
+
+bool Toolkit::GetNoteTable(NoteTable &table, const std::vector<bool> *measures)
+{
+    this->ResetLogBuffer();
+
+    table.clear();
+
+    if (!m_doc.HasTimemap()) {
+        // generate MIDI timemap before progressing
+        m_doc.CalculateTimemap();
+    }
+    if (!m_doc.HasTimemap()) {
+        LogWarning("Calculation of MIDI timemap failed, time value is invalid.");
+        return false;
+    }
+
+    GenerateNoteTableFunctor generateNoteTable(table, m_options->m_midiNoCue.GetValue(), measures);
+    m_doc.Process(generateNoteTable);
+
+    return true;
+}
+
+std::vector<std::string> Toolkit::GetMeasureIDsOnPage(int pageNo)
+{
+    std::vector<std::string> ids;
+
+    Pages *pages = m_doc.GetPages();
+    if (!pages || (pageNo < 1) || (pageNo > pages->GetChildCount())) {
+        return ids;
+    }
+
+    Object *page = pages->GetChild(pageNo - 1);
+    assert(page);
+
+    ListOfObjects measures = page->FindAllDescendantsByType(MEASURE, false);
+    for (Object *measure : measures) {
+        ids.push_back(measure->GetID());
+    }
+
+    return ids;
+}
+
+const ScoreMetadata &Toolkit::GetScoreMetadata()
+{
+    const bool withTimes = m_doc.HasTimemap();
+
+    // Gather again if the timemap has been calculated since
+    if (m_scoreMetadataValid && (m_scoreMetadata.hasTimes || !withTimes)) {
+        return m_scoreMetadata;
+    }
+
+    m_scoreMetadata = ScoreMetadata();
+    GenerateScoreMetadataFunctor generateScoreMetadata(m_scoreMetadata, withTimes);
+    m_doc.Process(generateScoreMetadata);
+    m_scoreMetadata.hasTimes = withTimes;
+    m_scoreMetadata.pageCount = m_doc.GetPageCount();
+
+    m_scoreMetadataValid = true;
+    return m_scoreMetadata;
+}
+
+void Toolkit::InvalidateDocumentCaches()
+{
+    m_idIndex.clear();
+    m_idIndexValid = false;
+    m_scoreMetadataValid = false;
+}
+
 // end of Yucong Jiang
 
 